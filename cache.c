@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+/* ##################################################################################### */
+
+/* Bump CACHE_VERSION whenever the bytecode or the layout below changes,
+    so old cache files get recompiled instead of misread. */
+#define CACHE_MAGIC   0x434c5843u       /* "CLXC" */
+#define CACHE_VERSION 1
+
+/* The layout, integers in host byte order so a file from another kind
+    of machine simply fails the magic check:
+
+    header    magic, version, mode (1 for register code), the length
+              of the source and its 64-bit hash
+    globals   count, then every global name in slot order. The code
+              refers to globals by slot, so loading has to give each
+              name the same slot again.
+    function  arity, reg_count, name (a flag byte, then the string),
+              code, line runs and constants. A constant is a tag byte
+              followed by a number, a string or a nested function.
+
+    A string is its length followed by its characters. */
+
+typedef enum {
+    CONST_NUMBER,
+    CONST_STRING,
+    CONST_FUNCTION,
+}   Const_t;
+
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool failed;
+}   Reader;
+
+/* ##################################################################################### */
+
+/* 64-bit FNV-1a, same scheme as hash_string (). */
+static uint64_t hash_source (const char *source, size_t len) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+/* ##################################################################################### */
+
+static char *cache_path (const char *path, const char *suffix) {
+    size_t len = strlen (path);
+    char *cpath = (char *) malloc (len + strlen (suffix) + 1);
+    if (cpath == NULL) return NULL;
+    memcpy (cpath, path, len);
+    strcpy (cpath + len, suffix);
+    return cpath;
+}
+
+/* ##################################################################################### */
+
+static void write_int (FILE *f, int32_t n) {
+    fwrite (&n, sizeof (n), 1, f);
+}
+
+static void write_string (FILE *f, ObjString *string) {
+    write_int (f, string->len);
+    fwrite (string->chars, 1, string->len, f);
+}
+
+/* ##################################################################################### */
+
+/* The cache holds bytecode only, so the functions skimmed in FUNCTION
+    are compiled while the source is still around. That has to happen
+    before the globals are written, as their bodies may name globals
+    the script itself does not. */
+static bool compile_skimmed (VM *vm, ObjFunction *function) {
+    if (function->source != NULL && !compile_lazy (vm, function)) return false;
+    for (int i = 0; i < function->c.constants.count; i++) {
+        Value val = function->c.constants.values[i];
+        if (IS_FUNCTION(val) && !compile_skimmed (vm, AS_FUNCTION(val))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ##################################################################################### */
+
+static bool write_function (VM *vm, FILE *f, ObjFunction *function) {
+    Chunk *c = &function->c;
+    write_int (f, function->arity);
+    write_int (f, function->reg_count);
+    fputc (function->name != NULL, f);
+    if (function->name != NULL) write_string (f, function->name);
+
+    write_int (f, c->count);
+    fwrite (c->code, 1, c->count, f);
+    write_int (f, c->line_count);
+    for (int i = 0; i < c->line_count; i++) {
+        write_int (f, c->lines[i].start);
+        write_int (f, c->lines[i].line);
+    }
+
+    write_int (f, c->constants.count);
+    for (int i = 0; i < c->constants.count; i++) {
+        Value val = c->constants.values[i];
+        if (IS_NUMBER(val)) {
+            double num = AS_NUMBER(val);
+            fputc (CONST_NUMBER, f);
+            fwrite (&num, sizeof (num), 1, f);
+        } else if (IS_STRING(val)) {
+            fputc (CONST_STRING, f);
+            write_string (f, AS_STRING(val));
+        } else if (IS_FUNCTION(val)) {
+            fputc (CONST_FUNCTION, f);
+            if (!write_function (vm, f, AS_FUNCTION(val))) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Writes the compiled SCRIPT to the cache file of PATH. It is written
+    to a temporary file first so no reader ever sees half a cache. */
+bool save_cache (VM *vm, const char *path, const char *source, size_t len,
+                 ObjFunction *script) {
+    if (!compile_skimmed (vm, script)) return false;
+
+    char *cpath = cache_path (path, "c");
+    char *tmp_path = cache_path (path, "c.tmp");
+    FILE *f = cpath != NULL && tmp_path != NULL ? fopen (tmp_path, "wb") : NULL;
+    if (f == NULL) {
+        free (cpath);
+        free (tmp_path);
+        return false;
+    }
+
+    uint64_t hash = hash_source (source, len);
+    write_int (f, (int32_t) CACHE_MAGIC);
+    write_int (f, CACHE_VERSION);
+    write_int (f, vm->register_mode);
+    write_int (f, (int32_t) len);
+    fwrite (&hash, sizeof (hash), 1, f);
+
+    write_int (f, vm->global_count);
+    for (int i = 0; i < vm->global_count; i++) {
+        write_string (f, vm->globals[i].name);
+    }
+    bool ok = write_function (vm, f, script);
+
+    ok = !ferror (f) && ok;
+    ok = fclose (f) == 0 && ok;
+    ok = ok && rename (tmp_path, cpath) == 0;
+    if (!ok) remove (tmp_path);
+    free (cpath);
+    free (tmp_path);
+    return ok;
+}
+
+/* ##################################################################################### */
+
+static void read_bytes (Reader *r, void *dest, size_t len) {
+    if (r->failed || (size_t) (r->end - r->p) < len) {
+        r->failed = true;
+        return;
+    }
+    memcpy (dest, r->p, len);
+    r->p += len;
+}
+
+static int32_t read_int (Reader *r) {
+    int32_t n = 0;
+    read_bytes (r, &n, sizeof (n));
+    return n;
+}
+
+/* Reads a count of things LEN bytes each, making sure they are there. */
+static int read_count (Reader *r, size_t len) {
+    int32_t count = read_int (r);
+    if (count < 0 || (size_t) (r->end - r->p) / len < (size_t) count) {
+        r->failed = true;
+    }
+    return r->failed ? 0 : count;
+}
+
+static ObjString *read_string (VM *vm, Reader *r) {
+    int len = read_count (r, 1);
+    if (r->failed) return NULL;
+    ObjString *string = copy_string (vm, (const char *) r->p, len);
+    r->p += len;
+    return string;
+}
+
+/* ##################################################################################### */
+
+/* The operands of an instruction that point outside of it, each -1
+    if it has none. */
+typedef struct {
+    int constant;
+    int global;
+    int target;             /* Offset a jump lands on. */
+}   Operands;
+
+#define SHORT_AT(c, at) (((c)->code[at] << 8) | (c)->code[(at) + 1])
+#define LONG_AT(c, at) \
+    (((c)->code[at] << 16) | ((c)->code[(at) + 1] << 8) | (c)->code[(at) + 2])
+
+static Operands stack_operands (Chunk *c, int offset) {
+    Operands ops = {-1, -1, -1};
+    switch (c->code[offset]) {
+        case OP_CONSTANT:
+            ops.constant = c->code[offset + 1];
+            break;
+        case OP_CONSTANT_LONG:
+            ops.constant = LONG_AT(c, offset + 1);
+            break;
+        case OP_GET_LOCAL_ADD_CONST:
+        case OP_GET_LOCAL_SUB_CONST:
+            ops.constant = c->code[offset + 2];
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            ops.global = SHORT_AT(c, offset + 1);
+            break;
+        case OP_JMP:
+        case OP_JMP_IF_FALSE:
+        case OP_EQUAL_JMP_IF_FALSE:
+        case OP_NOT_EQUAL_JMP_IF_FALSE:
+        case OP_GREATER_JMP_IF_FALSE:
+        case OP_GREATER_EQUAL_JMP_IF_FALSE:
+        case OP_LESS_JMP_IF_FALSE:
+        case OP_LESS_EQUAL_JMP_IF_FALSE:
+            ops.target = offset + 3 + SHORT_AT(c, offset + 1);
+            break;
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+            ops.target = offset + 3 - SHORT_AT(c, offset + 1);
+            break;
+        default:
+            break;
+    }
+    return ops;
+}
+
+static Operands reg_operands (Chunk *c, int offset) {
+    Operands ops = {-1, -1, -1};
+    switch (c->code[offset]) {
+        case ROP_CONSTANT:
+            ops.constant = c->code[offset + 2];
+            break;
+        case ROP_CONSTANT_LONG:
+            ops.constant = LONG_AT(c, offset + 2);
+            break;
+        case ROP_ADD_CONST:
+        case ROP_SUB_CONST:
+            ops.constant = c->code[offset + 3];
+            break;
+        case ROP_DEFINE_GLOBAL:
+        case ROP_GET_GLOBAL:
+        case ROP_SET_GLOBAL:
+            ops.global = SHORT_AT(c, offset + 2);
+            break;
+        case ROP_JMP:
+            ops.target = offset + 3 + SHORT_AT(c, offset + 1);
+            break;
+        case ROP_LOOP:
+            ops.target = offset + 3 - SHORT_AT(c, offset + 1);
+            break;
+        case ROP_JMP_IF_FALSE:
+            ops.target = offset + 4 + SHORT_AT(c, offset + 2);
+            break;
+        case ROP_EQUAL_JMP_IF_FALSE:
+        case ROP_NOT_EQUAL_JMP_IF_FALSE:
+        case ROP_GREATER_JMP_IF_FALSE:
+        case ROP_GREATER_EQUAL_JMP_IF_FALSE:
+        case ROP_LESS_JMP_IF_FALSE:
+        case ROP_LESS_EQUAL_JMP_IF_FALSE:
+            ops.target = offset + 5 + SHORT_AT(c, offset + 3);
+            break;
+        default:
+            break;
+    }
+    return ops;
+}
+
+#undef SHORT_AT
+#undef LONG_AT
+
+/* Checks that the code of C only has known opcodes, that no instruction
+    runs past the end, and that every operand stays inside what it
+    refers to: the constants of C, the GLOBAL_COUNT globals of the cache
+    file, and the instructions of C for jumps. run () trusts all of
+    these, so a damaged cache file has to fail here. */
+static bool check_code (Chunk *c, bool registers, int global_count) {
+    bool *starts = ALLOCATE(bool, c->count + 1);
+    memset (starts, 0, c->count + 1);
+    bool ok = true;
+    for (int offset = 0; offset < c->count && ok;) {
+        uint8_t op = c->code[offset];
+        int len = registers ? reg_instruction_len (op) : instruction_len (op);
+        starts[offset] = true;
+        ok = op <= (registers ? ROP_RETURN : OP_LOOP_TRACE) &&
+             offset + len <= c->count;
+        offset += len;
+    }
+
+    for (int offset = 0; offset < c->count && ok;) {
+        uint8_t op = c->code[offset];
+        Operands ops = registers ? reg_operands (c, offset)
+                                 : stack_operands (c, offset);
+        ok = ops.constant < c->constants.count && ops.global < global_count &&
+             (ops.target == -1 ||
+              (ops.target >= 0 && ops.target < c->count && starts[ops.target]));
+        offset += registers ? reg_instruction_len (op) : instruction_len (op);
+    }
+    FREE_ARRAY(bool, starts, c->count + 1);
+    return ok;
+}
+
+/* Checks that the line runs of C cover its code: at least one run for
+    any code, each starting inside the code after the run before it,
+    and no negative lines. get_line () relies on that. */
+static bool check_lines (Chunk *c) {
+    if (c->count > 0 && c->line_count == 0) return false;
+    for (int i = 0; i < c->line_count; i++) {
+        LineStart *run = &c->lines[i];
+        if (run->start < 0 || run->start >= c->count || run->line < 0 ||
+            (i > 0 && run->start <= run[-1].start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Checks the frame layout of FUNCTION. call () checks the arity of
+    every call against it, and register code reserves reg_count slots
+    of the UINT8_COUNT a frame has, counting the callee and arguments.
+    Stack code never has registers. */
+static bool check_frame (VM *vm, ObjFunction *function) {
+    if (function->arity < 0 || function->arity > UINT8_MAX) return false;
+    if (!vm->register_mode) return function->reg_count == 0;
+    return function->reg_count > function->arity &&
+           function->reg_count <= UINT8_COUNT;
+}
+
+/* ##################################################################################### */
+
+/* The function is a root while it is read, as reading its strings and
+    nested functions may collect garbage. */
+static ObjFunction *read_function (VM *vm, Reader *r, int global_count) {
+    ObjFunction *function = new_function (vm);
+    add_root (vm, OBJ_VAL(function));
+    Chunk *c = &function->c;
+    function->arity = read_int (r);
+    function->reg_count = read_int (r);
+    uint8_t has_name = 0;
+    read_bytes (r, &has_name, 1);
+    if (has_name) {
+        function->name = read_string (vm, r);
+        if (function->name != NULL) {
+            write_barrier (vm, (Obj *) function, OBJ_VAL(function->name));
+        }
+    }
+
+    int count = read_count (r, 1);
+    c->code = ALLOCATE(uint8_t, count);
+    c->capacity = count;
+    read_bytes (r, c->code, count);
+    c->count = count;
+
+    int line_count = read_count (r, 2 * sizeof (int32_t));
+    c->lines = ALLOCATE(LineStart, line_count);
+    c->line_capacity = line_count;
+    for (int i = 0; i < line_count; i++) {
+        c->lines[i].start = read_int (r);
+        c->lines[i].line = read_int (r);
+    }
+    c->line_count = line_count;
+
+    int constant_count = read_count (r, 1);
+    for (int i = 0; i < constant_count && !r->failed; i++) {
+        uint8_t tag = 0;
+        read_bytes (r, &tag, 1);
+        if (tag == CONST_NUMBER) {
+            double num = 0;
+            read_bytes (r, &num, sizeof (num));
+            write_value_array (&c->constants, NUMBER_VAL(num));
+        } else if (tag == CONST_STRING) {
+            ObjString *string = read_string (vm, r);
+            if (string != NULL) {
+                write_value_array (&c->constants, OBJ_VAL(string));
+                write_barrier (vm, (Obj *) function, OBJ_VAL(string));
+            }
+        } else if (tag == CONST_FUNCTION) {
+            ObjFunction *nested = read_function (vm, r, global_count);
+            write_value_array (&c->constants, OBJ_VAL(nested));
+        } else {
+            r->failed = true;
+        }
+    }
+    if (!r->failed && (!check_frame (vm, function) || !check_lines (c) ||
+                       !check_code (c, vm->register_mode, global_count))) {
+        r->failed = true;
+    }
+    remove_root (vm, OBJ_VAL(function));
+    return function;
+}
+
+/* ##################################################################################### */
+
+/* Loads the compiled script for PATH from its cache file. Returns NULL
+    if there is no cache file or it was not made from SOURCE by this
+    version of clox in the current mode. */
+ObjFunction *load_cache (VM *vm, const char *path, const char *source, 
+                         size_t len) {
+    char *cpath = cache_path (path, "c");
+    FILE *f = cpath != NULL ? fopen (cpath, "rb") : NULL;
+    free (cpath);
+    if (f == NULL) return NULL;
+
+    fseek (f, 0L, SEEK_END);
+    long fsize = ftell (f);
+    rewind (f);
+    uint8_t *buf = fsize > 0 ? (uint8_t *) malloc (fsize) : NULL;
+    if (buf == NULL || fread (buf, 1, fsize, f) < (size_t) fsize) {
+        free (buf);
+        fclose (f);
+        return NULL;
+    }
+    fclose (f);
+
+    Reader r = {buf, buf + fsize, false};
+    uint32_t magic = (uint32_t) read_int (&r);
+    int32_t version = read_int (&r);
+    int32_t mode = read_int (&r);
+    int32_t source_len = read_int (&r);
+    uint64_t hash = 0;
+    read_bytes (&r, &hash, sizeof (hash));
+    if (r.failed || magic != CACHE_MAGIC || version != CACHE_VERSION ||
+        mode != vm->register_mode || (size_t) source_len != len ||
+        hash != hash_source (source, len)) {
+        free (buf);
+        return NULL;
+    }
+
+    int global_count = read_count (&r, sizeof (int32_t));
+    for (int i = 0; i < global_count && !r.failed; i++) {
+        ObjString *name = read_string (vm, &r);
+        if (name != NULL && global_slot (vm, name) != i) r.failed = true;
+    }
+    ObjFunction *script = r.failed ? NULL : read_function (vm, &r, global_count);
+    if (r.failed || r.p != r.end) script = NULL;
+
+    free (buf);
+    return script;
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+/* ##################################################################################### */
+
+/* Compiled scripts can be kept in a cache file next to their source,
+    PATH with a 'c' appended, and loaded from there instead of being
+    compiled again as long as the source is unchanged. */
+ObjFunction *load_cache (VM *vm, const char *path, const char *source, 
+                         size_t len);
+bool save_cache (VM *vm, const char *path, const char *source, size_t len,
+                 ObjFunction *script);
+
+#endif
\ No newline at end of file
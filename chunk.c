@@ -9,8 +9,10 @@
 void init_chunk (Chunk *c) {
     c->capacity = 0;
     c->count = 0;
-    c->lines = NULL;
     c->code = NULL;
+    c->line_count = 0;
+    c->line_capacity = 0;
+    c->lines = NULL;
     init_value_array (&c->constants);
 }
 
@@ -18,7 +20,7 @@ void init_chunk (Chunk *c) {
 
 void free_chunk (Chunk *c) {
     FREE_ARRAY(uint8_t, c->code, c->capacity);
-    FREE_ARRAY(int, c->lines, c->capacity);
+    FREE_ARRAY(LineStart, c->lines, c->line_capacity);
     free_value_array (&c->constants);
     /* "Init" the Chunk again to zero out the contents. */
     init_chunk (c);
@@ -34,12 +36,47 @@ void write_chunk (Chunk *c, uint8_t byte, int line) {
         c->capacity = GROW_CAPACITY(old_capacity);
         c->code = GROW_ARRAY(uint8_t, c->code, 
             old_capacity, c->capacity);
-        c->lines = GROW_ARRAY(int, c->lines, old_capacity, 
-            c->capacity);
     }
     c->code[c->count] = byte;
-    c->lines[c->count] = line;
     c->count++;
+
+    /* Only a change of line starts a new run. */
+    if (c->line_count > 0 && c->lines[c->line_count - 1].line == line) return;
+
+    if (c->line_count == c->line_capacity) {
+        int old_capacity = c->line_capacity;
+        c->line_capacity = GROW_CAPACITY(old_capacity);
+        c->lines = GROW_ARRAY(LineStart, c->lines, 
+            old_capacity, c->line_capacity);
+    }
+    LineStart *run = &c->lines[c->line_count++];
+    run->start = c->count - 1;
+    run->line = line;
+}
+
+/* ##################################################################################### */
+
+/* Drops the code from COUNT on, along with its line runs. */
+void truncate_chunk (Chunk *c, int count) {
+    c->count = count;
+    while (c->line_count > 0 && c->lines[c->line_count - 1].start >= count) {
+        c->line_count--;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Returns the line the byte at OFFSET was compiled from. Only errors
+    and the disassembler ask, so a binary search over the runs is fine. */
+int get_line (Chunk *c, int offset) {
+    int low = 0;
+    int high = c->line_count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (c->lines[mid].start <= offset) low = mid;
+        else high = mid - 1;
+    }
+    return c->lines[low].line;
 }
 
 /* ##################################################################################### */
@@ -49,4 +86,72 @@ void write_chunk (Chunk *c, uint8_t byte, int line) {
 int add_constant (Chunk *c, Value val) {
     write_value_array (&c->constants, val);
     return c->constants.count - 1;
+}
+
+/* ##################################################################################### */
+
+/* Returns the size in bytes of an instruction with opcode OP, 
+    including its operands. */
+int instruction_len (uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JMP:
+        case OP_JMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+        case OP_EQUAL_JMP_IF_FALSE:
+        case OP_NOT_EQUAL_JMP_IF_FALSE:
+        case OP_GREATER_JMP_IF_FALSE:
+        case OP_GREATER_EQUAL_JMP_IF_FALSE:
+        case OP_LESS_JMP_IF_FALSE:
+        case OP_LESS_EQUAL_JMP_IF_FALSE:
+        case OP_GET_LOCAL_ADD_CONST:
+        case OP_GET_LOCAL_SUB_CONST:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Same as instruction_len () for register code. */
+int reg_instruction_len (uint8_t op) {
+    switch (op) {
+        case ROP_NIL:
+        case ROP_TRUE:
+        case ROP_FALSE:
+        case ROP_PRINT:
+        case ROP_RETURN:
+            return 2;
+        case ROP_MOVE:
+        case ROP_CONSTANT:
+        case ROP_NEGATE:
+        case ROP_NOT:
+        case ROP_JMP:
+        case ROP_LOOP:
+        case ROP_CALL:
+        case ROP_TAIL_CALL:
+            return 3;
+        case ROP_EQUAL_JMP_IF_FALSE:
+        case ROP_NOT_EQUAL_JMP_IF_FALSE:
+        case ROP_GREATER_JMP_IF_FALSE:
+        case ROP_GREATER_EQUAL_JMP_IF_FALSE:
+        case ROP_LESS_JMP_IF_FALSE:
+        case ROP_LESS_EQUAL_JMP_IF_FALSE:
+        case ROP_CONSTANT_LONG:
+            return 5;
+        default:
+            return 4;
+    }
 }
\ No newline at end of file
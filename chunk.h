@@ -8,6 +8,7 @@
 
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,   /* 24-bit constant index, for big pools. */
     OP_NIL, 
     OP_TRUE,
     OP_FALSE,
@@ -19,8 +20,11 @@ typedef enum {
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -31,16 +35,100 @@ typedef enum {
     OP_JMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_RETURN,
+    /* Superinstructions, emitted by the compiler in place of common 
+        sequences of the instructions above. */
+    OP_EQUAL_JMP_IF_FALSE,
+    OP_NOT_EQUAL_JMP_IF_FALSE,
+    OP_GREATER_JMP_IF_FALSE,
+    OP_GREATER_EQUAL_JMP_IF_FALSE,
+    OP_LESS_JMP_IF_FALSE,
+    OP_LESS_EQUAL_JMP_IF_FALSE,
+    OP_GET_LOCAL_ADD_CONST,
+    OP_GET_LOCAL_SUB_CONST,
+    /* Quickened instructions. The VM rewrites a generic instruction into
+        one of these once it has seen the operand types. When the guard 
+        fails, the site has seen more than one kind of operand and gets 
+        the matching _ANY instruction, which never quickens again. The 
+        compiler emits none of them. */
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_ADD_ANY,
+    OP_EQUAL_ANY,
+    OP_NOT_EQUAL_ANY,
+    /* Rewritten from OP_LOOP once the loop has a trace, see trace.c. */
+    OP_LOOP_TRACE,
 }   OpCode;
 
 /* ##################################################################################### */
 
+/* Register code, used instead of the above when the VM runs in register
+    mode. Operands A, B and C are indices into the frame's slots, K is a
+    constant index and G a 16-bit global slot. Every result goes to A. */
+typedef enum {
+    ROP_MOVE,                       /* A B */
+    ROP_CONSTANT,                   /* A K */
+    ROP_CONSTANT_LONG,              /* A K, K is 24 bits */
+    ROP_NIL,                        /* A */
+    ROP_TRUE,                       /* A */
+    ROP_FALSE,                      /* A */
+    ROP_DEFINE_GLOBAL,              /* A G */
+    ROP_GET_GLOBAL,                 /* A G */
+    ROP_SET_GLOBAL,                 /* A G */
+    ROP_EQUAL,                      /* A B C */
+    ROP_NOT_EQUAL,                  /* A B C */
+    ROP_GREATER,                    /* A B C */
+    ROP_GREATER_EQUAL,              /* A B C */
+    ROP_LESS,                       /* A B C */
+    ROP_LESS_EQUAL,                 /* A B C */
+    ROP_ADD,                        /* A B C */
+    ROP_SUBTRACT,                   /* A B C */
+    ROP_MULTIPLY,                   /* A B C */
+    ROP_DIVIDE,                     /* A B C */
+    ROP_ADD_CONST,                  /* A B K, K is a number */
+    ROP_SUB_CONST,                  /* A B K, K is a number */
+    ROP_NEGATE,                     /* A B */
+    ROP_NOT,                        /* A B */
+    ROP_PRINT,                      /* A */
+    ROP_JMP,                        /* offset */
+    ROP_JMP_IF_FALSE,               /* A offset */
+    ROP_LOOP,                       /* offset */
+    ROP_EQUAL_JMP_IF_FALSE,         /* B C offset */
+    ROP_NOT_EQUAL_JMP_IF_FALSE,     /* B C offset */
+    ROP_GREATER_JMP_IF_FALSE,       /* B C offset */
+    ROP_GREATER_EQUAL_JMP_IF_FALSE, /* B C offset */
+    ROP_LESS_JMP_IF_FALSE,          /* B C offset */
+    ROP_LESS_EQUAL_JMP_IF_FALSE,    /* B C offset */
+    ROP_CALL,                       /* A arg_count, callee and arguments 
+                                       from A on */
+    ROP_TAIL_CALL,                  /* A arg_count */
+    ROP_RETURN,                     /* A */
+}   RegOpCode;
+
+/* Constant indices fit in the 24-bit operand of OP_CONSTANT_LONG. */
+#define CONSTANTS_MAX (1 << 24)
+
+/* ##################################################################################### */
+
+/* A run of the line table: the code from START up to the next run
+    was compiled from LINE. */
+typedef struct {
+    int start;
+    int line;
+}   LineStart;
+
+/* ##################################################################################### */
+
 typedef struct {
     int capacity;
     int count;
-    int *lines;
     uint8_t *code;
+    int line_count;
+    int line_capacity;
+    LineStart *lines;
     ValueArray constants;
 }   Chunk;
 
@@ -49,7 +137,11 @@ typedef struct {
 void init_chunk (Chunk *c);
 void free_chunk (Chunk *c);
 void write_chunk (Chunk *c, uint8_t byte, int line);
+void truncate_chunk (Chunk *c, int count);
+int get_line (Chunk *c, int offset);
 int add_constant (Chunk *c, Value val);
+int instruction_len (uint8_t op);
+int reg_instruction_len (uint8_t op);
 
 #endif
 
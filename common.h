@@ -7,7 +7,45 @@
 
 /* ##################################################################################### */
 
+/* Pack every Value into the unused bits of a quiet NaN, so that a 
+    Value is 8 bytes instead of 16. Comment out for the tagged union. */
+#define NAN_BOXING
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXEC
 
+/* Collect garbage on every allocation that grows the heap, so an
+    object the collector cannot reach is freed right away instead of
+    once in a blue moon. Very slow. */
+// #define DEBUG_STRESS_GC
+
+/* Dispatch instructions in run() through a table of label addresses
+    (computed goto) instead of a switch. Only GCC and Clang support
+    labels as values, so everything else falls back on the switch. */
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/* Let the scanner look for the end of comments and strings 16 bytes at
+    a time with SSE2, which every x86-64 has. */
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(NO_SIMD_SCANNER)
+#define SIMD_SCANNER
+#endif
+
+/* Compile hot functions to native code. Only Linux on x86-64 is 
+    supported; the --no-jit switch turns it off at runtime. Without NaN
+    boxing every instruction would be a call, which is slower than the
+    interpreter, so the tagged union goes without. */
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(NO_JIT)
+#define BASELINE_JIT
+#endif
+
+/* Record the path hot loops take and compile it to native code that
+    keeps numbers unboxed in registers, on top of the baseline JIT. The
+    --no-trace switch turns it off at runtime. */
+#if defined(BASELINE_JIT) && !defined(NO_TRACING_JIT)
+#define TRACING_JIT
+#endif
+
 #endif
\ No newline at end of file
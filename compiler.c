@@ -1,9 +1,13 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "regcode.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -13,14 +17,7 @@
 /* ##################################################################################### */
 
 #define MAX_PARAMS 255
-
-
-typedef struct {
-    Token cur;
-    Token prev;
-    bool had_error;
-    bool panic_mode;
-}   Parser;
+#define CONSTANT_MAX_LOAD 0.75
 
 
 typedef enum {
@@ -38,22 +35,21 @@ typedef enum {
 }   Precedence;
 
 
-typedef void (*ParseFn)(bool can_assign);
-
-
-typedef struct {
-    ParseFn prefix;
-    ParseFn infix;
-    Precedence prec;
-}   ParseRule;
-
-
 typedef struct {
     Token name;
     int depth;
 }   Local;  
 
 
+/* Where in the constant pool a number or string already lives, so 
+    every such value only takes one slot. */
+typedef struct {
+    Value key;
+    int index;          /* -1 if the entry is empty, -2 for a tombstone. */
+    int uses;           /* Instructions loading the constant. */
+}   ConstantEntry;
+
+
 /* Function types. */
 typedef enum {
     TYPE_FUNCTION,
@@ -70,30 +66,75 @@ typedef struct Compiler {
                                        or temporaries. */
     int local_count;
     int scope_depth;
+    /* Offsets of the last comparison, local load and literal load
+        (constant, nil, true or false), so they can be fused with the
+        instruction that follows or folded. Reset whenever a jump lands
+        right after them. */
+    int last_cmp;
+    int last_get_local;
+    int last_constant;
+    /* Offset of the last call, so a return can turn it into a tail
+        call. A jump landing right after it is fine: it lands on the
+        OP_RETURN that stays behind the tail call. */
+    int last_call;
+    /* Open addressing index of the chunk's constants, like Table. */
+    ConstantEntry *constants;
+    int constant_capacity;
+    int constant_count;         /* Including tombstones. */
 }   Compiler;
 
-/* ##################################################################################### */
 
-Parser parser;
-Compiler *current = NULL;
-Chunk *compiling_chunk;
+/* Everything one compile works on. It is passed to every function
+    here, so separate compiles can run on separate threads. */
+typedef struct Parser {
+    VM *vm;                 /* Owns the objects being compiled. */
+    Scanner scanner;
+    Token cur;
+    Token prev;
+    bool had_error;
+    bool panic_mode;
+    Compiler *current;      /* The innermost function being compiled. */
+    struct Parser *enclosing; /* The compile this one interrupted. */
+    int skimming;           /* Bodies being checked by skim_function (). */
+}   Parser;
+
+
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
+
+
+typedef struct {
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence prec;
+}   ParseRule;
+
+
+/* The jobs of compile_parallel (), shared by its threads. */
+typedef struct {
+    VM *vm;
+    CompileJob *jobs;
+    int count;
+    atomic_int next;        /* The next job nobody has taken yet. */
+}   JobQueue;
 
 /* ##################################################################################### */
 
 /* Current chunk is always the chunk owned by 
     the function we're in the middle of compiling. */
-static Chunk *current_chunk () { 
-    return &current->function->c; 
+static Chunk *current_chunk (Parser *parser) { 
+    return &parser->current->function->c; 
 }
 
 /* ##################################################################################### */
 
 /* Handles error at TOKEN. */
-static void error_at (Token *token, const char *msg) {
+static void error_at (Parser *parser, Token *token, const char *msg) {
     /* If we are already panicking, we have already done this. */
-    if (parser.panic_mode) return;
+    if (parser->panic_mode) return;
 
-    parser.panic_mode = true;
+    parser->panic_mode = true;
+    /* Keeps the message in one piece when several files compile at once. */
+    flockfile (stderr);
     fprintf (stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) 
@@ -103,163 +144,317 @@ static void error_at (Token *token, const char *msg) {
         fprintf (stderr, " at '%.*s'", token->len, token->start);
 
     fprintf (stderr, ": %s\n", msg);
-    parser.had_error = true;
+    funlockfile (stderr);
+    parser->had_error = true;
 }
 
 /* ##################################################################################### */
 
 /* Handles error at previous token. */
-static void error (const char *msg) {
-    error_at (&parser.prev, msg);
+static void error (Parser *parser, const char *msg) {
+    error_at (parser, &parser->prev, msg);
 }
 
 /* ##################################################################################### */
 
 /* Handles error at current token. */
-static void error_at_current (const char *msg) {
-    error_at (&parser.cur, msg);
+static void error_at_current (Parser *parser, const char *msg) {
+    error_at (parser, &parser->cur, msg);
 }
 
 /* ##################################################################################### */
 
 /* Advances the parser one token. */
-static void advance () {
-    parser.prev = parser.cur;
+static void advance (Parser *parser) {
+    parser->prev = parser->cur;
 
     for (;;) {
-        parser.cur = scan_token ();
-        if (parser.cur.type != TOKEN_ERROR) break;
+        parser->cur = scan_token (&parser->scanner);
+        if (parser->cur.type != TOKEN_ERROR) break;
 
-        error_at_current (parser.cur.start);
+        error_at_current (parser, parser->cur.start);
     }
 }
 
 /* ##################################################################################### */
 
 /* Consumes a token. */
-static void consume (Token_t type, const char *msg) {
-    if (parser.cur.type == type) {
-        advance ();
+static void consume (Parser *parser, Token_t type, const char *msg) {
+    if (parser->cur.type == type) {
+        advance (parser);
         return;
     }
 
-    error_at_current (msg);
+    error_at_current (parser, msg);
 }
 
 /* ##################################################################################### */
 
 /* Check if we are currently parsing a token with type TYPE. */
-static bool check (Token_t type) {
-    return parser.cur.type == type;
+static bool check (Parser *parser, Token_t type) {
+    return parser->cur.type == type;
 }
 
 /* ##################################################################################### */
 
-static bool match (Token_t type) {
-    if (!check (type)) return false;
-    advance ();
+static bool match (Parser *parser, Token_t type) {
+    if (!check (parser, type)) return false;
+    advance (parser);
     return true;
 }
 
 /* ##################################################################################### */
 
 /* Writes BYTE to the current chunk. */
-static void emit_byte (uint8_t byte) {
-    write_chunk (current_chunk (), byte, parser.prev.line);
+static void emit_byte (Parser *parser, uint8_t byte) {
+    write_chunk (current_chunk (parser), byte, parser->prev.line);
 }
 
 /* ##################################################################################### */
 
 /* Writes 2 bytes to the current chunk. */
-static void emit_bytes (uint8_t byte1, uint8_t byte2) {
-    write_chunk (current_chunk (), byte1, parser.prev.line);
-    write_chunk (current_chunk (), byte2, parser.prev.line);
+static void emit_bytes (Parser *parser, uint8_t byte1, uint8_t byte2) {
+    write_chunk (current_chunk (parser), byte1, parser->prev.line);
+    write_chunk (current_chunk (parser), byte2, parser->prev.line);
 }
 
 /* ##################################################################################### */
 
-static void emit_loop (int loop_start) {
-    emit_byte (OP_LOOP);
+/* Writes a global variable instruction with its 16-bit slot. */
+static void emit_global (Parser *parser, uint8_t op, uint16_t slot) {
+    emit_byte (parser, op);
+    emit_bytes (parser, (slot >> 8) & 0xff, slot & 0xff);
+}
+
+/* ##################################################################################### */
 
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX) error ("Loop body too large.");
+static void emit_loop (Parser *parser, int loop_start) {
+    emit_byte (parser, OP_LOOP);
 
-    emit_byte ((offset >> 8) & 0xff);
-    emit_byte (offset & 0xff);
+    int offset = current_chunk (parser)->count - loop_start + 2;
+    if (offset > UINT16_MAX) error (parser, "Loop body too large.");
+
+    emit_byte (parser, (offset >> 8) & 0xff);
+    emit_byte (parser, offset & 0xff);
 }
 
 /* ##################################################################################### */
 
-static int emit_jmp (uint8_t instruction) {
+static int emit_jmp (Parser *parser, uint8_t instruction) {
     /* Write placeholder operand for the jmp offset. */
-    emit_byte (instruction);
+    emit_byte (parser, instruction);
     /* Use 2 bytes for the jump offset, since 16 bits allow
         jumping up to 65535 bytes of code, which should be enough. */
-    emit_bytes (0xff, 0xff);
-    return current_chunk()->count - 2;
+    emit_bytes (parser, 0xff, 0xff);
+    return current_chunk (parser)->count - 2;
 }
 
 /* ##################################################################################### */
 
 /* Writes the return operation to the current chunk. */
-static void emit_return () {
+static void emit_return (Parser *parser) {
     /* For functions with no return value. */
-    emit_byte (OP_NIL);
+    emit_byte (parser, OP_NIL);
+
+    emit_byte (parser, OP_RETURN);
+}
 
-    emit_byte (OP_RETURN);
+/* ##################################################################################### */
+
+/* Numbers are compared bit for bit, so 0 and -0 get separate slots and
+    NaN finds itself. Strings are interned, their address will do. */
+static uint64_t constant_bits (Value val) {
+    if (IS_NUMBER(val)) {
+        double num = AS_NUMBER(val);
+        uint64_t bits;
+        memcpy (&bits, &num, sizeof (bits));
+        return bits;
+    }
+    return (uint64_t) (uintptr_t) AS_OBJ(val);
 }
 
 /* ##################################################################################### */
 
-/* Checks if we have room for this constant and 
-    if so, calls add_constant. */
-static uint8_t make_constant (Value val) {
-    int constant = add_constant (current_chunk (), val);
-    if (constant > UINT8_MAX) {
-        error ("Too many constants in one chunk.");
+static ConstantEntry *find_constant (ConstantEntry *entries, int capacity,
+                                     Value key) {
+    uint64_t bits = constant_bits (key);
+    /* Whole numbers keep their low mantissa bits zero, so fold the high
+        half in first or they all probe from the same few slots. */
+    uint64_t hash = (bits ^ (bits >> 32)) * 0x9e3779b97f4a7c15u;
+    uint32_t i = (uint32_t) (hash >> 32) % capacity;
+    ConstantEntry *tombstone = NULL;
+    for (;;) {
+        ConstantEntry *entry = &entries[i];
+        if (entry->index == -1) {
+            return tombstone != NULL ? tombstone : entry;
+        } else if (entry->index == -2) {
+            if (tombstone == NULL) tombstone = entry;
+        } else if (IS_NUMBER(entry->key) == IS_NUMBER(key) &&
+                   constant_bits (entry->key) == bits) {
+            return entry;
+        }
+
+        i = (i + 1) % capacity;
+    }
+}
+
+/* ##################################################################################### */
+
+static void adjust_constant_capacity (Compiler *compiler, int capacity) {
+    ConstantEntry *entries = ALLOCATE(ConstantEntry, capacity);
+    for (int i = 0; i < capacity; i++) entries[i].index = -1;
+
+    compiler->constant_count = 0;
+    for (int i = 0; i < compiler->constant_capacity; i++) {
+        ConstantEntry *entry = &compiler->constants[i];
+        if (entry->index < 0) continue;
+
+        *find_constant (entries, capacity, entry->key) = *entry;
+        compiler->constant_count++;
+    }
+
+    FREE_ARRAY(ConstantEntry, compiler->constants, compiler->constant_capacity);
+    compiler->constants = entries;
+    compiler->constant_capacity = capacity;
+}
+
+/* ##################################################################################### */
+
+/* Returns the pool slot for VAL. Numbers and strings already in the
+    pool are shared; anything else gets a new slot. */
+static int make_constant (Parser *parser, Value val) {
+    Chunk *c = current_chunk (parser);
+    ConstantEntry *entry = NULL;
+    if (IS_NUMBER(val) || IS_STRING(val)) {
+        if (parser->current->constant_count + 1 > 
+            parser->current->constant_capacity * CONSTANT_MAX_LOAD) {
+            adjust_constant_capacity (parser->current, 
+                GROW_CAPACITY(parser->current->constant_capacity));
+        }
+        entry = find_constant (parser->current->constants, 
+                               parser->current->constant_capacity, val);
+        if (entry->index >= 0) {
+            entry->uses++;
+            return entry->index;
+        }
+    }
+
+    if (c->constants.count == CONSTANTS_MAX) {
+        error (parser, "Too many constants in one chunk.");
         return 0;
     }
+    int constant = add_constant (c, val);
+    write_barrier (parser->vm, (Obj *) parser->current->function, val);
+    if (entry != NULL) {
+        if (entry->index == -1) parser->current->constant_count++;
+        entry->key = val;
+        entry->index = constant;
+        entry->uses = 1;
+    }
+    return constant;
+}
 
-    return (uint8_t) constant;
+/* ##################################################################################### */
+
+/* Emits the load of pool slot CONSTANT, in the long form if the slot
+    does not fit in a byte. */
+static void emit_constant_load (Parser *parser, int constant) {
+    if (constant <= UINT8_MAX) {
+        emit_bytes (parser, OP_CONSTANT, (uint8_t) constant);
+    } else {
+        emit_byte (parser, OP_CONSTANT_LONG);
+        emit_byte (parser, (constant >> 16) & 0xff);
+        emit_bytes (parser, (constant >> 8) & 0xff, constant & 0xff);
+    }
 }
 
 /* ##################################################################################### */
 
-static void emit_constant (Value val) {
-    emit_bytes (OP_CONSTANT, make_constant (val));
+static void emit_constant (Parser *parser, Value val) {
+    parser->current->last_constant = current_chunk (parser)->count;
+    emit_constant_load (parser, make_constant (parser, val));
 }
 
 /* ##################################################################################### */
 
 /* Replaces the operand at the given location with the 
     calculated jmp offset. */
-static void patch_jmp (int offset) {
+static void patch_jmp (Parser *parser, int offset) {
     /* -2 to adjust for the bytecode for the jmp offset itself. */
-    int jmp = current_chunk ()->count - offset - 2;
+    int jmp = current_chunk (parser)->count - offset - 2;
+
+    if (jmp > UINT16_MAX) error (parser, "Too much code to jump over.");
 
-    if (jmp > UINT16_MAX) error ("Too much code to jump over.");
+    current_chunk (parser)->code[offset] = (jmp >> 8) & 0xff;
+    current_chunk (parser)->code[offset + 1] = jmp & 0xff;     
 
-    current_chunk ()->code[offset] = (jmp >> 8) & 0xff;
-    current_chunk ()->code[offset + 1] = jmp & 0xff;     
+    /* The code before the jump target can no longer be fused. */
+    parser->current->last_cmp = -1;
+    parser->current->last_get_local = -1;
+    parser->current->last_constant = -1;
 }
 
 /* ##################################################################################### */
 
-static void init_compiler (Compiler *compiler, Function_t type) {
-    compiler->enclosing = current;
+/* Emits a jump over the code that follows if the condition on top of
+    the stack is falsey. If that condition is a comparison that just 
+    got emitted, it is fused with the jump into an instruction that 
+    also pops the operands, and FUSED tells the caller to leave out the
+    OP_POPs of the condition. */
+static int emit_jmp_if_false (Parser *parser, bool *fused) {
+    Chunk *c = current_chunk (parser);
+    *fused = false;
+    int last_cmp = parser->current->last_cmp;
+    if (last_cmp == -1 || last_cmp != c->count - 1) {
+        return emit_jmp (parser, OP_JMP_IF_FALSE);
+    }
+
+    uint8_t *op = &c->code[c->count - 1];
+    switch (*op) {
+        case OP_EQUAL:         *op = OP_EQUAL_JMP_IF_FALSE;         break;
+        case OP_NOT_EQUAL:     *op = OP_NOT_EQUAL_JMP_IF_FALSE;     break;
+        case OP_GREATER:       *op = OP_GREATER_JMP_IF_FALSE;       break;
+        case OP_GREATER_EQUAL: *op = OP_GREATER_EQUAL_JMP_IF_FALSE; break;
+        case OP_LESS:          *op = OP_LESS_JMP_IF_FALSE;          break;
+        case OP_LESS_EQUAL:    *op = OP_LESS_EQUAL_JMP_IF_FALSE;    break;
+        default: return emit_jmp (parser, OP_JMP_IF_FALSE);  /* Unreachable. */
+    }
+    parser->current->last_cmp = -1;
+    *fused = true;
+    emit_bytes (parser, 0xff, 0xff);
+    return c->count - 2;
+}
+
+/* ##################################################################################### */
+
+/* Starts compiling FUNCTION, or a new function if it is NULL. */
+static void init_compiler (Parser *parser, Compiler *compiler, Function_t type,
+                           ObjFunction *function) {
+    compiler->enclosing = parser->current;
     /* NULL first because of garbage collection paranoia. */
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function ();
-    current = compiler;
-
-    if (type != TYPE_SCRIPT) {
-        current->function->name = copy_string (parser.prev.start, parser.prev.len);
+    compiler->last_cmp = -1;
+    compiler->last_get_local = -1;
+    compiler->last_constant = -1;
+    compiler->last_call = -1;
+    compiler->constants = NULL;
+    compiler->constant_capacity = 0;
+    compiler->constant_count = 0;
+    compiler->function = function != NULL ? function 
+                                          : new_function (parser->vm);
+    parser->current = compiler;
+
+    if (type != TYPE_SCRIPT && function == NULL) {
+        compiler->function->name = copy_string (parser->vm, parser->prev.start,
+                                                parser->prev.len);
+        write_barrier (parser->vm, (Obj *) compiler->function, 
+                       OBJ_VAL(compiler->function->name));
     }
 
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &compiler->locals[compiler->local_count++];
     local->depth = 0;
     local->name.start = "";
     local->name.len = 0;
@@ -267,187 +462,392 @@ static void init_compiler (Compiler *compiler, Function_t type) {
 
 /* ##################################################################################### */
 
-static ObjFunction *end_compiler () {
-    emit_return ();
-    ObjFunction *function = current->function;
+static ObjFunction *end_compiler (Parser *parser) {
+    emit_return (parser);
+    ObjFunction *function = parser->current->function;
+
+    if (parser->vm->register_mode && !parser->had_error &&
+        !to_register_code (function)) {
+        error (parser, "Too many values on the stack for register mode.");
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error) {
+    if (!parser->had_error && parser->skimming == 0) {
         /* If we are at "top-level" we are running a script, not a function. */
-        disassemble_chunk (current_chunk (), function->name != NULL ?
+        flockfile (stdout);
+        disassemble_chunk (parser->vm, current_chunk (parser), 
+                           function->name != NULL ?
                            function->name->chars : "<script>");
+        funlockfile (stdout);
     }
 #endif
-    current = current->enclosing;
+    FREE_ARRAY(ConstantEntry, parser->current->constants, 
+               parser->current->constant_capacity);
+    parser->current = parser->current->enclosing;
     return function;
 }
 
 /* ##################################################################################### */
 
-static void begin_scope () {
-    current->scope_depth++;
+static void begin_scope (Parser *parser) {
+    parser->current->scope_depth++;
 }
 
 /* ##################################################################################### */
 
-static void end_scope () {
-    current->scope_depth--;
+static void end_scope (Parser *parser) {
+    parser->current->scope_depth--;
     /* We need to pop the local variables off the stack
         when we exit the current scope. */
-    while (current->local_count > 0 && 
-           current->locals[current->local_count - 1].depth >
-           current->scope_depth) {
-        emit_byte (OP_POP);
-        current->local_count--;
+    while (parser->current->local_count > 0 && 
+           parser->current->locals[parser->current->local_count - 1].depth >
+           parser->current->scope_depth) {
+        emit_byte (parser, OP_POP);
+        parser->current->local_count--;
     }
 }
 
 /* ##################################################################################### */
 
-static void expression();
-static void statement();
-static void declaration();
-static void declare_variable ();
-static uint8_t identifier_constant (Token *name);
-static void parse_prec(Precedence prec);
-static int resolve_local (Compiler *compiler, Token *name);
+static void expression (Parser *parser);
+static void statement (Parser *parser);
+static void declaration (Parser *parser);
+static void declare_variable (Parser *parser);
+static uint16_t identifier_global (Parser *parser, Token *name);
+static void parse_prec (Parser *parser, Precedence prec);
+static int resolve_local (Parser *parser, Compiler *compiler, Token *name);
 static ParseRule* get_rule(Token_t type);
 
 /* ##################################################################################### */
 
-static void binary (bool can_assign) {
-    Token_t op_type = parser.prev.type;
+/* Turns 'OP_GET_LOCAL slot, OP_CONSTANT k' into 'OP slot k' when the
+    right operand is a single number constant and nothing jumps into
+    the middle of the sequence. */
+static bool fuse_local_constant (Parser *parser, bool lhs_is_local, int rhs_start, 
+                                 uint8_t op) {
+    Chunk *c = current_chunk (parser);
+    if (!lhs_is_local || parser->current->last_constant != rhs_start ||
+        c->code[rhs_start] != OP_CONSTANT || c->count != rhs_start + 2 || 
+        !IS_NUMBER(c->constants.values[c->code[rhs_start + 1]])) {
+        return false;
+    }
+
+    c->code[rhs_start - 2] = op;
+    c->code[rhs_start] = c->code[rhs_start + 1];
+    truncate_chunk (c, c->count - 1);
+    parser->current->last_get_local = -1;
+    parser->current->last_constant = -1;
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Returns the pool slot loaded by the instruction at OFFSET, or -1 if
+    it does not load a constant. */
+static int constant_at (Chunk *c, int offset) {
+    uint8_t *ip = &c->code[offset];
+    switch (ip[0]) {
+        case OP_CONSTANT:      return ip[1];
+        case OP_CONSTANT_LONG: return (ip[1] << 16) | (ip[2] << 8) | ip[3];
+        default:               return -1;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Reads the value of the literal instruction at START if it is all
+    the code from START up to END, i.e. a whole operand. */
+static bool literal_at (Parser *parser, int start, int end, Value *val) {
+    Chunk *c = current_chunk (parser);
+    if (start == -1 || parser->current->last_constant != start ||
+        start + instruction_len (c->code[start]) != end) {
+        return false;
+    }
+
+    switch (c->code[start]) {
+        case OP_CONSTANT: 
+        case OP_CONSTANT_LONG: 
+            *val = c->constants.values[constant_at (c, start)]; 
+            return true;
+        case OP_NIL:   *val = NIL_VAL;         return true;
+        case OP_TRUE:  *val = BOOL_VAL(true);  return true;
+        case OP_FALSE: *val = BOOL_VAL(false); return true;
+        default:                               return false;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Replaces the code from START on, one or two literals, with the 
+    literal VAL. Constants nothing else loads any more go back to the 
+    pool if they are at its end. */
+static void emit_folded (Parser *parser, int start, Value val) {
+    Chunk *c = current_chunk (parser);
+    for (int offset = start; offset < c->count; 
+         offset += instruction_len (c->code[offset])) {
+        int constant = constant_at (c, offset);
+        if (constant != -1) {
+            find_constant (parser->current->constants, 
+                           parser->current->constant_capacity,
+                           c->constants.values[constant])->uses--;
+        }
+    }
+    while (c->constants.count > 0) {
+        Value last = c->constants.values[c->constants.count - 1];
+        if (!IS_NUMBER(last) && !IS_STRING(last)) break;
+        ConstantEntry *entry = find_constant (parser->current->constants, 
+                                              parser->current->constant_capacity,
+                                              last);
+        if (entry->uses > 0) break;
+        entry->index = -2;
+        c->constants.count--;
+    }
+
+    truncate_chunk (c, start);
+    parser->current->last_get_local = -1;
+    if (IS_NIL(val)) {
+        emit_byte (parser, OP_NIL);
+    } else if (IS_BOOL(val)) {
+        emit_byte (parser, AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant (parser, val);
+        return;
+    }
+    parser->current->last_constant = start;
+}
+
+/* ##################################################################################### */
+
+/* Computes A OP B at compile time, where both operands are literals
+    starting at START. Operands of the wrong type are left to the VM,
+    which reports the error on the line of the operator when that code
+    actually runs. */
+static bool fold_binary (Parser *parser, Token_t op_type, Value a, Value b, 
+                         int start) {
+    Value res;
+    if (op_type == TOKEN_EQUAL_EQUAL || op_type == TOKEN_BANG_EQUAL) {
+        bool equal = values_equal (a, b);
+        res = BOOL_VAL(op_type == TOKEN_EQUAL_EQUAL ? equal : !equal);
+    } 
+    else if (op_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *x = AS_STRING(a);
+        ObjString *y = AS_STRING(b);
+        ObjString *string = reserve_string (parser->vm, x->len + y->len);
+        memcpy (string->chars, x->chars, x->len);
+        memcpy (string->chars + x->len, y->chars, y->len);
+        res = OBJ_VAL(take_string (parser->vm, string));
+    } 
+    else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op_type) {
+            case TOKEN_PLUS:          res = NUMBER_VAL(x + y); break;
+            case TOKEN_MINUS:         res = NUMBER_VAL(x - y); break;
+            case TOKEN_STAR:          res = NUMBER_VAL(x * y); break;
+            case TOKEN_SLASH:         res = NUMBER_VAL(x / y); break;
+            case TOKEN_GREATER:       res = BOOL_VAL(x > y);   break;
+            case TOKEN_GREATER_EQUAL: res = BOOL_VAL(x >= y);  break;
+            case TOKEN_LESS:          res = BOOL_VAL(x < y);   break;
+            case TOKEN_LESS_EQUAL:    res = BOOL_VAL(x <= y);  break;
+            default: return false;  /* Unreachable. */
+        }
+    } 
+    else {
+        return false;
+    }
+
+    emit_folded (parser, start, res);
+    return true;
+}
+
+/* ##################################################################################### */
+
+static void binary (Parser *parser, bool can_assign) {
+    Token_t op_type = parser->prev.type;
     ParseRule *rule = get_rule (op_type);
-    parse_prec ((Precedence) (rule->prec + 1));
+    int rhs_start = current_chunk (parser)->count;
+    bool lhs_is_local = parser->current->last_get_local != -1 &&
+                        parser->current->last_get_local == rhs_start - 2;
+    int lhs_start = parser->current->last_constant;
+    Value a, b;
+    bool lhs_is_literal = literal_at (parser, lhs_start, rhs_start, &a);
+    parse_prec (parser, (Precedence) (rule->prec + 1));
+
+    if (lhs_is_literal && 
+        literal_at (parser, rhs_start, current_chunk (parser)->count, &b) &&
+        fold_binary (parser, op_type, a, b, lhs_start)) {
+        return;
+    }
 
     switch (op_type) {
-        case TOKEN_PLUS: emit_byte (OP_ADD);                    break;
-        case TOKEN_MINUS: emit_byte (OP_SUBTRACT);              break;
-        case TOKEN_STAR: emit_byte (OP_MULTIPLY);               break;
-        case TOKEN_SLASH: emit_byte (OP_DIVIDE);                break;
-        case TOKEN_BANG_EQUAL: emit_bytes (OP_EQUAL, OP_NOT);   break;
-        case TOKEN_EQUAL_EQUAL: emit_byte (OP_EQUAL);           break;
-        case TOKEN_GREATER: emit_byte (OP_GREATER);             break;
-        case TOKEN_GREATER_EQUAL: emit_bytes (OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emit_byte (OP_LESS);                   break;
-        case TOKEN_LESS_EQUAL: emit_bytes (OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS: 
+            if (!fuse_local_constant (parser, lhs_is_local, rhs_start,
+                                      OP_GET_LOCAL_ADD_CONST)) {
+                emit_byte (parser, OP_ADD);
+            }
+            return;
+        case TOKEN_MINUS: 
+            if (!fuse_local_constant (parser, lhs_is_local, rhs_start,
+                                      OP_GET_LOCAL_SUB_CONST)) {
+                emit_byte (parser, OP_SUBTRACT);
+            }
+            return;
+        case TOKEN_STAR: emit_byte (parser, OP_MULTIPLY);                 return;
+        case TOKEN_SLASH: emit_byte (parser, OP_DIVIDE);                  return;
+        case TOKEN_BANG_EQUAL: emit_byte (parser, OP_NOT_EQUAL);          break;
+        case TOKEN_EQUAL_EQUAL: emit_byte (parser, OP_EQUAL);             break;
+        case TOKEN_GREATER: emit_byte (parser, OP_GREATER);               break;
+        case TOKEN_GREATER_EQUAL: emit_byte (parser, OP_GREATER_EQUAL);   break;
+        case TOKEN_LESS: emit_byte (parser, OP_LESS);                     break;
+        case TOKEN_LESS_EQUAL: emit_byte (parser, OP_LESS_EQUAL);         break;
         default: return;  /* Unreachable. */
     }
+    /* Only comparisons get here. */
+    parser->current->last_cmp = current_chunk (parser)->count - 1;
 }
 
 /* ##################################################################################### */
 
 /* Compile the arguments and return number of arguments. */
-static uint8_t argument_list () {
+static uint8_t argument_list (Parser *parser) {
     uint8_t arg_count = 0;
-    if (!check (TOKEN_RIGHT_PAREN)) {
+    if (!check (parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression ();
+            expression (parser);
             if (arg_count == MAX_PARAMS) {
-                error ("Cannot have more than 255 arguments.");
+                error (parser, "Cannot have more than 255 arguments.");
             }
             arg_count++;
-        }   while (match (TOKEN_COMMA));
+        }   while (match (parser, TOKEN_COMMA));
     }
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return arg_count;
 }
 
 /* ##################################################################################### */
 
-static void call (bool can_assign) {
-    uint8_t arg_count = argument_list ();
-    emit_bytes (OP_CALL, arg_count);
+static void call (Parser *parser, bool can_assign) {
+    uint8_t arg_count = argument_list (parser);
+    emit_bytes (parser, OP_CALL, arg_count);
+    parser->current->last_call = current_chunk (parser)->count - 2;
 }
 
 /* ##################################################################################### */
 
-static void literal (bool can_assign) {
-    switch (parser.prev.type) {
-        case TOKEN_FALSE: emit_byte (OP_FALSE); break;
-        case TOKEN_NIL: emit_byte (OP_NIL);     break;
-        case TOKEN_TRUE: emit_byte (OP_TRUE);   break;
+static void literal (Parser *parser, bool can_assign) {
+    switch (parser->prev.type) {
+        case TOKEN_FALSE: emit_byte (parser, OP_FALSE); break;
+        case TOKEN_NIL: emit_byte (parser, OP_NIL);     break;
+        case TOKEN_TRUE: emit_byte (parser, OP_TRUE);   break;
         default:                                return;
     }
+    parser->current->last_constant = current_chunk (parser)->count - 1;
 }
 
 /* ##################################################################################### */
 
-static void grouping (bool can_assign) {
-    expression ();
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping (Parser *parser, bool can_assign) {
+    expression (parser);
+    consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 /* ##################################################################################### */
 
-static void number (bool can_assign) {
-    double val = strtod (parser.prev.start, NULL);
-    emit_constant (NUMBER_VAL(val));
+static void number (Parser *parser, bool can_assign) {
+    /* strtod () wants a terminated string, which the source is not. */
+    char buf[64];
+    int len = parser->prev.len;
+    char *chars = len < (int) sizeof (buf) ? buf : (char *) malloc (len + 1);
+    memcpy (chars, parser->prev.start, len);
+    chars[len] = '\0';
+    double val = strtod (chars, NULL);
+    if (chars != buf) free (chars);
+    emit_constant (parser, NUMBER_VAL(val));
 }
 
 /* ##################################################################################### */
 
-static void _and (bool can_assign) {
-    int end_jmp = emit_jmp (OP_JMP_IF_FALSE);
-    emit_byte (OP_POP);
-    parse_prec (PREC_AND);
-    patch_jmp (end_jmp);
+static void _and (Parser *parser, bool can_assign) {
+    int end_jmp = emit_jmp (parser, OP_JMP_IF_FALSE);
+    emit_byte (parser, OP_POP);
+    parse_prec (parser, PREC_AND);
+    patch_jmp (parser, end_jmp);
 }
 
 /* ##################################################################################### */
 
-static void _or (bool can_assign) {
-    int else_jmp = emit_jmp (OP_JMP_IF_FALSE);
-    int end_jmp = emit_jmp (OP_JMP);
+static void _or (Parser *parser, bool can_assign) {
+    int else_jmp = emit_jmp (parser, OP_JMP_IF_FALSE);
+    int end_jmp = emit_jmp (parser, OP_JMP);
 
-    patch_jmp (else_jmp);
-    emit_byte (OP_POP);
+    patch_jmp (parser, else_jmp);
+    emit_byte (parser, OP_POP);
 
-    parse_prec (PREC_OR);
-    patch_jmp (end_jmp);
+    parse_prec (parser, PREC_OR);
+    patch_jmp (parser, end_jmp);
 }
 
 /* ##################################################################################### */
 
-static void string (bool can_assign) {
-    emit_constant (OBJ_VAL(copy_string (parser.prev.start + 1,
-                                        parser.prev.len - 2)));
+static void string (Parser *parser, bool can_assign) {
+    emit_constant (parser, OBJ_VAL(copy_string (parser->vm, 
+                                                parser->prev.start + 1,
+                                                parser->prev.len - 2)));
 }
 
 /* ##################################################################################### */
 
-static void named_variable (Token *name, bool can_assign) {
-    uint8_t get_op, set_op;
-
-    int arg = resolve_local (current, name);
-    if (arg == -1) arg = identifier_constant (name);
-
-    get_op = OP_GET_GLOBAL;
-    set_op = OP_SET_GLOBAL;
+static void named_variable (Parser *parser, Token *name, bool can_assign) {
+    int arg = resolve_local (parser, parser->current, name);
+    if (arg == -1) {
+        /* Globals are addressed by their 16-bit slot in the VM. */
+        uint16_t global = identifier_global (parser, name);
+        if (can_assign && match (parser, TOKEN_EQUAL)) {
+            expression (parser);
+            emit_global (parser, OP_SET_GLOBAL, global);
+        } else {
+            emit_global (parser, OP_GET_GLOBAL, global);
+        }
+        return;
+    }
 
-    if (can_assign && match (TOKEN_EQUAL)) {
-        expression ();
-        emit_bytes (set_op, (uint8_t) arg);
+    if (can_assign && match (parser, TOKEN_EQUAL)) {
+        expression (parser);
+        emit_bytes (parser, OP_SET_LOCAL, (uint8_t) arg);
     } else {
-        emit_bytes (get_op, (uint8_t) arg);
+        emit_bytes (parser, OP_GET_LOCAL, (uint8_t) arg);
+        parser->current->last_get_local = current_chunk (parser)->count - 2;
     }
 } 
 
 /* ##################################################################################### */
 
-static void variable (bool can_assign) {
-    named_variable (&parser.prev, can_assign);
+static void variable (Parser *parser, bool can_assign) {
+    named_variable (parser, &parser->prev, can_assign);
 }
 
 /* ##################################################################################### */
 
-static void unary (bool can_assign) {
-    Token_t op_type = parser.prev.type;
-    parse_prec (PREC_UNARY);
+static void unary (Parser *parser, bool can_assign) {
+    Token_t op_type = parser->prev.type;
+    int start = current_chunk (parser)->count;
+    parse_prec (parser, PREC_UNARY);
+
+    Value val;
+    if (literal_at (parser, start, current_chunk (parser)->count, &val)) {
+        if (op_type == TOKEN_BANG) {
+            emit_folded (parser, start, BOOL_VAL(is_falsey (val)));
+            return;
+        }
+        if (op_type == TOKEN_MINUS && IS_NUMBER(val)) {
+            emit_folded (parser, start, NUMBER_VAL(-AS_NUMBER(val)));
+            return;
+        }
+    }
 
     switch (op_type) {
-        case TOKEN_MINUS: emit_byte (OP_NEGATE); break;
-        case TOKEN_BANG: emit_byte (OP_NOT); break;
+        case TOKEN_MINUS: emit_byte (parser, OP_NEGATE); break;
+        case TOKEN_BANG: emit_byte (parser, OP_NOT); break;
         default: break;  /* Unreachable. */
     }
 }
@@ -499,24 +899,24 @@ ParseRule rules[] = {
 
 /* ##################################################################################### */
 
-static void parse_prec (Precedence prec) {
-    advance ();
-    ParseFn prefix_rule = get_rule (parser.prev.type)->prefix;
+static void parse_prec (Parser *parser, Precedence prec) {
+    advance (parser);
+    ParseFn prefix_rule = get_rule (parser->prev.type)->prefix;
     if (prefix_rule == NULL) {
-        error ("Expect expression.");
+        error (parser, "Expect expression.");
         return;
     }
     bool can_assign = prec <= PREC_ASSIGNMENT;
-    prefix_rule (can_assign);
+    prefix_rule (parser, can_assign);
 
-    while (prec <= get_rule (parser.cur.type)->prec) {
-        advance ();
-        ParseFn infix_rule = get_rule (parser.prev.type)->infix;
-        infix_rule (can_assign);
+    while (prec <= get_rule (parser->cur.type)->prec) {
+        advance (parser);
+        ParseFn infix_rule = get_rule (parser->prev.type)->infix;
+        infix_rule (parser, can_assign);
     }
 
-    if (can_assign && match (TOKEN_EQUAL)) {
-        error ("Invalid assignment target.");
+    if (can_assign && match (parser, TOKEN_EQUAL)) {
+        error (parser, "Invalid assignment target.");
     }
 }
 
@@ -524,39 +924,48 @@ static void parse_prec (Precedence prec) {
 
 /* Parses a variable and prints ERROR_MSG if consuming
     current token fails. */
-static uint8_t parse_variable (const char *error_msg) {
-    consume (TOKEN_IDENTIFIER, error_msg);
+static uint16_t parse_variable (Parser *parser, const char *error_msg) {
+    consume (parser, TOKEN_IDENTIFIER, error_msg);
     
-    declare_variable ();
-    if (current->scope_depth > 0) return 0;
+    declare_variable (parser);
+    if (parser->current->scope_depth > 0) return 0;
 
-    return identifier_constant (&parser.prev);
+    return identifier_global (parser, &parser->prev);
 }
 
 /* ##################################################################################### */
 
 /* Marks the latest local variable initialized. */
-static void mark_initialized () {
-    if (current->scope_depth == 0) return;
-    printf("marking as initialized. \n");
-    current->locals[current->local_count - 1].depth = 
-        current->scope_depth;
+static void mark_initialized (Parser *parser) {
+    if (parser->current->scope_depth == 0) return;
+    parser->current->locals[parser->current->local_count - 1].depth = 
+        parser->current->scope_depth;
 }
 
 /* ##################################################################################### */
 
-static void define_variable (uint8_t global) {
-    if (current->scope_depth > 0) {
-        mark_initialized ();
+static void define_variable (Parser *parser, uint16_t global) {
+    if (parser->current->scope_depth > 0) {
+        mark_initialized (parser);
         return;
     } 
-    emit_bytes (OP_DEFINE_GLOBAL, global);
+    emit_global (parser, OP_DEFINE_GLOBAL, global);
 }
 
 /* ##################################################################################### */
 
-static uint8_t identifier_constant (Token *name) {
-    return make_constant (OBJ_VAL(copy_string (name->start, name->len)));
+/* Resolves the global variable NAME to its slot in the VM. The slot
+    exists from now on, but stays undefined until OP_DEFINE_GLOBAL runs,
+    so functions can still refer to globals declared after them. */
+static uint16_t identifier_global (Parser *parser, Token *name) {
+    int slot = global_slot (parser->vm, 
+                            copy_string (parser->vm, name->start, name->len));
+    if (slot == -1) {
+        error (parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t) slot;
 }
 
 /* ##################################################################################### */
@@ -570,14 +979,15 @@ static bool identifiers_equal (Token *a, Token *b) {
 
 /* Get the index of the local variable with identifier NAME. 
     Returns -1 if not found. */
-static int resolve_local (Compiler *compiler, Token *name) {
+static int resolve_local (Parser *parser, Compiler *compiler, Token *name) {
     /* Walk backwards so we get the last declared variable 
         with the identifier. */
     for (int i = compiler->local_count - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
         if (identifiers_equal (name, &local->name)) {
             if (local->depth == -1) {
-                error ("Cannot read local variable in its own initializer.");
+                error (parser, 
+                       "Cannot read local variable in its own initializer.");
             }
             return i;
         }
@@ -587,12 +997,12 @@ static int resolve_local (Compiler *compiler, Token *name) {
 
 /* ##################################################################################### */
 
-static void add_local (Token name) {
-    if (current->local_count == UINT8_COUNT) {
-        error ("Too many local variables in function.");
+static void add_local (Parser *parser, Token name) {
+    if (parser->current->local_count == UINT8_COUNT) {
+        error (parser, "Too many local variables in function.");
         return;
     }
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &parser->current->locals[parser->current->local_count++];
     local->name = name;
     /* This is to indicate that the local is uninitialized. */
     local->depth = -1;
@@ -600,21 +1010,21 @@ static void add_local (Token name) {
 
 /* ##################################################################################### */
 
-static void declare_variable () {
-    if (current->scope_depth == 0) return;
-    Token *name = &parser.prev;
+static void declare_variable (Parser *parser) {
+    if (parser->current->scope_depth == 0) return;
+    Token *name = &parser->prev;
 
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth) {
+    for (int i = parser->current->local_count - 1; i >= 0; i--) {
+        Local *local = &parser->current->locals[i];
+        if (local->depth != -1 && local->depth < parser->current->scope_depth) {
             break;    
         }
 
         if (identifiers_equal (name, &local->name)) {
-            error ("Already a variable with this name in this scope.");
+            error (parser, "Already a variable with this name in this scope.");
         }
     }
-    add_local (*name);
+    add_local (parser, *name);
 }
 
 /* ##################################################################################### */
@@ -625,47 +1035,90 @@ static ParseRule *get_rule (Token_t type) {
 
 /* ##################################################################################### */
 
-static void expression () {
-    parse_prec (PREC_ASSIGNMENT);
+static void expression (Parser *parser) {
+    parse_prec (parser, PREC_ASSIGNMENT);
 }
 
 /* ##################################################################################### */
 
-static void block () {
-    while (!check (TOKEN_RIGHT_BRACE) && !check (TOKEN_EOF)) {
-        declaration ();
+static void block (Parser *parser) {
+    while (!check (parser, TOKEN_RIGHT_BRACE) && !check (parser, TOKEN_EOF)) {
+        declaration (parser);
     } 
-    consume (TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume (parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 /* ##################################################################################### */
 
-static void function (Function_t type) {
-    Compiler compiler;
-    init_compiler (&compiler, type);
-    begin_scope ();
+/* Compiles the parameters and body of the current function. */
+static void function_body (Parser *parser) {
+    begin_scope (parser);
 
-    consume (TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    consume (parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
     /* Check if we have any parameters. */
-    if (!check (TOKEN_RIGHT_PAREN)) {
+    if (!check (parser, TOKEN_RIGHT_PAREN)) {
         /* We do have parameters. Parse them as variables. */
         do {
-            current->function->arity++;
-            if (current->function->arity > MAX_PARAMS) {
-                error_at_current ("Cannot have more than 255 parameters.");
+            parser->current->function->arity++;
+            if (parser->current->function->arity > MAX_PARAMS) {
+                error_at_current (parser, "Cannot have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable ("Expect parameter name.");
-            define_variable (constant);
-        }   while (match (TOKEN_COMMA));
+            uint16_t constant = parse_variable (parser, "Expect parameter name.");
+            define_variable (parser, constant);
+        }   while (match (parser, TOKEN_COMMA));
     }
 
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume (TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block ();
+    consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume (parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block (parser);
+}
+
+/* ##################################################################################### */
+
+/* Checks the parameters and body of a function without keeping its
+    code. The body goes through the compiler like it would without
+    --lazy, so it reports the same errors and gives the globals it names
+    their slots, but the code is thrown away. The function remembers
+    where its source is and compile_lazy () compiles it for good when it
+    is first called. */
+static void skim_function (Parser *parser) {
+    ObjFunction *function = new_function (parser->vm);
+    /* In the constants before the name is allocated, which may collect. */
+    int constant = make_constant (parser, OBJ_VAL(function));
+    function->name = copy_string (parser->vm, parser->prev.start, 
+                                  parser->prev.len);
+    write_barrier (parser->vm, (Obj *) function, OBJ_VAL(function->name));
+    function->source = parser->cur.start;
+    function->source_line = parser->cur.line;
+
+    Compiler compiler;
+    init_compiler (parser, &compiler, TYPE_FUNCTION, function);
+    parser->skimming++;
+    function_body (parser);
+    end_compiler (parser);
+    parser->skimming--;
+    free_chunk (&function->c);
+    function->arity = 0;
+    function->reg_count = 0;
+    function->source_len = (int) (parser->prev.start + parser->prev.len - 
+                                  function->source);
+    emit_constant_load (parser, constant);
+}
+
+/* ##################################################################################### */
+
+static void function (Parser *parser, Function_t type) {
+    if (parser->vm->lazy_compile) {
+        skim_function (parser);
+        return;
+    }
 
-    ObjFunction *function = end_compiler ();
-    emit_bytes (OP_CONSTANT, make_constant (OBJ_VAL(function)));
+    Compiler compiler;
+    init_compiler (parser, &compiler, type, NULL);
+    function_body (parser);
+    ObjFunction *function = end_compiler (parser);
+    emit_constant_load (parser, make_constant (parser, OBJ_VAL(function)));
 }
 
 /* ##################################################################################### */
@@ -673,154 +1126,165 @@ static void function (Function_t type) {
 /* A function declaration at the top level will bind the function
     to a global variable. Inside a block or other function, a
     function declaration creates a local variable. */
-static void fun_declaration () {
-    uint8_t global = parse_variable ("Expect function name.");
-    mark_initialized ();
-    function (TYPE_FUNCTION);
-    define_variable (global);
+static void fun_declaration (Parser *parser) {
+    uint16_t global = parse_variable (parser, "Expect function name.");
+    mark_initialized (parser);
+    function (parser, TYPE_FUNCTION);
+    define_variable (parser, global);
 }
 
 /* ##################################################################################### */
 
-static void var_declaration () {
-    uint8_t global = parse_variable ("Expect variable name.");
+static void var_declaration (Parser *parser) {
+    uint16_t global = parse_variable (parser, "Expect variable name.");
 
-    if (match (TOKEN_EQUAL)) {
-        expression ();
+    if (match (parser, TOKEN_EQUAL)) {
+        expression (parser);
     } else {
         /* E.g., 'var a;' sets a to nil. */
-        emit_byte (OP_NIL);
+        emit_byte (parser, OP_NIL);
     }
-    consume (TOKEN_SEMICOLON, 
+    consume (parser, TOKEN_SEMICOLON, 
              "Expect ';' after variable declaration.");
 
-    define_variable (global);
+    define_variable (parser, global);
 }
 
 /* ##################################################################################### */
 
-static void expression_statement () {
-    expression ();
-    consume (TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte (OP_POP);
+static void expression_statement (Parser *parser) {
+    expression (parser);
+    consume (parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emit_byte (parser, OP_POP);
 }
 
 /* ##################################################################################### */
 
-static void if_statement () {
+static void if_statement (Parser *parser) {
     int then_jmp, else_jmp;
+    bool fused;
 
-    consume (TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression ();
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume (parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression (parser);
+    consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     /* Use backpatching to know how far to jump. */
-    then_jmp = emit_jmp (OP_JMP_IF_FALSE);
-    emit_byte (OP_POP);
-    statement ();
-    else_jmp = emit_jmp (OP_JMP);
+    then_jmp = emit_jmp_if_false (parser, &fused);
+    if (!fused) emit_byte (parser, OP_POP);
+    statement (parser);
+    else_jmp = emit_jmp (parser, OP_JMP);
 
-    patch_jmp (then_jmp);
+    patch_jmp (parser, then_jmp);
+    if (!fused) emit_byte (parser, OP_POP);
 
-    if (match (TOKEN_ELSE)) statement ();
-    patch_jmp (else_jmp);
+    if (match (parser, TOKEN_ELSE)) statement (parser);
+    patch_jmp (parser, else_jmp);
 }
 
 /* ##################################################################################### */
 
-static void for_statement () {
+static void for_statement (Parser *parser) {
     int loop_start, exit_jmp;
+    bool fused;
     /* If a for-statement declares a variable, that variable
         should be scoped to the loop body. */
-    begin_scope ();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match (TOKEN_SEMICOLON)) {
+    begin_scope (parser);
+    consume (parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match (parser, TOKEN_SEMICOLON)) {
         /* No initializer. */
-    } else if (match (TOKEN_VAR)) {
-        var_declaration ();
+    } else if (match (parser, TOKEN_VAR)) {
+        var_declaration (parser);
     } else {
-        expression_statement ();
+        expression_statement (parser);
     }
-    loop_start = current_chunk ()->count;
+    loop_start = current_chunk (parser)->count;
     /* Check condition expression. */
     exit_jmp = -1;
-    if (!match (TOKEN_SEMICOLON)) {
-        expression ();
-        consume (TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    fused = false;
+    if (!match (parser, TOKEN_SEMICOLON)) {
+        expression (parser);
+        consume (parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         /* Jump out of the loop if the condition is false. */
-        exit_jmp = emit_jmp (OP_JMP_IF_FALSE);
+        exit_jmp = emit_jmp_if_false (parser, &fused);
         /* Condition. */
-        emit_byte (OP_POP);
+        if (!fused) emit_byte (parser, OP_POP);
     }
 
     /* One pass compiler, increment clause comes before the body, but 
         executes after. So we need to jump a little bit back and forth. */
-    if (!match (TOKEN_RIGHT_PAREN)) {
-        int body_jmp = emit_jmp (OP_JMP);
-        int inc_start = current_chunk ()->count;
-        expression ();
-        emit_byte (OP_POP);
-        consume (TOKEN_RIGHT_PAREN, "Expect ')' after for-clauses.");
-
-        emit_loop (loop_start);
+    if (!match (parser, TOKEN_RIGHT_PAREN)) {
+        int body_jmp = emit_jmp (parser, OP_JMP);
+        int inc_start = current_chunk (parser)->count;
+        expression (parser);
+        emit_byte (parser, OP_POP);
+        consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after for-clauses.");
+
+        emit_loop (parser, loop_start);
         loop_start = inc_start;
-        patch_jmp (body_jmp);
+        patch_jmp (parser, body_jmp);
     }
 
-    statement ();
-    emit_loop (loop_start);
+    statement (parser);
+    emit_loop (parser, loop_start);
     /* After the loop body, we need to patch that jump. */
     if (exit_jmp != -1) {
-        patch_jmp (exit_jmp);
-        emit_byte (OP_POP);
+        patch_jmp (parser, exit_jmp);
+        if (!fused) emit_byte (parser, OP_POP);
     }
-    end_scope ();
+    end_scope (parser);
 }
 
 
-static void print_statement () {
-    expression ();
-    consume (TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte (OP_PRINT);
+static void print_statement (Parser *parser) {
+    expression (parser);
+    consume (parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emit_byte (parser, OP_PRINT);
 }
 
-static void return_statement () {
-    if (current->type == TYPE_SCRIPT) {
-        error ("Cannot return from top-level code.");
+static void return_statement (Parser *parser) {
+    if (parser->current->type == TYPE_SCRIPT) {
+        error (parser, "Cannot return from top-level code.");
     }
-    if (match (TOKEN_SEMICOLON)) {
-        emit_return ();
+    if (match (parser, TOKEN_SEMICOLON)) {
+        emit_return (parser);
     } 
     else {
-        expression ();
-        consume (TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte (OP_RETURN);
+        expression (parser);
+        consume (parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        /* return f(...) reuses the frame of the returning function. */
+        Chunk *c = current_chunk (parser);
+        int last_call = parser->current->last_call;
+        if (last_call != -1 && last_call == c->count - 2) {
+            c->code[last_call] = OP_TAIL_CALL;
+        }
+        emit_byte (parser, OP_RETURN);
     }
 }
 
-static void while_statement () {
+static void while_statement (Parser *parser) {
     /* Capture the location to jump back to. */
-    int loop_start = current_chunk ()->count;
-    consume (TOKEN_LEFT_PAREN, "Ecpect '(' after 'while'.");
-    expression ();
-    consume (TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-    int exit_jmp = emit_jmp (OP_JMP_IF_FALSE);
-    emit_byte (OP_POP);
-    statement ();
-    emit_loop (loop_start);
-
-    patch_jmp (exit_jmp);
-    emit_jmp (OP_POP);
+    int loop_start = current_chunk (parser)->count;
+    consume (parser, TOKEN_LEFT_PAREN, "Ecpect '(' after 'while'.");
+    expression (parser);
+    consume (parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    bool fused;
+    int exit_jmp = emit_jmp_if_false (parser, &fused);
+    if (!fused) emit_byte (parser, OP_POP);
+    statement (parser);
+    emit_loop (parser, loop_start);
+
+    patch_jmp (parser, exit_jmp);
+    if (!fused) emit_byte (parser, OP_POP);
 }
 
 /* Skip tokens until statement boundary is found (like a semicolon). 
     Or, we can look for a beginning of a statement. */
-static void synchronize () {
-    parser.panic_mode = false;
+static void synchronize (Parser *parser) {
+    parser->panic_mode = false;
 
-    while (parser.cur.type != TOKEN_EOF) {
-        if (parser.prev.type == TOKEN_SEMICOLON) return;
-        switch (parser.cur.type) {
+    while (parser->cur.type != TOKEN_EOF) {
+        if (parser->prev.type == TOKEN_SEMICOLON) return;
+        switch (parser->cur.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -833,66 +1297,177 @@ static void synchronize () {
             default:
                 ;  /* Do nothing. */
         }
-        advance ();
+        advance (parser);
     }
 }
 
 
-static void declaration () {
-    if (match (TOKEN_FUN)) {
-        fun_declaration ();
+static void declaration (Parser *parser) {
+    if (match (parser, TOKEN_FUN)) {
+        fun_declaration (parser);
     }
-    else if (match (TOKEN_VAR)) {
-        var_declaration ();
+    else if (match (parser, TOKEN_VAR)) {
+        var_declaration (parser);
     } else {
-        statement ();
+        statement (parser);
     }
-    if (parser.panic_mode) synchronize ();
+    if (parser->panic_mode) synchronize (parser);
 }
 
 
-static void statement () {
-    if (match (TOKEN_PRINT)) {
-        print_statement ();
+static void statement (Parser *parser) {
+    if (match (parser, TOKEN_PRINT)) {
+        print_statement (parser);
     } 
-    else if (match (TOKEN_IF)) {
-        if_statement ();
+    else if (match (parser, TOKEN_IF)) {
+        if_statement (parser);
     }
-    else if (match (TOKEN_RETURN)) {
-        return_statement ();
+    else if (match (parser, TOKEN_RETURN)) {
+        return_statement (parser);
     }
-    else if (match (TOKEN_FOR)) {
-        for_statement ();
+    else if (match (parser, TOKEN_FOR)) {
+        for_statement (parser);
     }
-    else if (match (TOKEN_WHILE)) {
-        while_statement ();
+    else if (match (parser, TOKEN_WHILE)) {
+        while_statement (parser);
     }
-    else if (match (TOKEN_LEFT_BRACE)) {
-        begin_scope ();
-        block ();
-        end_scope ();
+    else if (match (parser, TOKEN_LEFT_BRACE)) {
+        begin_scope (parser);
+        block (parser);
+        end_scope (parser);
     } 
     else {
-        expression_statement ();
+        expression_statement (parser);
     }
 }
 
+/* ##################################################################################### */
+
+static void init_parser (Parser *parser, VM *vm, const char *source, 
+                         size_t len, int line) {
+    parser->vm = vm;
+    init_scanner (&parser->scanner, source, len, line);
+    parser->had_error = false;
+    parser->panic_mode = false;
+    parser->current = NULL;
+    parser->skimming = 0;
+    /* The collector finds the functions being compiled through 
+        vm->compiling. Nothing is collected while compile_parallel () 
+        runs, so its threads leave it alone. */
+    parser->enclosing = vm->compiling;
+    if (!vm->parallel) vm->compiling = parser;
+}
+
+/* ##################################################################################### */
+
+static void end_parser (Parser *parser) {
+    if (!parser->vm->parallel) parser->vm->compiling = parser->enclosing;
+}
+
+/* ##################################################################################### */
+
 /* Compiles the given source code. Returns the resulting 
     function if no errors, else NULL. */
-ObjFunction *compile (const char* source) {
-    init_scanner (source);
+ObjFunction *compile (VM *vm, const char* source, size_t len) {
+    Parser parser;
+    init_parser (&parser, vm, source, len, 1);
     Compiler compiler;
-    init_compiler (&compiler, TYPE_SCRIPT);
-
-    compiling_chunk = &compiler.function->c;
-    parser.had_error = false;
-    parser.panic_mode = false;
+    init_compiler (&parser, &compiler, TYPE_SCRIPT, NULL);
 
-    advance ();
+    advance (&parser);
     
-    while (!match (TOKEN_EOF)) {
-        declaration ();
+    while (!match (&parser, TOKEN_EOF)) {
+        declaration (&parser);
     }
-    ObjFunction *function = end_compiler ();
+    ObjFunction *function = end_compiler (&parser);
+    end_parser (&parser);
     return parser.had_error ? NULL : function;
+}
+
+/* ##################################################################################### */
+
+/* Compiles the body of FUNCTION, which skim_function () left for its
+    first call. Returns false on a compile error, leaving the function
+    skimmed, so every later call fails the same way instead of running
+    half a body. */
+bool compile_lazy (VM *vm, ObjFunction *function) {
+    Parser parser;
+    init_parser (&parser, vm, function->source, function->source_len, 
+                 function->source_line);
+    Compiler compiler;
+    init_compiler (&parser, &compiler, TYPE_FUNCTION, function);
+
+    advance (&parser);
+    function_body (&parser);
+    end_compiler (&parser);
+    end_parser (&parser);
+    if (parser.had_error) {
+        free_chunk (&function->c);
+        function->arity = 0;
+        function->reg_count = 0;
+        return false;
+    }
+    function->source = NULL;
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Marks the functions of every compile on the VM's thread, which only
+    the compiler can reach yet. */
+void mark_compiler_roots (VM *vm) {
+    for (Parser *parser = vm->compiling; parser != NULL; 
+         parser = parser->enclosing) {
+        for (Compiler *compiler = parser->current; compiler != NULL;
+             compiler = compiler->enclosing) {
+            mark_object (vm, (Obj *) compiler->function);
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+static void *compile_worker (void *arg) {
+    JobQueue *queue = (JobQueue *) arg;
+    for (;;) {
+        int i = atomic_fetch_add (&queue->next, 1);
+        if (i >= queue->count) return NULL;
+        CompileJob *job = &queue->jobs[i];
+        job->function = compile (queue->vm, job->source, job->len);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Compiles COUNT independent sources on up to THREADS threads, storing
+    each script in its job, or NULL on a compile error. The threads only 
+    meet in the heap, the string table and the globals, which are locked
+    while vm->parallel is set. The scripts are not roots; the caller
+    keeps them alive with add_root (). */
+void compile_parallel (VM *vm, CompileJob *jobs, int count, int threads) {
+    JobQueue queue = {vm, jobs, count, 0};
+    if (threads > count) threads = count;
+    /* Even on one thread vm->parallel is set, as the finished scripts
+        are only held by the jobs and must not be collected. The threads
+        would race on a collection in progress, so that is finished. */
+    finish_collection (vm);
+    vm->parallel = true;
+    if (threads <= 1) {
+        compile_worker (&queue);
+        vm->parallel = false;
+        return;
+    }
+
+    pthread_t *workers = ALLOCATE(pthread_t, threads - 1);
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create (&workers[started], NULL, compile_worker, 
+                            &queue) != 0) break;
+    }
+    /* This thread takes jobs too, so all of them get done even if no
+        worker could be started. */
+    compile_worker (&queue);
+    for (int i = 0; i < started; i++) pthread_join (workers[i], NULL);
+    vm->parallel = false;
+    FREE_ARRAY(pthread_t, workers, threads - 1);
 }
\ No newline at end of file
@@ -6,6 +6,18 @@
 
 /* ##################################################################################### */
 
-ObjFunction *compile(const char* source);
+/* One source for compile_parallel (). */
+typedef struct {
+    const char *source;
+    size_t len;
+    ObjFunction *function;  /* The compiled script, NULL on an error. */
+}   CompileJob;
+
+/* ##################################################################################### */
+
+ObjFunction *compile (VM *vm, const char* source, size_t len);
+bool compile_lazy (VM *vm, ObjFunction *function);
+void compile_parallel (VM *vm, CompileJob *jobs, int count, int threads);
+void mark_compiler_roots (VM *vm);
 
 #endif
\ No newline at end of file
@@ -2,14 +2,15 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 /* ##################################################################################### */
 
-void disassemble_chunk (Chunk *c, const char *name) {
+void disassemble_chunk (VM *vm, Chunk *c, const char *name) {
     printf ("== %s ==\n", name);
 
     for (int offset = 0; offset < c->count;) {
-        offset = disassemble_instruction (c, offset);
+        offset = disassemble_instruction (vm, c, offset);
     }
 }
 
@@ -26,6 +27,27 @@ static int constant_instruction (const char *name, Chunk *c,
 
 /* ##################################################################################### */
 
+static int constant_long_instruction (const char *name, Chunk *c, 
+                                      int offset) {
+    int c_idx = (c->code[offset + 1] << 16) | (c->code[offset + 2] << 8) |
+                c->code[offset + 3];
+    printf ("%-16s %4d '", name, c_idx);
+    print_value (c->constants.values[c_idx]);
+    printf ("'\n");
+    return offset + 4;
+}
+
+/* ##################################################################################### */
+
+static int global_instruction (VM *vm, const char *name, Chunk *c, int offset) {
+    uint16_t slot = (uint16_t) (c->code[offset + 1] << 8);
+    slot |= c->code[offset + 2];
+    printf ("%-16s %4d '%s'\n", name, slot, vm->globals[slot].name->chars);
+    return offset + 3;
+}
+
+/* ##################################################################################### */
+
 static int simple_instruction (const char *name, int offset) {
     printf ("%s\n", name);
     return offset + 1;
@@ -53,18 +75,188 @@ static int jmp_instruction (const char *name, int sign,
 
 /* ##################################################################################### */
 
-int disassemble_instruction (Chunk *c, int offset) {
+static int local_constant_instruction (const char *name, Chunk *c,
+                                       int offset) {
+    uint8_t slot = c->code[offset + 1];
+    uint8_t c_idx = c->code[offset + 2];
+    printf ("%-16s %4d %4d '", name, slot, c_idx);
+    print_value (c->constants.values[c_idx]);
+    printf ("'\n");
+    return offset + 3;
+}
+
+/* ##################################################################################### */
+
+/* Register code: COUNT register operands. */
+static int reg_instruction (const char *name, int count, 
+                            Chunk *c, int offset) {
+    printf ("%-16s", name);
+    for (int i = 1; i <= count; i++) printf (" r%-3d", c->code[offset + i]);
+    printf ("\n");
+    return offset + 1 + count;
+}
+
+/* ##################################################################################### */
+
+/* Register code: COUNT registers, then a constant. */
+static int reg_constant_instruction (const char *name, int count, 
+                                     Chunk *c, int offset) {
+    printf ("%-16s", name);
+    for (int i = 1; i <= count; i++) printf (" r%-3d", c->code[offset + i]);
+    uint8_t c_idx = c->code[offset + count + 1];
+    printf (" %4d '", c_idx);
+    print_value (c->constants.values[c_idx]);
+    printf ("'\n");
+    return offset + count + 2;
+}
+
+/* ##################################################################################### */
+
+static int reg_constant_long_instruction (const char *name, Chunk *c, 
+                                          int offset) {
+    int c_idx = (c->code[offset + 2] << 16) | (c->code[offset + 3] << 8) |
+                c->code[offset + 4];
+    printf ("%-16s r%-3d %4d '", name, c->code[offset + 1], c_idx);
+    print_value (c->constants.values[c_idx]);
+    printf ("'\n");
+    return offset + 5;
+}
+
+/* ##################################################################################### */
+
+static int reg_global_instruction (VM *vm, const char *name, Chunk *c, 
+                                   int offset) {
+    uint16_t slot = (uint16_t) (c->code[offset + 2] << 8);
+    slot |= c->code[offset + 3];
+    printf ("%-16s r%-3d %4d '%s'\n", name, c->code[offset + 1], slot, 
+            vm->globals[slot].name->chars);
+    return offset + 4;
+}
+
+/* ##################################################################################### */
+
+/* Register code: COUNT registers, then the jump offset. */
+static int reg_jmp_instruction (const char *name, int count, int sign,
+                                Chunk *c, int offset) {
+    printf ("%-16s", name);
+    for (int i = 1; i <= count; i++) printf (" r%-3d", c->code[offset + i]);
+    uint16_t jmp = (uint16_t) (c->code[offset + count + 1] << 8);
+    jmp |= c->code[offset + count + 2];
+    int next = offset + count + 3;
+    printf (" %4d -> %d\n", offset, next + sign * jmp);
+    return next;
+}
+
+/* ##################################################################################### */
+
+static int reg_call_instruction (const char *name, Chunk *c, int offset) {
+    printf ("%-16s r%-3d (%d args)\n", name, c->code[offset + 1], 
+            c->code[offset + 2]);
+    return offset + 3;
+}
+
+/* ##################################################################################### */
+
+static int disassemble_reg_instruction (VM *vm, Chunk *c, int offset) {
+    uint8_t instruction = c->code[offset];
+    switch (instruction) {
+        case ROP_MOVE:
+            return reg_instruction ("ROP_MOVE", 2, c, offset);
+        case ROP_CONSTANT:
+            return reg_constant_instruction ("ROP_CONSTANT", 1, c, offset);
+        case ROP_CONSTANT_LONG:
+            return reg_constant_long_instruction ("ROP_CONSTANT_LONG", c, offset);
+        case ROP_NIL:
+            return reg_instruction ("ROP_NIL", 1, c, offset);
+        case ROP_TRUE:
+            return reg_instruction ("ROP_TRUE", 1, c, offset);
+        case ROP_FALSE:
+            return reg_instruction ("ROP_FALSE", 1, c, offset);
+        case ROP_DEFINE_GLOBAL:
+            return reg_global_instruction (vm, "ROP_DEFINE_GLOBAL", c, offset);
+        case ROP_GET_GLOBAL:
+            return reg_global_instruction (vm, "ROP_GET_GLOBAL", c, offset);
+        case ROP_SET_GLOBAL:
+            return reg_global_instruction (vm, "ROP_SET_GLOBAL", c, offset);
+        case ROP_EQUAL:
+            return reg_instruction ("ROP_EQUAL", 3, c, offset);
+        case ROP_NOT_EQUAL:
+            return reg_instruction ("ROP_NOT_EQUAL", 3, c, offset);
+        case ROP_GREATER:
+            return reg_instruction ("ROP_GREATER", 3, c, offset);
+        case ROP_GREATER_EQUAL:
+            return reg_instruction ("ROP_GREATER_EQUAL", 3, c, offset);
+        case ROP_LESS:
+            return reg_instruction ("ROP_LESS", 3, c, offset);
+        case ROP_LESS_EQUAL:
+            return reg_instruction ("ROP_LESS_EQUAL", 3, c, offset);
+        case ROP_ADD:
+            return reg_instruction ("ROP_ADD", 3, c, offset);
+        case ROP_SUBTRACT:
+            return reg_instruction ("ROP_SUBTRACT", 3, c, offset);
+        case ROP_MULTIPLY:
+            return reg_instruction ("ROP_MULTIPLY", 3, c, offset);
+        case ROP_DIVIDE:
+            return reg_instruction ("ROP_DIVIDE", 3, c, offset);
+        case ROP_ADD_CONST:
+            return reg_constant_instruction ("ROP_ADD_CONST", 2, c, offset);
+        case ROP_SUB_CONST:
+            return reg_constant_instruction ("ROP_SUB_CONST", 2, c, offset);
+        case ROP_NEGATE:
+            return reg_instruction ("ROP_NEGATE", 2, c, offset);
+        case ROP_NOT:
+            return reg_instruction ("ROP_NOT", 2, c, offset);
+        case ROP_PRINT:
+            return reg_instruction ("ROP_PRINT", 1, c, offset);
+        case ROP_JMP:
+            return reg_jmp_instruction ("ROP_JMP", 0, 1, c, offset);
+        case ROP_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_JMP_IF_FALSE", 1, 1, c, offset);
+        case ROP_LOOP:
+            return reg_jmp_instruction ("ROP_LOOP", 0, -1, c, offset);
+        case ROP_EQUAL_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_EQUAL_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_NOT_EQUAL_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_NOT_EQUAL_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_GREATER_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_GREATER_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_GREATER_EQUAL_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_GREATER_EQUAL_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_LESS_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_LESS_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_LESS_EQUAL_JMP_IF_FALSE:
+            return reg_jmp_instruction ("ROP_LESS_EQUAL_JMP_IF_FALSE", 2, 1, c, offset);
+        case ROP_CALL:
+            return reg_call_instruction ("ROP_CALL", c, offset);
+        case ROP_TAIL_CALL:
+            return reg_call_instruction ("ROP_TAIL_CALL", c, offset);
+        case ROP_RETURN:
+            return reg_instruction ("ROP_RETURN", 1, c, offset);
+        default:
+            printf ("Unknown opcode: %d\n", instruction);
+            return offset + 1;
+    }
+}
+
+/* ##################################################################################### */
+
+int disassemble_instruction (VM *vm, Chunk *c, int offset) {
     printf ("%04d ", offset);
     
-    if (offset > 0 && c->lines[offset] == c->lines[offset - 1]) 
+    int line = get_line (c, offset);
+    if (offset > 0 && line == get_line (c, offset - 1)) 
         printf ("   | ");
     else
-        printf ("%4d ", c->lines[offset]);
+        printf ("%4d ", line);
+
+    if (vm->register_mode) return disassemble_reg_instruction (vm, c, offset);
 
     uint8_t instruction = c->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constant_instruction ("OP_CONSTANT", c, offset);
+        case OP_CONSTANT_LONG:
+            return constant_long_instruction ("OP_CONSTANT_LONG", c, offset);
         case OP_NIL:
             return simple_instruction ("OP_NIL", offset);
         case OP_TRUE:
@@ -74,11 +266,11 @@ int disassemble_instruction (Chunk *c, int offset) {
         case OP_POP:
             return simple_instruction ("OP_POP", offset); 
         case OP_DEFINE_GLOBAL:
-            return constant_instruction ("OP_DEFINE_GLOBAL", c, offset);
+            return global_instruction (vm, "OP_DEFINE_GLOBAL", c, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction ("OP_GET_GLOBAL", c, offset);
+            return global_instruction (vm, "OP_GET_GLOBAL", c, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction ("OP_SET_GLOBAL", c, offset);
+            return global_instruction (vm, "OP_SET_GLOBAL", c, offset);
         case OP_GET_LOCAL:
             return byte_instruction ("OP_GET_LOCAL", c, offset);
         case OP_SET_LOCAL:
@@ -87,10 +279,16 @@ int disassemble_instruction (Chunk *c, int offset) {
             return simple_instruction ("OP_NEGATE", offset);
         case OP_EQUAL:
             return simple_instruction ("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simple_instruction ("OP_NOT_EQUAL", offset);
         case OP_GREATER:
             return simple_instruction ("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction ("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simple_instruction ("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simple_instruction ("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simple_instruction ("OP_ADD", offset);
         case OP_SUBTRACT:
@@ -109,10 +307,44 @@ int disassemble_instruction (Chunk *c, int offset) {
             return jmp_instruction ("OP_JMP_IF_FALSE", 1, c, offset);
         case OP_LOOP:
             return jmp_instruction ("OP_LOOP", -1, c, offset);
+        case OP_LOOP_TRACE:
+            return jmp_instruction ("OP_LOOP_TRACE", -1, c, offset);
         case OP_CALL:
             return byte_instruction ("OP_CALL", c, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction ("OP_TAIL_CALL", c, offset);
         case OP_RETURN:
             return simple_instruction ("OP_RETURN", offset);
+        case OP_EQUAL_JMP_IF_FALSE:
+            return jmp_instruction ("OP_EQUAL_JMP_IF_FALSE", 1, c, offset);
+        case OP_NOT_EQUAL_JMP_IF_FALSE:
+            return jmp_instruction ("OP_NOT_EQUAL_JMP_IF_FALSE", 1, c, offset);
+        case OP_GREATER_JMP_IF_FALSE:
+            return jmp_instruction ("OP_GREATER_JMP_IF_FALSE", 1, c, offset);
+        case OP_GREATER_EQUAL_JMP_IF_FALSE:
+            return jmp_instruction ("OP_GREATER_EQUAL_JMP_IF_FALSE", 1, c, offset);
+        case OP_LESS_JMP_IF_FALSE:
+            return jmp_instruction ("OP_LESS_JMP_IF_FALSE", 1, c, offset);
+        case OP_LESS_EQUAL_JMP_IF_FALSE:
+            return jmp_instruction ("OP_LESS_EQUAL_JMP_IF_FALSE", 1, c, offset);
+        case OP_GET_LOCAL_ADD_CONST:
+            return local_constant_instruction ("OP_GET_LOCAL_ADD_CONST", c, offset);
+        case OP_GET_LOCAL_SUB_CONST:
+            return local_constant_instruction ("OP_GET_LOCAL_SUB_CONST", c, offset);
+        case OP_ADD_NUM:
+            return simple_instruction ("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simple_instruction ("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simple_instruction ("OP_EQUAL_NUM", offset);
+        case OP_NOT_EQUAL_NUM:
+            return simple_instruction ("OP_NOT_EQUAL_NUM", offset);
+        case OP_ADD_ANY:
+            return simple_instruction ("OP_ADD_ANY", offset);
+        case OP_EQUAL_ANY:
+            return simple_instruction ("OP_EQUAL_ANY", offset);
+        case OP_NOT_EQUAL_ANY:
+            return simple_instruction ("OP_NOT_EQUAL_ANY", offset);
         default:
             printf ("Unknown opcode: %d\n", instruction);
             return offset + 1;
@@ -2,10 +2,11 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 /* ##################################################################################### */
 
-void disassemble_chunk (Chunk *c, const char *name);
-int disassemble_instruction (Chunk *c, int offset);
+void disassemble_chunk (VM *vm, Chunk *c, const char *name);
+int disassemble_instruction (VM *vm, Chunk *c, int offset);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,943 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+/* ##################################################################################### */
+
+/* The JIT works like a template compiler: every instruction has a small
+    C function doing its work, and a function's native code is the
+    sequence of calls to them, with the operand address baked in. The
+    hottest instructions are written out as machine code instead. Jumps
+    become native jumps, so there is no dispatch left at all. Calls and
+    returns go back to jit_run (), which lets the interpreter or native
+    code continue with the new topmost frame. */
+
+/* Upper bound of the machine code emitted for a single instruction. */
+#define MAX_OP_SIZE 128
+
+/* How many calls from native code into native code may be nested on
+    the C stack before they go through jit_run () instead. */
+#define MAX_NESTING 256
+
+/* ##################################################################################### */
+
+/* What the C function of an instruction returns. Anything past
+    JIT_TAKEN makes the native code return to jit_run (). */
+typedef enum {
+    JIT_NEXT,           /* Go on with the next instruction. */
+    JIT_TAKEN,          /* Take the jump of a conditional branch. */
+    JIT_EXIT_FRAME,     /* A call or return changed the topmost frame. */
+    JIT_EXIT_DONE,      /* The script itself returned. */
+    JIT_EXIT_ERROR,     /* A runtime error has been reported. */
+}   JitStatus;
+
+/* ##################################################################################### */
+
+/* How the native code deals with the status of an instruction. */
+typedef enum {
+    KIND_PLAIN,         /* Cannot fail, the status is ignored. */
+    KIND_CHECKED,       /* Returns to jit_run () unless JIT_NEXT. */
+    KIND_BRANCH,        /* Jumps on JIT_TAKEN, returns past that. */
+    KIND_JUMP,          /* Unconditional jump, no C function at all. */
+    KIND_EXIT,          /* Always returns to jit_run (). */
+}   OpKind;
+
+/* ##################################################################################### */
+
+/* IP points right after the opcode, just like in run (). */
+typedef JitStatus (*OpFn)(VM *vm, uint8_t *ip);
+
+typedef struct {
+    OpFn fn;
+    OpKind kind;
+}   JitOp;
+
+/* ##################################################################################### */
+
+/* Enters native code at TARGET, running in the frame with SLOTS. */
+typedef JitStatus (*JitEntry)(uint8_t *target, Value *slots, Value **sp);
+
+/* ##################################################################################### */
+
+#define READ_BYTE()     (*ip++)
+#define CONSTANTS()     (vm->jit_frame->function->c.constants.values)
+#define READ_CONSTANT() (CONSTANTS()[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, CONSTANTS()[(ip[-3] << 16) | (ip[-2] << 8) | ip[-1]])
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_GLOBAL()   (&vm->globals[READ_SHORT()])
+#define PUSH(val)       (*vm->sp++ = (val))
+#define POP()           (*--vm->sp)
+#define PEEK(distance)  (vm->sp[-1 - (distance)])
+#define RUNTIME_ERROR(...)                                \
+    do {                                                  \
+        vm->jit_frame->ip = ip;                           \
+        runtime_error (vm, __VA_ARGS__);                  \
+        return JIT_EXIT_ERROR;                            \
+    } while (false)
+#define BINARY_OP(value_type, op)                         \
+    do {                                                  \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        double b = AS_NUMBER(POP());                      \
+        double a = AS_NUMBER(POP());                      \
+        PUSH(value_type(a op b));                         \
+        return JIT_NEXT;                                  \
+    } while (false)
+#define COMPARE_JMP_IF_FALSE(op)                          \
+    do {                                                  \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        double b = AS_NUMBER(POP());                      \
+        double a = AS_NUMBER(POP());                      \
+        return (a op b) ? JIT_NEXT : JIT_TAKEN;           \
+    } while (false)
+
+/* ##################################################################################### */
+
+static JitStatus op_constant (VM *vm, uint8_t *ip) {
+    PUSH(READ_CONSTANT());
+    return JIT_NEXT;
+}
+
+static JitStatus op_constant_long (VM *vm, uint8_t *ip) {
+    PUSH(READ_CONSTANT_LONG());
+    return JIT_NEXT;
+}
+
+static JitStatus op_nil (VM *vm, uint8_t *ip) {
+    PUSH(NIL_VAL);
+    return JIT_NEXT;
+}
+
+static JitStatus op_true (VM *vm, uint8_t *ip) {
+    PUSH(BOOL_VAL(true));
+    return JIT_NEXT;
+}
+
+static JitStatus op_false (VM *vm, uint8_t *ip) {
+    PUSH(BOOL_VAL(false));
+    return JIT_NEXT;
+}
+
+static JitStatus op_pop (VM *vm, uint8_t *ip) {
+    vm->sp--;
+    return JIT_NEXT;
+}
+
+static JitStatus op_negate (VM *vm, uint8_t *ip) {
+    if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
+    }
+    vm->sp[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+    return JIT_NEXT;
+}
+
+/* ##################################################################################### */
+
+static JitStatus op_define_global (VM *vm, uint8_t *ip) {
+    Global *global = READ_GLOBAL();
+    global->val = POP();
+    GC_SHADE(vm, global->val);
+    return JIT_NEXT;
+}
+
+static JitStatus op_get_global (VM *vm, uint8_t *ip) {
+    Global *global = READ_GLOBAL();
+    if (IS_UNDEFINED(global->val)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+    }
+    PUSH(global->val);
+    return JIT_NEXT;
+}
+
+static JitStatus op_set_global (VM *vm, uint8_t *ip) {
+    Global *global = READ_GLOBAL();
+    if (IS_UNDEFINED(global->val)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+    }
+    global->val = PEEK(0);
+    GC_SHADE(vm, global->val);
+    return JIT_NEXT;
+}
+
+static JitStatus op_get_local (VM *vm, uint8_t *ip) {
+    PUSH(vm->jit_frame->slots[READ_BYTE()]);
+    return JIT_NEXT;
+}
+
+static JitStatus op_set_local (VM *vm, uint8_t *ip) {
+    vm->jit_frame->slots[READ_BYTE()] = PEEK(0);
+    return JIT_NEXT;
+}
+
+/* ##################################################################################### */
+
+static JitStatus op_equal (VM *vm, uint8_t *ip) {
+    Value b = POP();
+    Value a = POP();
+    PUSH(BOOL_VAL(values_equal (a, b)));
+    return JIT_NEXT;
+}
+
+static JitStatus op_not_equal (VM *vm, uint8_t *ip) {
+    Value b = POP();
+    Value a = POP();
+    PUSH(BOOL_VAL(!values_equal (a, b)));
+    return JIT_NEXT;
+}
+
+static JitStatus op_greater (VM *vm, uint8_t *ip) {
+    BINARY_OP(BOOL_VAL, >);
+}
+
+static JitStatus op_greater_equal (VM *vm, uint8_t *ip) {
+    BINARY_OP(BOOL_VAL, >=);
+}
+
+static JitStatus op_less (VM *vm, uint8_t *ip) {
+    BINARY_OP(BOOL_VAL, <);
+}
+
+static JitStatus op_less_equal (VM *vm, uint8_t *ip) {
+    BINARY_OP(BOOL_VAL, <=);
+}
+
+/* Also used for the quickened variants; the number check comes first
+    since that is what hot code adds. */
+static JitStatus op_add (VM *vm, uint8_t *ip) {
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
+    } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        concatenate (vm);
+    } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+    }
+    return JIT_NEXT;
+}
+
+static JitStatus op_subtract (VM *vm, uint8_t *ip) { BINARY_OP(NUMBER_VAL, -); }
+static JitStatus op_multiply (VM *vm, uint8_t *ip) { BINARY_OP(NUMBER_VAL, *); }
+static JitStatus op_divide (VM *vm, uint8_t *ip)   { BINARY_OP(NUMBER_VAL, /); }
+
+static JitStatus op_not (VM *vm, uint8_t *ip) {
+    vm->sp[-1] = BOOL_VAL(is_falsey (PEEK(0)));
+    return JIT_NEXT;
+}
+
+static JitStatus op_print (VM *vm, uint8_t *ip) {
+    print_value (POP());
+    printf ("\n");
+    return JIT_NEXT;
+}
+
+/* ##################################################################################### */
+
+static JitStatus op_jmp_if_false (VM *vm, uint8_t *ip) {
+    return is_falsey (PEEK(0)) ? JIT_TAKEN : JIT_NEXT;
+}
+
+static JitStatus op_equal_jmp_if_false (VM *vm, uint8_t *ip) {
+    Value b = POP();
+    Value a = POP();
+    return values_equal (a, b) ? JIT_NEXT : JIT_TAKEN;
+}
+
+static JitStatus op_not_equal_jmp_if_false (VM *vm, uint8_t *ip) {
+    Value b = POP();
+    Value a = POP();
+    return values_equal (a, b) ? JIT_TAKEN : JIT_NEXT;
+}
+
+static JitStatus op_greater_jmp_if_false (VM *vm, uint8_t *ip) {
+    COMPARE_JMP_IF_FALSE(>);
+}
+
+static JitStatus op_greater_equal_jmp_if_false (VM *vm, uint8_t *ip) {
+    COMPARE_JMP_IF_FALSE(>=);
+}
+
+static JitStatus op_less_jmp_if_false (VM *vm, uint8_t *ip) {
+    COMPARE_JMP_IF_FALSE(<);
+}
+
+static JitStatus op_less_equal_jmp_if_false (VM *vm, uint8_t *ip) {
+    COMPARE_JMP_IF_FALSE(<=);
+}
+
+/* ##################################################################################### */
+
+static JitStatus op_get_local_add_const (VM *vm, uint8_t *ip) {
+    Value a = vm->jit_frame->slots[READ_BYTE()];
+    Value b = READ_CONSTANT();
+    if (!IS_NUMBER(a)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+    }
+    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+    return JIT_NEXT;
+}
+
+static JitStatus op_get_local_sub_const (VM *vm, uint8_t *ip) {
+    Value a = vm->jit_frame->slots[READ_BYTE()];
+    Value b = READ_CONSTANT();
+    if (!IS_NUMBER(a)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+    }
+    PUSH(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+    return JIT_NEXT;
+}
+
+/* ##################################################################################### */
+
+static JitStatus enter (VM *vm);
+
+/* A call to a native function finishes right here, and so does a call
+    to a clox function with native code: that code runs right away on
+    the C stack. Anything else goes back to jit_run () to be handed to
+    the interpreter. */
+static JitStatus op_call (VM *vm, uint8_t *ip) {
+    int arg_count = READ_BYTE();
+    int frame_count = vm->frame_count;
+    vm->jit_frame->ip = ip;
+    if (!call_value (vm, PEEK(arg_count), arg_count)) {
+        return JIT_EXIT_ERROR;
+    }
+    if (vm->frame_count == frame_count) return JIT_NEXT;
+    if (vm->frames[vm->frame_count - 1].function->jit == NULL ||
+        vm->jit_nesting == MAX_NESTING) {
+        return JIT_EXIT_FRAME;
+    }
+
+    vm->jit_nesting++;
+    JitStatus status = enter (vm);
+    vm->jit_nesting--;
+    /* Unless the callee simply returned to us, let jit_run () sort out
+        whatever frame is on top now. */
+    if (status != JIT_EXIT_FRAME || vm->frame_count != frame_count) {
+        return status;
+    }
+    vm->jit_frame = &vm->frames[frame_count - 1];
+    return JIT_NEXT;
+}
+
+/* A tail call into a clox function replaced the frame, and jit_run ()
+    picks up from there. Unwinding the native code first keeps the C
+    stack flat for tail-recursive loops. */
+static JitStatus op_tail_call (VM *vm, uint8_t *ip) {
+    int arg_count = READ_BYTE();
+    bool replaces_frame = IS_FUNCTION(PEEK(arg_count));
+    vm->jit_frame->ip = ip;
+    if (!tail_call_value (vm, PEEK(arg_count), arg_count)) {
+        return JIT_EXIT_ERROR;
+    }
+    return replaces_frame ? JIT_EXIT_FRAME : JIT_NEXT;
+}
+
+static JitStatus op_return (VM *vm, uint8_t *ip) {
+    Value result = POP();
+    vm->frame_count--;
+    if (vm->frame_count == 0) {
+        vm->sp--;
+        return JIT_EXIT_DONE;
+    }
+    vm->sp = vm->jit_frame->slots;
+    PUSH(result);
+    return JIT_EXIT_FRAME;
+}
+
+#ifdef TRACING_JIT
+/* A loop got hot in native code, or has a trace already. Unless it
+    cannot be traced, the trace runs and jit_run () carries on wherever
+    it exited. */
+static JitStatus op_loop_trace (VM *vm, uint8_t *ip) {
+    uint16_t offset = READ_SHORT();
+    CallFrame *frame = vm->jit_frame;
+    frame->ip = ip - offset;
+    HOT_LOOP(vm, frame->ip) = TRACE_HOT_LOOP;
+    if (!vm->trace_enabled || !trace_record (vm, frame)) return JIT_TAKEN;
+    trace_run (vm, frame);
+    return JIT_EXIT_FRAME;
+}
+#endif
+
+#undef READ_BYTE
+#undef CONSTANTS
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_SHORT
+#undef READ_GLOBAL
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef COMPARE_JMP_IF_FALSE
+
+/* ##################################################################################### */
+
+static const JitOp jit_ops[UINT8_COUNT] = {
+    [OP_CONSTANT]       = {op_constant,       KIND_PLAIN},
+    [OP_CONSTANT_LONG]  = {op_constant_long,  KIND_PLAIN},
+    [OP_NIL]            = {op_nil,            KIND_PLAIN},
+    [OP_TRUE]           = {op_true,           KIND_PLAIN},
+    [OP_FALSE]          = {op_false,          KIND_PLAIN},
+    [OP_POP]            = {op_pop,            KIND_PLAIN},
+    [OP_NEGATE]         = {op_negate,         KIND_CHECKED},
+    [OP_DEFINE_GLOBAL]  = {op_define_global,  KIND_PLAIN},
+    [OP_GET_GLOBAL]     = {op_get_global,     KIND_CHECKED},
+    [OP_SET_GLOBAL]     = {op_set_global,     KIND_CHECKED},
+    [OP_GET_LOCAL]      = {op_get_local,      KIND_PLAIN},
+    [OP_SET_LOCAL]      = {op_set_local,      KIND_PLAIN},
+    [OP_EQUAL]          = {op_equal,          KIND_PLAIN},
+    [OP_NOT_EQUAL]      = {op_not_equal,      KIND_PLAIN},
+    [OP_GREATER]        = {op_greater,        KIND_CHECKED},
+    [OP_GREATER_EQUAL]  = {op_greater_equal,  KIND_CHECKED},
+    [OP_LESS]           = {op_less,           KIND_CHECKED},
+    [OP_LESS_EQUAL]     = {op_less_equal,     KIND_CHECKED},
+    [OP_ADD]            = {op_add,            KIND_CHECKED},
+    [OP_SUBTRACT]       = {op_subtract,       KIND_CHECKED},
+    [OP_MULTIPLY]       = {op_multiply,       KIND_CHECKED},
+    [OP_DIVIDE]         = {op_divide,         KIND_CHECKED},
+    [OP_NOT]            = {op_not,            KIND_PLAIN},
+    [OP_PRINT]          = {op_print,          KIND_PLAIN},
+    [OP_JMP]            = {NULL,              KIND_JUMP},
+    [OP_JMP_IF_FALSE]   = {op_jmp_if_false,   KIND_BRANCH},
+    [OP_LOOP]           = {NULL,              KIND_JUMP},
+    [OP_CALL]           = {op_call,           KIND_CHECKED},
+    [OP_TAIL_CALL]      = {op_tail_call,      KIND_CHECKED},
+    [OP_RETURN]         = {op_return,         KIND_EXIT},
+    [OP_EQUAL_JMP_IF_FALSE]         = {op_equal_jmp_if_false,         KIND_BRANCH},
+    [OP_NOT_EQUAL_JMP_IF_FALSE]     = {op_not_equal_jmp_if_false,     KIND_BRANCH},
+    [OP_GREATER_JMP_IF_FALSE]       = {op_greater_jmp_if_false,       KIND_BRANCH},
+    [OP_GREATER_EQUAL_JMP_IF_FALSE] = {op_greater_equal_jmp_if_false, KIND_BRANCH},
+    [OP_LESS_JMP_IF_FALSE]          = {op_less_jmp_if_false,          KIND_BRANCH},
+    [OP_LESS_EQUAL_JMP_IF_FALSE]    = {op_less_equal_jmp_if_false,    KIND_BRANCH},
+    [OP_GET_LOCAL_ADD_CONST]        = {op_get_local_add_const,        KIND_CHECKED},
+    [OP_GET_LOCAL_SUB_CONST]        = {op_get_local_sub_const,        KIND_CHECKED},
+    [OP_ADD_NUM]        = {op_add,            KIND_CHECKED},
+    [OP_ADD_STR]        = {op_add,            KIND_CHECKED},
+    [OP_EQUAL_NUM]      = {op_equal,          KIND_PLAIN},
+    [OP_NOT_EQUAL_NUM]  = {op_not_equal,      KIND_PLAIN},
+    [OP_ADD_ANY]        = {op_add,            KIND_CHECKED},
+    [OP_EQUAL_ANY]      = {op_equal,          KIND_PLAIN},
+    [OP_NOT_EQUAL_ANY]  = {op_not_equal,      KIND_PLAIN},
+#ifdef TRACING_JIT
+    [OP_LOOP_TRACE]     = {op_loop_trace,     KIND_BRANCH},
+#endif
+};
+
+/* ##################################################################################### */
+
+/* Machine code being written. */
+typedef struct {
+    uint8_t *code;
+    int count;
+}   Buffer;
+
+/* A rel32 jump operand at AT that should land on bytecode offset TARGET. */
+typedef struct {
+    int at;
+    int target;
+}   Fixup;
+
+/* Native code keeps rbx = &vm->sp, r12 = frame->slots and r13 = the
+    stack top in callee-saved registers. vm->sp is only brought up to
+    date around the calls into C. The entry stub sets them up; every
+    return to C goes through the shared epilogue right behind it. */
+#define ENTRY_SIZE  0x15
+#define EPILOGUE    ENTRY_SIZE
+
+/* ##################################################################################### */
+
+static void emit32 (Buffer *b, uint32_t word) {
+    memcpy (&b->code[b->count], &word, sizeof (word));
+    b->count += sizeof (word);
+}
+
+static void emit64 (Buffer *b, uint64_t word) {
+    memcpy (&b->code[b->count], &word, sizeof (word));
+    b->count += sizeof (word);
+}
+
+static void emit_bytes (Buffer *b, const uint8_t *bytes, int count) {
+    memcpy (&b->code[b->count], bytes, count);
+    b->count += count;
+}
+
+#define EMIT(...)                                           \
+    do {                                                    \
+        const uint8_t bytes_[] = {__VA_ARGS__};             \
+        emit_bytes (b, bytes_, sizeof (bytes_));            \
+    } while (false)
+
+/* ##################################################################################### */
+
+/* Writes a rel32 operand landing on the native offset TARGET. */
+static void emit_rel32 (Buffer *b, int target) {
+    emit32 (b, (uint32_t) (target - (b->count + 4)));
+}
+
+/* Writes a rel32 placeholder, to be patched to bytecode offset TARGET. */
+static void emit_target (Buffer *b, Fixup *fixups, int *fixup_count,
+                         int target) {
+    fixups[*fixup_count].at = b->count;
+    fixups[*fixup_count].target = target;
+    (*fixup_count)++;
+    emit32 (b, 0);
+}
+
+/* ##################################################################################### */
+
+static int jmp_target (Chunk *c, int offset) {
+    int jmp = (c->code[offset + 1] << 8) | c->code[offset + 2];
+    if (c->code[offset] == OP_LOOP || c->code[offset] == OP_LOOP_TRACE) {
+        return offset + 3 - jmp;
+    }
+    return offset + 3 + jmp;
+}
+
+/* ##################################################################################### */
+
+/* Displacement of FIELD of the VM from rbx, which points at its sp.
+    Native code reaches the VM only through rbx and never has its
+    address baked in. */
+#define VM_DISP(field) \
+    ((uint32_t) ((int32_t) offsetof(VM, field) - (int32_t) offsetof(VM, sp)))
+
+/* fn (vm, ip), with vm->sp written back before and reloaded after. */
+static void emit_call (Buffer *b, OpFn fn, uint8_t *ip) {
+    EMIT(0x4c, 0x89, 0x2b);                 /* mov [rbx], r13 */
+    EMIT(0x48, 0x8d, 0xbb);                 /* lea rdi, [rbx + disp32] */
+    emit32 (b, (uint32_t) -(int32_t) offsetof(VM, sp));
+    EMIT(0x48, 0xbe);                       /* mov rsi, imm64 */
+    emit64 (b, (uint64_t) (uintptr_t) ip);
+    EMIT(0x48, 0xb8);                       /* mov rax, imm64 */
+    emit64 (b, (uint64_t) (uintptr_t) fn);
+    EMIT(0xff, 0xd0);                       /* call rax */
+    EMIT(0x4c, 0x8b, 0x2b);                 /* mov r13, [rbx] */
+}
+
+/* Calls the C function of the instruction at OFFSET and acts on its
+    status the way its kind says. */
+static void emit_op (Buffer *b, Chunk *c, int offset,
+                     Fixup *fixups, int *fixup_count) {
+    const JitOp *op = &jit_ops[c->code[offset]];
+    emit_call (b, op->fn, &c->code[offset + 1]);
+    switch (op->kind) {
+        case KIND_CHECKED:
+            EMIT(0x85, 0xc0);                   /* test eax, eax */
+            EMIT(0x0f, 0x85);                   /* jnz epilogue */
+            emit_rel32 (b, EPILOGUE);
+            break;
+        case KIND_BRANCH:
+            EMIT(0x83, 0xf8, JIT_TAKEN);        /* cmp eax, JIT_TAKEN */
+            EMIT(0x0f, 0x84);                   /* je target */
+            emit_target (b, fixups, fixup_count, jmp_target (c, offset));
+            EMIT(0x0f, 0x87);                   /* ja epilogue */
+            emit_rel32 (b, EPILOGUE);
+            break;
+        case KIND_EXIT:
+            EMIT(0xe9);                         /* jmp epilogue */
+            emit_rel32 (b, EPILOGUE);
+            break;
+        default:
+            break;
+    }
+
+    if (c->code[offset] == OP_CALL) {
+        /* The callee may have moved the value stack. */
+        EMIT(0x48, 0x8b, 0x83);                 /* mov rax, vm->jit_frame */
+        emit32 (b, VM_DISP(jit_frame));
+        EMIT(0x4c, 0x8b, 0x60,                  /* mov r12, [rax + slots] */
+             (uint8_t) offsetof(CallFrame, slots));
+    }
+}
+
+#ifdef TRACING_JIT
+/* OP_LOOP counts down the hot counter of its loop, like in run (), and
+    only calls op_loop_trace () once that runs out. */
+static void emit_hot_loop (Buffer *b, Chunk *c, int offset,
+                           Fixup *fixups, int *fixup_count) {
+    int target = jmp_target (c, offset);
+    int slot = (int) ((uintptr_t) &c->code[target] % HOT_LOOP_SLOTS);
+    EMIT(0xfe, 0x8b);                       /* dec byte [rbx + disp32] */
+    emit32 (b, VM_DISP(hot_loops) + slot);
+    EMIT(0x0f, 0x85);                       /* jnz target */
+    emit_target (b, fixups, fixup_count, target);
+    emit_call (b, op_loop_trace, &c->code[offset + 1]);
+    EMIT(0x83, 0xf8, JIT_TAKEN);            /* cmp eax, JIT_TAKEN */
+    EMIT(0x0f, 0x84);                       /* je target */
+    emit_target (b, fixups, fixup_count, target);
+    EMIT(0xe9);                             /* jmp epilogue */
+    emit_rel32 (b, EPILOGUE);
+}
+#endif
+
+/* ##################################################################################### */
+
+/* With NaN boxing a Value is a plain 64-bit word, so the hot stack and
+    number instructions are simple enough to be written out as machine
+    code. Anything off their fast path falls back to the C function. */
+
+/* Writes a short jump with condition code CC, returning where its
+    operand goes for patch_short (). */
+static int emit_short (Buffer *b, uint8_t cc) {
+    EMIT(cc, 0x00);
+    return b->count - 1;
+}
+
+static void patch_short (Buffer *b, int at) {
+    b->code[at] = (uint8_t) (b->count - (at + 1));
+}
+
+static void emit_push_rax (Buffer *b) {
+    EMIT(0x49, 0x89, 0x45, 0x00);           /* mov [r13], rax */
+    EMIT(0x49, 0x83, 0xc5, 0x08);           /* add r13, 8 */
+}
+
+static void emit_push_imm (Buffer *b, Value value) {
+    EMIT(0x48, 0xb8);                       /* mov rax, imm64 */
+    emit64 (b, value);
+    emit_push_rax (b);
+}
+
+/* rax (or rcx) = the constant at INDEX. Loaded through its address, so the
+    constant table stays the only place holding the value. */
+static void emit_load_constant (Buffer *b, Chunk *c, int index, bool rcx) {
+    EMIT(0x48, rcx ? 0xb9 : 0xb8);          /* mov rcx/rax, imm64 */
+    emit64 (b, (uint64_t) (uintptr_t) &c->constants.values[index]);
+    if (rcx) EMIT(0x48, 0x8b, 0x09);        /* mov rcx, [rcx] */
+    else EMIT(0x48, 0x8b, 0x00);            /* mov rax, [rax] */
+}
+
+/* rdx = &vm->globals[SLOT].val, rax = its value. vm->globals is read
+    anew every time since it moves when it grows. */
+static void emit_load_global (Buffer *b, int slot) {
+    EMIT(0x48, 0x8b, 0x83);                 /* mov rax, vm->globals */
+    emit32 (b, VM_DISP(globals));
+    EMIT(0x48, 0x8d, 0x90);                 /* lea rdx, [rax + disp32] */
+    emit32 (b, (uint32_t) (slot * sizeof (Global) + offsetof(Global, val)));
+    EMIT(0x48, 0x8b, 0x02);                 /* mov rax, [rdx] */
+}
+
+/* Jumps to the returned short jump if rax holds UNDEFINED_VAL. */
+static int emit_defined_check (Buffer *b) {
+    EMIT(0x48, 0xb9);                       /* mov rcx, UNDEFINED_VAL */
+    emit64 (b, UNDEFINED_VAL);
+    EMIT(0x48, 0x39, 0xc8);                 /* cmp rax, rcx */
+    return emit_short (b, 0x74);            /* je slow */
+}
+
+static void emit_load_local (Buffer *b, int slot) {
+    EMIT(0x49, 0x8b, 0x84, 0x24);           /* mov rax, [r12 + disp32] */
+    emit32 (b, (uint32_t) slot * sizeof (Value));
+}
+
+/* Jumps to the returned short jump unless rax (and rcx if BOTH) hold
+    numbers. */
+static int emit_number_check (Buffer *b, bool both, int *second) {
+    EMIT(0x48, 0xbe);                       /* mov rsi, QNAN */
+    emit64 (b, QNAN);
+    EMIT(0x48, 0x89, 0xc2);                 /* mov rdx, rax */
+    EMIT(0x48, 0x21, 0xf2);                 /* and rdx, rsi */
+    EMIT(0x48, 0x39, 0xf2);                 /* cmp rdx, rsi */
+    int first = emit_short (b, 0x74);       /* je slow */
+    if (both) {
+        EMIT(0x48, 0x89, 0xca);             /* mov rdx, rcx */
+        EMIT(0x48, 0x21, 0xf2);             /* and rdx, rsi */
+        EMIT(0x48, 0x39, 0xf2);             /* cmp rdx, rsi */
+        *second = emit_short (b, 0x74);     /* je slow */
+    }
+    return first;
+}
+
+/* Pops two numbers into xmm0 and xmm1, or goes to the slow path. */
+static int emit_pop_numbers (Buffer *b, int *second) {
+    EMIT(0x49, 0x8b, 0x45, 0xf0);           /* mov rax, [r13 - 16] */
+    EMIT(0x49, 0x8b, 0x4d, 0xf8);           /* mov rcx, [r13 - 8] */
+    int first = emit_number_check (b, true, second);
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0);     /* movq xmm0, rax */
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc9);     /* movq xmm1, rcx */
+    EMIT(0x49, 0x83, 0xed, 0x10);           /* sub r13, 16 */
+    return first;
+}
+
+/* Emits the fast path of the instruction at OFFSET followed by its slow
+    path. Returns false if the instruction has no fast path. */
+static bool emit_inline (Buffer *b, Chunk *c, int offset,
+                         Fixup *fixups, int *fixup_count) {
+    uint8_t *ip = &c->code[offset + 1];
+    int first, second = -1;
+    uint8_t sse;
+
+    switch (c->code[offset]) {
+        case OP_CONSTANT:
+            emit_load_constant (b, c, ip[0], false);
+            emit_push_rax (b);
+            return true;
+        case OP_CONSTANT_LONG:
+            emit_load_constant (b, c, (ip[0] << 16) | (ip[1] << 8) | ip[2], 
+                                false);
+            emit_push_rax (b);
+            return true;
+        case OP_NIL:   emit_push_imm (b, NIL_VAL); return true;
+        case OP_TRUE:  emit_push_imm (b, TRUE_VAL); return true;
+        case OP_FALSE: emit_push_imm (b, FALSE_VAL); return true;
+        case OP_POP:
+            EMIT(0x49, 0x83, 0xed, 0x08);       /* sub r13, 8 */
+            return true;
+        case OP_GET_LOCAL:
+            emit_load_local (b, ip[0]);
+            emit_push_rax (b);
+            return true;
+        case OP_SET_LOCAL:
+            EMIT(0x49, 0x8b, 0x45, 0xf8);       /* mov rax, [r13 - 8] */
+            EMIT(0x49, 0x89, 0x84, 0x24);       /* mov [r12 + disp32], rax */
+            emit32 (b, (uint32_t) ip[0] * sizeof (Value));
+            return true;
+        case OP_GET_GLOBAL:
+            emit_load_global (b, (ip[0] << 8) | ip[1]);
+            first = emit_defined_check (b);
+            emit_push_rax (b);
+            break;
+        case OP_SET_GLOBAL:
+            /* The write barrier is left to the C function. */
+            EMIT(0x83, 0xbb);                   /* cmp vm->gc_phase, GC_MARK */
+            emit32 (b, VM_DISP(gc_phase));
+            EMIT(GC_MARK);
+            second = emit_short (b, 0x74);      /* je slow */
+            emit_load_global (b, (ip[0] << 8) | ip[1]);
+            first = emit_defined_check (b);
+            EMIT(0x49, 0x8b, 0x45, 0xf8);       /* mov rax, [r13 - 8] */
+            EMIT(0x48, 0x89, 0x02);             /* mov [rdx], rax */
+            break;
+        case OP_JMP_IF_FALSE:
+            EMIT(0x49, 0x8b, 0x45, 0xf8);       /* mov rax, [r13 - 8] */
+            EMIT(0x48, 0xb9);                   /* mov rcx, NIL_VAL */
+            emit64 (b, NIL_VAL);
+            EMIT(0x48, 0x39, 0xc8);             /* cmp rax, rcx */
+            EMIT(0x0f, 0x84);                   /* je target */
+            emit_target (b, fixups, fixup_count, jmp_target (c, offset));
+            EMIT(0x48, 0xb9);                   /* mov rcx, FALSE_VAL */
+            emit64 (b, FALSE_VAL);
+            EMIT(0x48, 0x39, 0xc8);             /* cmp rax, rcx */
+            EMIT(0x0f, 0x84);                   /* je target */
+            emit_target (b, fixups, fixup_count, jmp_target (c, offset));
+            return true;
+
+        case OP_ADD:
+        case OP_ADD_NUM:  sse = 0x58; goto arithmetic;
+        case OP_SUBTRACT: sse = 0x5c; goto arithmetic;
+        case OP_MULTIPLY: sse = 0x59; goto arithmetic;
+        case OP_DIVIDE:   sse = 0x5e; goto arithmetic;
+        arithmetic:
+            first = emit_pop_numbers (b, &second);
+            EMIT(0xf2, 0x0f, sse, 0xc1);        /* op xmm0, xmm1 */
+            EMIT(0x66, 0x41, 0x0f, 0xd6, 0x45, 0x00);   /* movq [r13], xmm0 */
+            EMIT(0x49, 0x83, 0xc5, 0x08);       /* add r13, 8 */
+            break;
+
+        /* ucomisd sets CF for "below" and unordered alike, so each test
+            is arranged as "above" or "above or equal" to send NaNs down
+            the false branch like run () does. */
+        case OP_GREATER_JMP_IF_FALSE:       sse = 0x86; goto compare;
+        case OP_GREATER_EQUAL_JMP_IF_FALSE: sse = 0x82; goto compare;
+        case OP_LESS_JMP_IF_FALSE:          sse = 0x86; goto compare_swapped;
+        case OP_LESS_EQUAL_JMP_IF_FALSE:    sse = 0x82; goto compare_swapped;
+        compare:
+            first = emit_pop_numbers (b, &second);
+            EMIT(0x66, 0x0f, 0x2e, 0xc1);       /* ucomisd xmm0, xmm1 */
+            goto branch;
+        compare_swapped:
+            first = emit_pop_numbers (b, &second);
+            EMIT(0x66, 0x0f, 0x2e, 0xc8);       /* ucomisd xmm1, xmm0 */
+        branch:
+            EMIT(0x0f, sse);                    /* jbe / jb target */
+            emit_target (b, fixups, fixup_count, jmp_target (c, offset));
+            break;
+
+        case OP_GET_LOCAL_ADD_CONST: sse = 0x58; goto local_constant;
+        case OP_GET_LOCAL_SUB_CONST: sse = 0x5c; goto local_constant;
+        local_constant:
+            emit_load_local (b, ip[0]);
+            first = emit_number_check (b, false, NULL);
+            emit_load_constant (b, c, ip[1], true);
+            EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0); /* movq xmm0, rax */
+            EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc9); /* movq xmm1, rcx */
+            EMIT(0xf2, 0x0f, sse, 0xc1);        /* op xmm0, xmm1 */
+            EMIT(0x66, 0x41, 0x0f, 0xd6, 0x45, 0x00);   /* movq [r13], xmm0 */
+            EMIT(0x49, 0x83, 0xc5, 0x08);       /* add r13, 8 */
+            break;
+
+        default:
+            return false;
+    }
+
+    /* Slow path: whatever the fast path did not handle, including
+        reporting the error. */
+    int done = emit_short (b, 0xeb);            /* jmp done */
+    patch_short (b, first);
+    if (second != -1) patch_short (b, second);
+    emit_op (b, c, offset, fixups, fixup_count);
+    patch_short (b, done);
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Compiles FUNCTION to native code. Returns false, leaving the function
+    to the interpreter, if any part of that fails. */
+bool jit_compile (ObjFunction *function) {
+    Chunk *c = &function->c;
+
+    for (int offset = 0; offset < c->count;
+         offset += instruction_len (c->code[offset])) {
+        const JitOp *op = &jit_ops[c->code[offset]];
+        if (op->fn == NULL && op->kind != KIND_JUMP) return false;
+    }
+
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    size_t size = ((size_t) c->count * MAX_OP_SIZE + ENTRY_SIZE + 16
+                   + page - 1) / page * page;
+    uint8_t *code = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return false;
+
+    int *offsets = ALLOCATE(int, c->count);
+    Fixup *fixups = ALLOCATE(Fixup, 2 * c->count);
+    int fixup_count = 0;
+    Buffer buffer = {code, 0};
+    Buffer *b = &buffer;
+
+    /* Entry stub, called as entry (target, frame->slots, &vm->sp). The
+        extra 8 bytes keep the stack 16-byte aligned for the calls. */
+    EMIT(0x55);                             /* push rbp */
+    EMIT(0x53);                             /* push rbx */
+    EMIT(0x41, 0x54);                       /* push r12 */
+    EMIT(0x41, 0x55);                       /* push r13 */
+    EMIT(0x48, 0x83, 0xec, 0x08);           /* sub rsp, 8 */
+    EMIT(0x48, 0x89, 0xd3);                 /* mov rbx, rdx */
+    EMIT(0x49, 0x89, 0xf4);                 /* mov r12, rsi */
+    EMIT(0x4c, 0x8b, 0x2b);                 /* mov r13, [rbx] */
+    EMIT(0xff, 0xe7);                       /* jmp rdi */
+
+    /* Epilogue, with the status already in eax and vm->sp up to date. */
+    EMIT(0x48, 0x83, 0xc4, 0x08);           /* add rsp, 8 */
+    EMIT(0x41, 0x5d);                       /* pop r13 */
+    EMIT(0x41, 0x5c);                       /* pop r12 */
+    EMIT(0x5b);                             /* pop rbx */
+    EMIT(0x5d);                             /* pop rbp */
+    EMIT(0xc3);                             /* ret */
+
+    for (int offset = 0; offset < c->count;) {
+        uint8_t opcode = c->code[offset];
+        int len = instruction_len (opcode);
+        for (int i = 0; i < len; i++) offsets[offset + i] = -1;
+        offsets[offset] = b->count;
+
+#ifdef TRACING_JIT
+        if (opcode == OP_LOOP) {
+            emit_hot_loop (b, c, offset, fixups, &fixup_count);
+        } else
+#endif
+        if (jit_ops[opcode].kind == KIND_JUMP) {
+            EMIT(0xe9);                             /* jmp target */
+            emit_target (b, fixups, &fixup_count, jmp_target (c, offset));
+        } else if (!emit_inline (b, c, offset, fixups, &fixup_count)) {
+            emit_op (b, c, offset, fixups, &fixup_count);
+        }
+        offset += len;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < fixup_count; i++) {
+        int target = fixups[i].target;
+        if (target < 0 || target >= c->count || offsets[target] == -1) {
+            ok = false;
+            break;
+        }
+        int32_t rel = offsets[target] - (fixups[i].at + 4);
+        memcpy (&code[fixups[i].at], &rel, sizeof (rel));
+    }
+    FREE_ARRAY(Fixup, fixups, 2 * c->count);
+
+    if (!ok || mprotect (code, size, PROT_READ | PROT_EXEC) != 0) {
+        FREE_ARRAY(int, offsets, c->count);
+        munmap (code, size);
+        return false;
+    }
+
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->offsets = offsets;
+    jit->count = c->count;
+    function->jit = jit;
+    return true;
+}
+
+#undef EMIT
+#undef VM_DISP
+
+/* ##################################################################################### */
+
+/* Runs the native code of the topmost frame, starting at its ip. */
+static JitStatus enter (VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    vm->jit_frame = frame;
+    JitCode *jit = frame->function->jit;
+    JitEntry entry = (JitEntry) (void *) jit->code;
+    int offset = jit->offsets[frame->ip - frame->function->c.code];
+    return entry (jit->code + offset, frame->slots, &vm->sp);
+}
+
+
+/* ##################################################################################### */
+
+/* Runs native code for as long as the topmost frame has any. Returns
+    true with the result in RES when the program finished or failed,
+    and false when the interpreter should take over the topmost frame. */
+bool jit_run (VM *vm, InterpretRes *res) {
+    for (;;) {
+        if (vm->frames[vm->frame_count - 1].function->jit == NULL) {
+            return false;
+        }
+
+        switch (enter (vm)) {
+            case JIT_EXIT_DONE:
+                *res = INTERPRET_OK;
+                return true;
+            case JIT_EXIT_ERROR:
+                *res = INTERPRET_RUNTIME_ERROR;
+                return true;
+            default:
+                break;  /* The topmost frame changed. */
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+void jit_free (JitCode *jit) {
+    munmap (jit->code, jit->size);
+    FREE_ARRAY(int, jit->offsets, jit->count);
+    FREE(JitCode, jit);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+/* ##################################################################################### */
+
+/* Number of calls after which a function is compiled to native code. */
+#define JIT_CALL_THRESHOLD 1000
+
+/* Number of backward jumps after which the function running the loop
+    is compiled, and its frame moves over to native code right at the
+    loop header. */
+#define JIT_LOOP_THRESHOLD 1000
+
+/* ##################################################################################### */
+
+/* Native code for one ObjFunction. Every instruction of the bytecode
+    gets its own piece of machine code, so execution can enter the
+    function at any instruction boundary, e.g. when a call returns. */
+typedef struct JitCode {
+    uint8_t *code;          /* Executable memory, starts with the entry stub. */
+    size_t size;            /* Size of the mapping holding CODE. */
+    int *offsets;           /* Native offset of each bytecode offset, or -1
+                               if the byte is not the start of an instruction. */
+    int count;              /* Number of bytecode bytes. */
+}   JitCode;
+
+/* ##################################################################################### */
+
+bool jit_compile (ObjFunction *function);
+bool jit_run (VM *vm, InterpretRes *res);
+void jit_free (JitCode *jit);
+
+#endif
+
+#endif
\ No newline at end of file
@@ -1,10 +1,17 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 /* ##################################################################################### */
@@ -17,7 +24,12 @@
 
 /* ##################################################################################### */
 
-static void repl () {
+static bool use_cache = false;     /* Set by --cache. */
+static bool gc_stats = false;      /* Set by --gc-stats. */
+
+/* ##################################################################################### */
+
+static void repl (VM *vm) {
     char line[MAX_LINE_LEN];
     for (;;) {
         printf ("> ");
@@ -27,64 +39,168 @@ static void repl () {
             break;
         }
 
-        interpret (line);
+        interpret (vm, line, strlen (line));
     }
 }
 
 /* ##################################################################################### */
 
-static char *read_file (const char *path) {
-    FILE *f = fopen (path, "rb");
-    if (f == NULL) {
+/* Maps the file at PATH read-only and stores its size in LEN. The
+    scanner reads the mapping directly, so the source is never copied. */
+static const char *map_file (const char *path, size_t *len) {
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
         fprintf (stderr, "Could not open file \"%s\".\n", path);
         exit (EX_FILE);
     }
 
-    fseek (f, 0L, SEEK_END);
-    size_t fsize = ftell (f);   
-    rewind (f);
-
-    char *buf = (char *) malloc (fsize + 1);
-    if (buf == NULL) {
-        fprintf (stderr, "Not enough memory to read \"%s\".\n", path);
+    struct stat st;
+    if (fstat (fd, &st) == -1) {
+        fprintf (stderr, "Could not read file \"%s\".\n", path);
         exit (EX_FILE);
     }
-    size_t bytes_read = fread (buf, sizeof (char), fsize, f);
-    if (bytes_read < fsize) {
+    *len = (size_t) st.st_size;
+    if (*len == 0) {
+        /* Empty files cannot be mapped. */
+        close (fd);
+        return "";
+    }
+
+    void *source = mmap (NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (source == MAP_FAILED) {
         fprintf (stderr, "Could not read file \"%s\".\n", path);
         exit (EX_FILE);
     }
-    buf[bytes_read] = '\0';
-
-    fclose (f);
-    return buf;
+    return (const char *) source;
 }
 
 /* ##################################################################################### */
 
-static void run_file (const char *path) {
-    char *source = read_file (path);
-    InterpretRes res = interpret (source);
-    free (source);
+/* Runs the scripts at PATHS one after the other, stopping at the first
+    runtime error. They are all compiled up front, on as many threads as
+    there are cores, and none runs if any of them fails to compile. */
+static InterpretRes run_files (VM *vm, const char **paths, int count, 
+                               int cores) {
+    CompileJob *jobs = ALLOCATE(CompileJob, count);
+    for (int i = 0; i < count; i++) {
+        jobs[i].source = map_file (paths[i], &jobs[i].len);
+        jobs[i].function = NULL;
+    }
 
-    if (res == INTERPRET_COMPILE_ERROR) exit (EX_COMPILE);
-    if (res == INTERPRET_RUNTIME_ERROR) exit (EX_RUNTIME);
+    /* The cache files are read in order, before anything is compiled,
+        so each finds the globals in the slots it was saved with. */
+    CompileJob *misses = ALLOCATE(CompileJob, count);
+    int miss_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (use_cache) {
+            jobs[i].function = load_cache (vm, paths[i], jobs[i].source, 
+                                           jobs[i].len);
+        }
+        if (jobs[i].function == NULL) misses[miss_count++] = jobs[i];
+        else add_root (vm, OBJ_VAL(jobs[i].function));
+    }
+    compile_parallel (vm, misses, miss_count, cores);
+
+    /* The scripts are roots until the VM is freed, as saving a cache 
+        compiles skimmed functions and running a script allocates. */
+    for (int i = 0; i < miss_count; i++) {
+        if (misses[i].function != NULL) {
+            add_root (vm, OBJ_VAL(misses[i].function));
+        }
+    }
+
+    bool compiled = true;
+    for (int i = 0, miss = 0; i < count; i++) {
+        if (jobs[i].function != NULL) continue;
+        jobs[i].function = misses[miss++].function;
+        if (jobs[i].function == NULL) {
+            compiled = false;
+        } else if (use_cache) {
+            save_cache (vm, paths[i], jobs[i].source, jobs[i].len, 
+                        jobs[i].function);
+        }
+    }
+
+    InterpretRes res = compiled ? INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+    for (int i = 0; i < count && res == INTERPRET_OK; i++) {
+        res = interpret_function (vm, jobs[i].function);
+    }
+    /* Skimmed functions point into the sources, and a later script may
+        call one from an earlier script, so they are unmapped last. */
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].len > 0) munmap ((void *) jobs[i].source, jobs[i].len);
+    }
+    FREE_ARRAY(CompileJob, misses, count);
+    FREE_ARRAY(CompileJob, jobs, count);
+    return res;
 }
 
 /* ##################################################################################### */
 
 int main(int argc, const char *argv[]) {
-    init_VM ();
+    VM vm;
+    init_VM (&vm);
+    long online = sysconf (_SC_NPROCESSORS_ONLN);
+    int cores = online > 0 ? (int) online : 1;
+    vm.gc_threads = cores;
     
-    if (argc == 1) {
-        repl ();
-    } else if (argc == 2) {
-        run_file (argv[1]);
+    /* Leading switches. */
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp (argv[arg], "--no-jit") == 0) {
+            vm.jit_enabled = false;
+        } else if (strcmp (argv[arg], "--no-trace") == 0) {
+            vm.trace_enabled = false;
+        } else if (strcmp (argv[arg], "--lazy") == 0) {
+            vm.lazy_compile = true;
+        } else if (strcmp (argv[arg], "--cache") == 0) {
+            use_cache = true;
+        } else if (strcmp (argv[arg], "--registers") == 0) {
+            /* The JIT only knows stack code. */
+            vm.register_mode = true;
+            vm.jit_enabled = false;
+        } else if (strcmp (argv[arg], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strcmp (argv[arg], "--gc-budget") == 0 && arg + 1 < argc) {
+            vm.gc_budget = atoi (argv[++arg]);
+            if (vm.gc_budget < 1) {
+                fprintf (stderr, "Invalid GC budget \"%s\".\n", argv[arg]);
+                exit (EX_USAGE);
+            }
+        } else if (strcmp (argv[arg], "--gc-threads") == 0 && arg + 1 < argc) {
+            vm.gc_threads = atoi (argv[++arg]);
+            if (vm.gc_threads < 1) {
+                fprintf (stderr, "Invalid GC thread count \"%s\".\n", argv[arg]);
+                exit (EX_USAGE);
+            }
+        } else if (strcmp (argv[arg], "--max-frames") == 0 && arg + 1 < argc) {
+            vm.max_frames = atoi (argv[++arg]);
+            if (vm.max_frames < 1) {
+                fprintf (stderr, "Invalid call depth \"%s\".\n", argv[arg]);
+                exit (EX_USAGE);
+            }
+        } else {
+            fprintf (stderr, "Unknown option \"%s\".\n", argv[arg]);
+            fprintf (stderr, "Usage: clox [--no-jit] [--no-trace] [--registers] [--lazy] "
+                             "[--cache] [--max-frames n] [--gc-budget n] "
+                             "[--gc-threads n] [--gc-stats] [path...]\n");
+            exit (EX_USAGE);
+        }
+    }
+
+    InterpretRes res = INTERPRET_OK;
+    if (arg == argc) {
+        /* Skimmed functions would point into the reused line buffer. */
+        vm.lazy_compile = false;
+        repl (&vm);
     } else {
-        fprintf (stderr, "Usage: clox [path\n]");
-        exit(EX_USAGE);
+        res = run_files (&vm, &argv[arg], argc - arg, cores);
     }
+    if (gc_stats) print_gc_stats (&vm);
+    if (res == INTERPRET_COMPILE_ERROR) exit (EX_COMPILE);
+    if (res == INTERPRET_RUNTIME_ERROR) exit (EX_RUNTIME);
     
-    free_VM ();
+    free_VM (&vm);
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "trace.h"
 #include "vm.h"
 
 /* ##################################################################################### */
@@ -19,34 +26,805 @@ void *reallocate (void *pointer, size_t old_size, size_t new_size) {
 
 /* ##################################################################################### */
 
-static void free_object (Obj *object) {
+/* Returns SIZE bytes from the nursery, or NULL if they do not fit, in
+    which case the next safepoint runs a minor collection. Large objects
+    are not worth copying and start out old. */
+void *allocate_young (VM *vm, size_t size) {
+    if (size > NURSERY_SIZE / 8) return NULL;
+    if (size > (size_t) (vm->nursery + NURSERY_SIZE - vm->nursery_top)) {
+        vm->nursery_full = true;
+        return NULL;
+    }
+    void *result = vm->nursery_top;
+    vm->nursery_top += size;
+    return result;
+}
+
+/* ##################################################################################### */
+
+/* Call after storing VAL in OBJECT. Besides GC_SHADE (), a minor 
+    collection only looks at the old objects remembered here, so an old
+    object that now points into the nursery joins vm->remembered. */
+void write_barrier (VM *vm, Obj *object, Value val) {
+    GC_SHADE(vm, val);
+    if (!IS_OBJ(val) || !IS_YOUNG(vm, AS_OBJ(val)) || IS_YOUNG(vm, object)) {
+        return;
+    }
+
+    VM_LOCK(vm, objects_lock);
+    if (!object->is_remembered) {
+        object->is_remembered = true;
+        if (vm->remembered_count == vm->remembered_capacity) {
+            int old_capacity = vm->remembered_capacity;
+            vm->remembered_capacity = GROW_CAPACITY(old_capacity);
+            vm->remembered = GROW_ARRAY(Obj *, vm->remembered, old_capacity,
+                                        vm->remembered_capacity);
+        }
+        vm->remembered[vm->remembered_count++] = object;
+    }
+    VM_UNLOCK(vm, objects_lock);
+}
+
+/* ##################################################################################### */
+
+/* Monotonic time in nanoseconds, for the pause histograms. */
+static uint64_t now (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* ##################################################################################### */
+
+/* Bucket 0 counts pauses under 1us, bucket N those from 2^(N-1)us up
+    to 2^N us, and the last one everything longer. */
+static void count_pause (uint64_t *histogram, uint64_t ns) {
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us > 0 && bucket < GC_HISTOGRAM_BUCKETS - 1; 
+         us >>= 1) {
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+/* ##################################################################################### */
+
+/* Moves OBJECT out of the nursery, unless that happened already, and
+    returns where it lives now. Only strings are young, and they refer
+    to nothing, so there is nothing to scan in the copy. */
+static Obj *promote (VM *vm, Obj *object) {
+    if (object->is_marked) return object->next;
+
+    ObjString *young = (ObjString *) object;
+    size_t size = STRING_SIZE(young->len);
+    /* Not through gc_reallocate (), which could start a collection. */
+    ObjString *string = slab_reallocate (&vm->slabs, NULL, 0, size);
+    memcpy (string, young, size);
+    string->obj.is_marked = vm->mark_sense;
+    string->obj.is_remembered = false;
+    string->obj.next = vm->objects;
+    vm->objects = (Obj *) string;
+    vm->bytes_allocated += size;
+
+    object->is_marked = true;
+    object->next = (Obj *) string;
+    return object->next;
+}
+
+/* ##################################################################################### */
+
+static void promote_value (VM *vm, Value *slot) {
+    if (IS_OBJ(*slot) && IS_YOUNG(vm, AS_OBJ(*slot))) {
+        *slot = OBJ_VAL(promote (vm, AS_OBJ(*slot)));
+    }
+}
+
+/* ##################################################################################### */
+
+static void promote_string (VM *vm, ObjString **slot) {
+    if (*slot != NULL && IS_YOUNG(vm, *slot)) {
+        *slot = (ObjString *) promote (vm, (Obj *) *slot);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Promotes everything the old OBJECT refers to. */
+static void promote_fields (VM *vm, Obj *object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *) object;
+            promote_string (vm, &function->name);
+            for (int i = 0; i < function->c.constants.count; i++) {
+                promote_value (vm, &function->c.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+/* ##################################################################################### */
+
+/* A minor collection. Young objects reachable from the roots or from
+    a remembered old object are promoted to the old generation, and the
+    whole nursery is free again. Dead young objects cost nothing but
+    their entry in the string table. */
+void collect_nursery (VM *vm) {
+    uint64_t start = now ();
+    for (Value *slot = vm->stack; slot < vm->sp; slot++) {
+        promote_value (vm, slot);
+    }
+    for (int i = 0; i < vm->global_count; i++) {
+        promote_string (vm, &vm->globals[i].name);
+        promote_value (vm, &vm->globals[i].val);
+    }
+    for (int i = 0; i < vm->roots.count; i++) {
+        promote_value (vm, &vm->roots.values[i]);
+    }
+    for (int i = 0; i < vm->remembered_count; i++) {
+        promote_fields (vm, vm->remembered[i]);
+        vm->remembered[i]->is_remembered = false;
+    }
+    vm->remembered_count = 0;
+
+    /* The tables are keyed by address, so they follow the moves. */
+    uint8_t *young = vm->nursery;
+    while (young < vm->nursery_top) {
+        ObjString *string = (ObjString *) young;
+        if (string->obj.is_marked) {
+            ObjString *moved = (ObjString *) string->obj.next;
+            table_rekey (&vm->strings, string, moved);
+            table_rekey (&vm->global_slots, string, moved);
+        } else {
+            table_delete (&vm->strings, string);
+        }
+        young += YOUNG_STRING_SIZE(string->len);
+    }
+    vm->nursery_top = vm->nursery;
+    vm->nursery_full = false;
+    count_pause (vm->minor_pauses, now () - start);
+}
+
+/* ##################################################################################### */
+
+static void push_gray (GrayStack *stack, Obj *object) {
+    if (stack->count == stack->capacity) {
+        int old_capacity = stack->capacity;
+        stack->capacity = GROW_CAPACITY(old_capacity);
+        stack->objects = GROW_ARRAY(Obj *, stack->objects, old_capacity,
+                                    stack->capacity);
+    }
+    stack->objects[stack->count++] = object;
+}
+
+/* ##################################################################################### */
+
+/* Turns a white OBJECT gray by pushing it on STACK. Young objects are
+    left to collect_nursery (). With SHARED, other marking threads race 
+    for the object, and only the one that flips the mark pushes it. */
+static void gray_object (VM *vm, Obj *object, GrayStack *stack, bool shared) {
+    if (object == NULL || IS_YOUNG(vm, object)) return;
+    if (shared) {
+        if (__atomic_exchange_n (&object->is_marked, vm->mark_sense, 
+                                 __ATOMIC_RELAXED) == vm->mark_sense) return;
+    } else {
+        if (object->is_marked == vm->mark_sense) return;
+        object->is_marked = vm->mark_sense;
+    }
+    push_gray (stack, object);
+}
+
+/* ##################################################################################### */
+
+void mark_object (VM *vm, Obj *object) {
+    gray_object (vm, object, &vm->gray, false);
+}
+
+/* ##################################################################################### */
+
+void mark_value (VM *vm, Value val) {
+    if (IS_OBJ(val)) mark_object (vm, AS_OBJ(val));
+}
+
+/* ##################################################################################### */
+
+static void mark_array (VM *vm, ValueArray *array) {
+    for (int i = 0; i < array->count; i++) {
+        mark_value (vm, array->values[i]);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Grays everything OBJECT refers to, see gray_object (). */
+static void blacken_object (VM *vm, Obj *object, GrayStack *stack, 
+                            bool shared) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *) object;
+            gray_object (vm, (Obj *) function->name, stack, shared);
+            for (int i = 0; i < function->c.constants.count; i++) {
+                Value val = function->c.constants.values[i];
+                if (IS_OBJ(val)) gray_object (vm, AS_OBJ(val), stack, shared);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+/* ##################################################################################### */
+
+/* The roots that are written without a write barrier, so the end of
+    marking has to look at them again. */
+static void mark_volatile_roots (VM *vm) {
+    for (Value *slot = vm->stack; slot < vm->sp; slot++) {
+        mark_value (vm, *slot);
+    }
+    for (int i = 0; i < vm->frame_count; i++) {
+        mark_object (vm, (Obj *) vm->frames[i].function);
+    }
+    mark_array (vm, &vm->roots);
+    /* Kept until the next minor collection looks at them. */
+    for (int i = 0; i < vm->remembered_count; i++) {
+        mark_object (vm, vm->remembered[i]);
+    }
+    mark_compiler_roots (vm);
+}
+
+/* ##################################################################################### */
+
+static void mark_roots (VM *vm) {
+    mark_volatile_roots (vm);
+    for (int i = 0; i < vm->global_count; i++) {
+        mark_object (vm, (Obj *) vm->globals[i].name);
+        mark_value (vm, vm->globals[i].val);
+    }
+    mark_table (vm, &vm->global_slots);
+}
+
+/* ##################################################################################### */
+
+/* One marking thread's gray objects. The owner works on OWN without
+    locking, and moves some over to SHARED, where the other threads 
+    steal from, whenever that runs dry. */
+typedef struct {
+    GrayStack own;
+    GrayStack shared;       /* Its count is also read without the lock. */
+    pthread_mutex_t lock;
+    pthread_t thread;
+    struct Markers *markers;
+    int index;
+}   MarkStack;
+
+/* The threads of parallel marking. The VM's thread is number 0 and 
+    the others wait for the next round in between. */
+struct Markers {
+    VM *vm;
+    int count;              /* Threads running, this one included. */
+    int capacity;           /* Stacks allocated. */
+    MarkStack *stacks;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned round;         /* Bumped to start a round of marking. */
+    int finished;           /* Helpers through with the round. */
+    bool quit;
+    int budget;             /* Per thread, negative for no limit. */
+    atomic_int active;      /* Threads that have work or look for it. */
+};
+
+/* ##################################################################################### */
+
+/* Moves the top half of the shared stack of FROM, rounded up, onto TO.
+    Returns false if there was nothing to take. */
+static bool take_shared (MarkStack *from, GrayStack *to) {
+    if (__atomic_load_n (&from->shared.count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+    pthread_mutex_lock (&from->lock);
+    int count = from->shared.count;
+    int taken = (count + 1) / 2;
+    for (int i = count - taken; i < count; i++) {
+        push_gray (to, from->shared.objects[i]);
+    }
+    __atomic_store_n (&from->shared.count, count - taken, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&from->lock);
+    return taken > 0;
+}
+
+/* ##################################################################################### */
+
+/* Moves the bottom COUNT objects of the own stack of STACK to its 
+    shared one. */
+static void share_work (MarkStack *stack, int count) {
+    GrayStack *shared = &stack->shared;
+    pthread_mutex_lock (&stack->lock);
+    if (shared->count + count > shared->capacity) {
+        int old_capacity = shared->capacity;
+        while (shared->capacity < shared->count + count) {
+            shared->capacity = GROW_CAPACITY(shared->capacity);
+        }
+        shared->objects = GROW_ARRAY(Obj *, shared->objects, old_capacity,
+                                     shared->capacity);
+    }
+    memcpy (shared->objects + shared->count, stack->own.objects, 
+            count * sizeof (Obj *));
+    __atomic_store_n (&shared->count, shared->count + count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&stack->lock);
+    stack->own.count -= count;
+    memmove (stack->own.objects, stack->own.objects + count, 
+             stack->own.count * sizeof (Obj *));
+}
+
+/* ##################################################################################### */
+
+/* Steals work for thread SELF, which is out of it. Returns false once 
+    no thread has any left. */
+static bool steal_work (struct Markers *markers, int self) {
+    MarkStack *stack = &markers->stacks[self];
+    for (;;) {
+        for (int i = 1; i < markers->count; i++) {
+            MarkStack *victim = &markers->stacks[(self + i) % markers->count];
+            if (__atomic_load_n (&victim->shared.count, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            atomic_fetch_add (&markers->active, 1);
+            if (take_shared (victim, &stack->own)) return true;
+            atomic_fetch_sub (&markers->active, 1);
+        }
+        if (atomic_load (&markers->active) == 0) return false;
+        sched_yield ();
+    }
+}
+
+/* ##################################################################################### */
+
+/* Marking thread SELF's part of a round: it blackens up to the budget
+    of objects, its own and then stolen ones. Whatever is left when the
+    budget runs out goes to the shared stack. */
+static void mark_in_parallel (struct Markers *markers, int self) {
+    VM *vm = markers->vm;
+    MarkStack *stack = &markers->stacks[self];
+    int budget = markers->budget;
+    for (;;) {
+        while (budget != 0 && 
+               (stack->own.count > 0 || take_shared (stack, &stack->own))) {
+            budget--;
+            blacken_object (vm, stack->own.objects[--stack->own.count], 
+                            &stack->own, true);
+            if (stack->own.count >= 2 * GC_SHARE_BATCH && 
+                __atomic_load_n (&stack->shared.count, __ATOMIC_RELAXED) == 0) {
+                share_work (stack, GC_SHARE_BATCH);
+            }
+        }
+        if (budget == 0) {
+            if (stack->own.count > 0) share_work (stack, stack->own.count);
+            atomic_fetch_sub (&markers->active, 1);
+            return;
+        }
+        atomic_fetch_sub (&markers->active, 1);
+        if (!steal_work (markers, self)) return;
+    }
+}
+
+/* ##################################################################################### */
+
+static void *marker_thread (void *arg) {
+    MarkStack *stack = (MarkStack *) arg;
+    struct Markers *markers = stack->markers;
+    unsigned round = 0;
+    for (;;) {
+        pthread_mutex_lock (&markers->lock);
+        while (markers->round == round && !markers->quit) {
+            pthread_cond_wait (&markers->start, &markers->lock);
+        }
+        if (markers->quit) {
+            pthread_mutex_unlock (&markers->lock);
+            return NULL;
+        }
+        round = markers->round;
+        pthread_mutex_unlock (&markers->lock);
+
+        mark_in_parallel (markers, stack->index);
+
+        pthread_mutex_lock (&markers->lock);
+        markers->finished++;
+        pthread_cond_signal (&markers->done);
+        pthread_mutex_unlock (&markers->lock);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Starts the vm->gc_threads - 1 helpers of parallel marking, or as many
+    as the system lets us have. */
+static struct Markers *start_markers (VM *vm) {
+    struct Markers *markers = ALLOCATE(struct Markers, 1);
+    markers->vm = vm;
+    markers->capacity = vm->gc_threads;
+    markers->stacks = ALLOCATE(MarkStack, markers->capacity);
+    markers->round = 0;
+    markers->finished = 0;
+    markers->quit = false;
+    markers->budget = 0;
+    atomic_init (&markers->active, 0);
+    pthread_mutex_init (&markers->lock, NULL);
+    pthread_cond_init (&markers->start, NULL);
+    pthread_cond_init (&markers->done, NULL);
+    for (int i = 0; i < markers->capacity; i++) {
+        MarkStack *stack = &markers->stacks[i];
+        stack->own = (GrayStack) {NULL, 0, 0};
+        stack->shared = (GrayStack) {NULL, 0, 0};
+        stack->markers = markers;
+        stack->index = i;
+        pthread_mutex_init (&stack->lock, NULL);
+    }
+
+    markers->count = 1;
+    while (markers->count < markers->capacity) {
+        MarkStack *stack = &markers->stacks[markers->count];
+        if (pthread_create (&stack->thread, NULL, marker_thread, stack) != 0) {
+            break;
+        }
+        markers->count++;
+    }
+    return markers;
+}
+
+/* ##################################################################################### */
+
+static void stop_markers (VM *vm) {
+    struct Markers *markers = vm->markers;
+    pthread_mutex_lock (&markers->lock);
+    markers->quit = true;
+    pthread_cond_broadcast (&markers->start);
+    pthread_mutex_unlock (&markers->lock);
+    for (int i = 1; i < markers->count; i++) {
+        pthread_join (markers->stacks[i].thread, NULL);
+    }
+
+    for (int i = 0; i < markers->capacity; i++) {
+        MarkStack *stack = &markers->stacks[i];
+        FREE_ARRAY(Obj *, stack->own.objects, stack->own.capacity);
+        FREE_ARRAY(Obj *, stack->shared.objects, stack->shared.capacity);
+        pthread_mutex_destroy (&stack->lock);
+    }
+    pthread_mutex_destroy (&markers->lock);
+    pthread_cond_destroy (&markers->start);
+    pthread_cond_destroy (&markers->done);
+    FREE_ARRAY(MarkStack, markers->stacks, markers->capacity);
+    FREE(struct Markers, markers);
+    vm->markers = NULL;
+}
+
+/* ##################################################################################### */
+
+/* A round of marking on all threads, each blackening up to BUDGET 
+    objects. The gray objects are dealt out first, and what is left 
+    gray in the end is collected back onto vm->gray. */
+static void trace_in_parallel (VM *vm, int budget) {
+    struct Markers *markers = vm->markers;
+    for (int i = 0; i < vm->gray.count; i++) {
+        push_gray (&markers->stacks[i % markers->count].own, 
+                   vm->gray.objects[i]);
+    }
+    vm->gray.count = 0;
+    markers->budget = budget;
+    atomic_store (&markers->active, markers->count);
+
+    pthread_mutex_lock (&markers->lock);
+    markers->round++;
+    markers->finished = 0;
+    pthread_cond_broadcast (&markers->start);
+    pthread_mutex_unlock (&markers->lock);
+
+    mark_in_parallel (markers, 0);
+
+    pthread_mutex_lock (&markers->lock);
+    while (markers->finished < markers->count - 1) {
+        pthread_cond_wait (&markers->done, &markers->lock);
+    }
+    pthread_mutex_unlock (&markers->lock);
+
+    for (int i = 0; i < markers->count; i++) {
+        MarkStack *stack = &markers->stacks[i];
+        for (int j = 0; j < stack->own.count; j++) {
+            push_gray (&vm->gray, stack->own.objects[j]);
+        }
+        for (int j = 0; j < stack->shared.count; j++) {
+            push_gray (&vm->gray, stack->shared.objects[j]);
+        }
+        stack->own.count = 0;
+        stack->shared.count = 0;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Blackens up to BUDGET gray objects, or all of them if BUDGET is
+    negative. With vm->gc_threads, enough gray objects are marked in 
+    parallel, up to BUDGET on each thread. */
+static void trace_references (VM *vm, int budget) {
+    if (vm->gc_threads > 1 && vm->gray.count >= GC_PARALLEL_MIN) {
+        if (vm->markers == NULL) vm->markers = start_markers (vm);
+        if (vm->markers->count > 1) {
+            trace_in_parallel (vm, budget);
+            return;
+        }
+    }
+    while (vm->gray.count > 0 && budget-- != 0) {
+        blacken_object (vm, vm->gray.objects[--vm->gray.count], &vm->gray, 
+                        false);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Frees OBJECT into POOL and returns how many bytes that was. Not 
+    through gc_reallocate (), as the background sweep frees objects 
+    too, into a pool of its own. */
+static size_t free_object (SlabPool *pool, Obj *object) {
     switch (object->type) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) object;
+#ifdef BASELINE_JIT
+            if (function->jit != NULL) jit_free (function->jit);
+#endif
+#ifdef TRACING_JIT
+            trace_free (function->traces);
+#endif
             free_chunk (&function->c);
-            FREE(ObjFunction, object);
-            break;
+            slab_reallocate (pool, object, sizeof (ObjFunction), 0);
+            return sizeof (ObjFunction);
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
-            break;
+            slab_reallocate (pool, object, sizeof (ObjNative), 0);
+            return sizeof (ObjNative);
         }
         case OBJ_STRING: {
-            ObjString *string = (ObjString *) object;
-            FREE_ARRAY(char, string->chars, string->len + 1);
-            FREE(ObjString, object);
-            break;
+            size_t size = STRING_SIZE(((ObjString *) object)->len);
+            slab_reallocate (pool, object, size, 0);
+            return size;
         }
     }
+    return 0;
 }
 
 /* ##################################################################################### */
 
-void free_objects () {
-    Obj *object = vm.objects;
+/* Frees up to BUDGET objects the marking did not reach, or all of them
+    if BUDGET is negative, continuing where the last call stopped. 
+    Returns true once the whole list is swept. */
+static bool sweep (VM *vm, int budget) {
+    while (*vm->sweep_link != NULL && budget-- != 0) {
+        Obj *object = *vm->sweep_link;
+        if (object->is_marked == vm->mark_sense) {
+            vm->sweep_link = &object->next;
+            continue;
+        }
+
+        *vm->sweep_link = object->next;
+        /* The string table is weak. */
+        if (object->type == OBJ_STRING) {
+            table_delete (&vm->strings, (ObjString *) object);
+        }
+        vm->bytes_allocated -= free_object (&vm->slabs, object);
+    }
+    return *vm->sweep_link == NULL;
+}
+
+/* ##################################################################################### */
+
+/* The background sweep. It goes through vm->sweep_list on its own and
+    frees what the marking did not reach, except for strings, which the
+    VM's thread still reads in the string table. Those are moved to
+    vm->dead_strings instead. */
+static void *sweep_thread (void *arg) {
+    VM *vm = (VM *) arg;
+    Obj **link = &vm->sweep_list;
+    Obj **dead_link = &vm->dead_strings;
+    size_t freed = 0;
+    while (*link != NULL) {
+        Obj *object = *link;
+        if (object->is_marked == vm->mark_sense) {
+            link = &object->next;
+            continue;
+        }
+
+        *link = object->next;
+        if (object->type == OBJ_STRING) {
+            *dead_link = object;
+            dead_link = &object->next;
+        } else {
+            freed += free_object (&vm->swept, object);
+        }
+    }
+    *dead_link = NULL;
+    vm->sweep_link = link;
+    vm->sweep_freed = freed;
+    atomic_store (&vm->sweep_done, true);
+    return NULL;
+}
+
+/* ##################################################################################### */
+
+/* Hands every object there is to a background sweep, and starts a new
+    vm->objects for those allocated meanwhile. Returns false if there 
+    is no thread for it. */
+static bool start_background_sweep (VM *vm) {
+    if (vm->gc_threads <= 1) return false;
+    vm->sweep_list = vm->objects;
+    vm->objects = NULL;
+    atomic_store (&vm->sweep_done, false);
+    if (pthread_create (&vm->sweeper, NULL, sweep_thread, vm) != 0) {
+        vm->objects = vm->sweep_list;
+        return false;
+    }
+    vm->sweeping = true;
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Once the background sweep is through, or right away with WAIT, puts 
+    the survivors back on vm->objects and leaves the dead strings to 
+    sweep (). Returns false if the sweep is still running. */
+static bool end_background_sweep (VM *vm, bool wait) {
+    if (!wait && !atomic_load (&vm->sweep_done)) return false;
+    pthread_join (vm->sweeper, NULL);
+    vm->sweeping = false;
+    *vm->sweep_link = vm->objects;
+    vm->objects = vm->sweep_list;
+    vm->sweep_list = NULL;
+    vm->bytes_allocated -= vm->sweep_freed;
+    merge_slabs (&vm->slabs, &vm->swept);
+    vm->sweep_link = &vm->dead_strings;
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Does BUDGET objects worth of the collection in progress, starting one
+    if there is none. The collection is incremental and tri-color:
+    - Starting it flips vm->mark_sense, which turns every object white, 
+        and marks the roots gray.
+    - Marking blackens gray objects a slice at a time. Meanwhile the
+        write barriers gray whatever is stored into the globals or an
+        object, and new objects are allocated black.
+    - Once nothing is gray, the stack and the other roots without a 
+        barrier are marked again and traced in one go.
+    - Sweeping frees white objects a slice at a time, or all of them on
+        a thread of its own while the program goes on, if there are
+        vm->gc_threads. */
+static void run_collection (VM *vm, int budget) {
+    if (vm->gc_phase == GC_IDLE) {
+        vm->mark_sense = !vm->mark_sense;
+        vm->gc_phase = GC_MARK;
+        mark_roots (vm);
+        return;
+    }
+
+    if (vm->gc_phase == GC_MARK) {
+        trace_references (vm, budget);
+        if (vm->gray.count > 0) return;
+
+        mark_volatile_roots (vm);
+        trace_references (vm, -1);
+        vm->gc_phase = GC_SWEEP;
+        if (!start_background_sweep (vm)) vm->sweep_link = &vm->objects;
+        return;
+    }
+
+    if (vm->sweeping && !end_background_sweep (vm, budget < 0)) return;
+    if (sweep (vm, budget)) {
+        vm->gc_phase = GC_IDLE;
+        vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+        if (vm->next_gc < GC_FIRST_COLLECTION) {
+            vm->next_gc = GC_FIRST_COLLECTION;
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+/* One slice of the collection, timed for the pause histogram. */
+static void collect_slice (VM *vm) {
+    uint64_t start = now ();
+    run_collection (vm, vm->gc_budget);
+    vm->next_slice = vm->bytes_allocated + GC_SLICE_STEP;
+    count_pause (vm->major_pauses, now () - start);
+}
+
+/* ##################################################################################### */
+
+/* Runs the collection in progress to its end, e.g. before other
+    threads start allocating. */
+void finish_collection (VM *vm) {
+    while (vm->gc_phase != GC_IDLE) run_collection (vm, -1);
+}
+
+/* ##################################################################################### */
+
+/* Counts the change toward the next collection. Past vm->next_gc one
+    starts, and while it is in progress every GC_SLICE_STEP bytes pay 
+    for a slice of it. Nothing is collected while the compiler threads
+    of compile_parallel () are running. The memory comes from 
+    vm->slabs. */
+void *gc_reallocate (VM *vm, void *pointer, size_t old_size, 
+                     size_t new_size) {
+    VM_LOCK(vm, objects_lock);
+    vm->bytes_allocated += new_size - old_size;
+    VM_UNLOCK(vm, objects_lock);
+
+    if (new_size > old_size && !vm->parallel) {
+#ifdef DEBUG_STRESS_GC
+        collect_slice (vm);
+#else
+        if (vm->gc_phase == GC_IDLE ? vm->bytes_allocated > vm->next_gc 
+                                    : vm->bytes_allocated >= vm->next_slice) {
+            collect_slice (vm);
+        }
+#endif
+    }
+
+    VM_LOCK(vm, objects_lock);
+    void *result = slab_reallocate (&vm->slabs, pointer, old_size, new_size);
+    VM_UNLOCK(vm, objects_lock);
+    return result;
+}
+
+/* ##################################################################################### */
+
+static void print_histogram (const char *title, uint64_t *histogram) {
+    fprintf (stderr, "%s:\n", title);
+    for (int i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+        if (histogram[i] == 0) continue;
+        if (i == GC_HISTOGRAM_BUCKETS - 1) {
+            fprintf (stderr, "  >= %7llu us: %llu\n", 1ull << (i - 1),
+                     (unsigned long long) histogram[i]);
+        } else {
+            fprintf (stderr, "  < %8llu us: %llu\n", 1ull << i,
+                     (unsigned long long) histogram[i]);
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+/* Prints how long the slices of the major collector and the minor 
+    collections took, see --gc-stats. */
+void print_gc_stats (VM *vm) {
+    print_histogram ("GC slices", vm->major_pauses);
+    print_histogram ("Minor collections", vm->minor_pauses);
+    print_slab_stats (&vm->slabs);
+}
+
+/* ##################################################################################### */
+
+void free_objects (VM *vm) {
+    if (vm->sweeping) end_background_sweep (vm, true);
+    if (vm->markers != NULL) stop_markers (vm);
+    Obj *object = vm->objects;
+    while (object != NULL) {
+        Obj *next = object->next;
+        free_object (&vm->slabs, object);
+        object = next;
+    }
+    /* What the background sweep left for sweep (). */
+    object = vm->dead_strings;
     while (object != NULL) {
         Obj *next = object->next;
-        free_object (object);
+        free_object (&vm->slabs, object);
         object = next;
     }
+    free_slabs (&vm->slabs);
+    FREE_ARRAY(Obj *, vm->gray.objects, vm->gray.capacity);
+    FREE_ARRAY(Obj *, vm->remembered, vm->remembered_capacity);
+    FREE_ARRAY(uint8_t, vm->nursery, NURSERY_SIZE);
 }
\ No newline at end of file
@@ -21,9 +21,62 @@
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
+/* The heap may grow to this multiple of what survived a collection
+    before the next one runs. */
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_FIRST_COLLECTION (1024 * 1024)
+
+/* Objects one slice of the incremental collector marks or sweeps, 
+    unless --gc-budget says otherwise. */
+#define GC_SLICE_BUDGET 1024
+/* While a collection is in progress, a slice runs every time this many
+    more bytes were allocated. */
+#define GC_SLICE_STEP (16 * 1024)
+/* Marking only goes parallel with at least this many gray objects to 
+    deal out, and a thread shares its work in batches of this many. */
+#define GC_PARALLEL_MIN 64
+#define GC_SHARE_BATCH 32
+
+/* The write barrier of the incremental collector. While it marks, a
+    value stored into a global or an object is grayed, so no black 
+    object ends up pointing at a white one. The stack has no barrier; 
+    it is marked again when marking ends. */
+#define GC_SHADE(vm, val) \
+    do { if ((vm)->gc_phase == GC_MARK) mark_value (vm, val); } while (false)
+
+/* Strings built at runtime start out in the nursery, a block of this
+    many bytes that is allocated from by bumping a pointer. */
+#define NURSERY_SIZE (256 * 1024)
+
+/* Bytes a young string of LEN characters takes up in the nursery, 
+    rounded up to keep the next one aligned. */
+#define YOUNG_STRING_SIZE(len) ((STRING_SIZE(len) + 7) & ~(size_t) 7)
+
+#define IS_YOUNG(vm, object) \
+    ((uintptr_t) (object) - (uintptr_t) (vm)->nursery < NURSERY_SIZE)
+
+/* Runs a minor collection once the nursery is full. That moves young
+    objects, so it only happens at these points, where every live value
+    is in a root and no C code holds on to an object. */
+#ifdef DEBUG_STRESS_GC
+#define GC_SAFEPOINT(vm) collect_nursery (vm)
+#else
+#define GC_SAFEPOINT(vm) \
+    do { if ((vm)->nursery_full) collect_nursery (vm); } while (false)
+#endif
+
 /* ##################################################################################### */
 
 void *reallocate (void *pointer, size_t old_size, size_t new_size);
-void free_objects ();
+void *gc_reallocate (VM *vm, void *pointer, size_t old_size, 
+                     size_t new_size);
+void *allocate_young (VM *vm, size_t size);
+void write_barrier (VM *vm, Obj *object, Value val);
+void collect_nursery (VM *vm);
+void mark_object (VM *vm, Obj *object);
+void mark_value (VM *vm, Value val);
+void finish_collection (VM *vm);
+void print_gc_stats (VM *vm);
+void free_objects (VM *vm);
 
 #endif
\ No newline at end of file
@@ -9,49 +9,67 @@
 
 /* ##################################################################################### */
 
-#define ALLOCATE_OBJ(type, obj_type) \
-    (type *)allocate_object(sizeof(type), obj_type)
+#define ALLOCATE_OBJ(vm, type, obj_type) \
+    (type *)allocate_object(vm, sizeof(type), obj_type)
 
 /* ##################################################################################### */
 
-static Obj *allocate_object (size_t size, Obj_t type) {
-    Obj *object = (Obj *)reallocate (NULL, 0, size);
+static void init_object (VM *vm, Obj *object, Obj_t type) {
     object->type = type;
+    /* Black if a collection is in progress, else white for the next. */
+    object->is_marked = vm->mark_sense;
+    object->is_remembered = false;
 
     /* We also need to add it to the VM's list of objects. */
-    object->next = vm.objects;
-    vm.objects = object;
+    VM_LOCK(vm, objects_lock);
+    object->next = vm->objects;
+    vm->objects = object;
+    VM_UNLOCK(vm, objects_lock);
+}
+
+/* ##################################################################################### */
+
+static Obj *allocate_object (VM *vm, size_t size, Obj_t type) {
+    Obj *object = (Obj *)gc_reallocate (vm, NULL, 0, size);
+    init_object (vm, object, type);
     return object;
 }
 
 /* ##################################################################################### */
 
-ObjFunction *new_function () {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction *new_function (VM *vm) {
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
+    function->call_count = 0;
+    function->loop_count = 0;
+    function->reg_count = 0;
+    function->source = NULL;
+    function->source_len = 0;
+    function->source_line = 0;
+    function->jit = NULL;
+    function->traces = NULL;
+    function->trace_failures = 0;
     init_chunk (&function->c);
     return function;
 }
 
 /* ##################################################################################### */
 
-ObjNative *new_native (NativeFn function) {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative *new_native (VM *vm, NativeFn function) {
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
 /* ##################################################################################### */
 
-static ObjString *allocate_string (char *chars, int len, 
-                                   uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->len = len;
-    string->chars = chars;
+/* Makes STRING, whose characters are filled in, an object and adds it
+    to the string table. */
+static void add_string (VM *vm, ObjString *string, uint32_t hash) {
+    init_object (vm, (Obj *) string, OBJ_STRING);
     string->hash = hash;
-    table_set (&vm.strings, string, NIL_VAL);
-    return string;
+    table_set (&vm->strings, string, NIL_VAL);
 }
 
 /* ##################################################################################### */
@@ -70,28 +88,85 @@ uint32_t hash_string (const char *key, int len) {
 
 /* ##################################################################################### */
 
-ObjString *take_string (char *chars, int len) {
-    uint32_t hash = hash_string (chars, len);
-    ObjString *interned = table_find_string (&vm.strings, chars,
-                                             len, hash);
+/* Room for a string of LEN characters, which the caller fills in 
+    before passing it to take_string (). It is no object until then. */
+ObjString *reserve_string (VM *vm, int len) {
+    ObjString *string = (ObjString *) gc_reallocate (vm, NULL, 0, 
+                                                     STRING_SIZE(len));
+    string->len = len;
+    string->chars[len] = '\0';
+    return string;
+}
+
+/* ##################################################################################### */
+
+/* Takes over STRING from reserve_string () and returns the interned
+    string with its characters, which may be another one. */
+ObjString *take_string (VM *vm, ObjString *string) {
+    int len = string->len;
+    uint32_t hash = hash_string (string->chars, len);
+    VM_LOCK(vm, strings_lock);
+    ObjString *interned = table_find_string (vm, &vm->strings, 
+                                             string->chars, len, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, len + 1);
+        VM_UNLOCK(vm, strings_lock);
+        gc_reallocate (vm, string, STRING_SIZE(len), 0);
         return interned;
     }
-    return allocate_string (chars, len, hash);
+    add_string (vm, string, hash);
+    VM_UNLOCK(vm, strings_lock);
+    return string;
 }
 
 /* ##################################################################################### */
 
-ObjString* copy_string(const char* chars, int len) {
+/* The lookup and the insert happen under one lock, so two threads
+    interning the same name get the same string. */
+ObjString* copy_string(VM *vm, const char* chars, int len) {
     uint32_t hash = hash_string (chars, len);
-    ObjString *interned = table_find_string (&vm.strings, chars, 
-                                             len, hash);
-    if (interned != NULL) return interned;
-    char* heap_chars = ALLOCATE(char, len + 1);
-    memcpy(heap_chars, chars, len);
-    heap_chars[len] = '\0';
-    return allocate_string(heap_chars, len, hash);
+    VM_LOCK(vm, strings_lock);
+    ObjString *interned = table_find_string (vm, &vm->strings, 
+                                             chars, len, hash);
+    if (interned == NULL) {
+        interned = reserve_string (vm, len);
+        memcpy (interned->chars, chars, len);
+        add_string (vm, interned, hash);
+    }
+    VM_UNLOCK(vm, strings_lock);
+    return interned;
+}
+
+/* ##################################################################################### */
+
+/* Returns A followed by B. Strings built at runtime mostly die young,
+    so a new one goes into the nursery, and only becomes a regular
+    object if the nursery is full. */
+ObjString *concat_strings (VM *vm, ObjString *a, ObjString *b) {
+    int len = a->len + b->len;
+    ObjString *string = (ObjString *) allocate_young (vm, YOUNG_STRING_SIZE(len));
+    bool young = string != NULL;
+    if (!young) string = reserve_string (vm, len);
+    memcpy (string->chars, a->chars, a->len);
+    memcpy (string->chars + a->len, b->chars, b->len);
+    string->chars[len] = '\0';
+    string->len = len;
+    if (!young) return take_string (vm, string);
+
+    uint32_t hash = hash_string (string->chars, len);
+    ObjString *interned = table_find_string (vm, &vm->strings, 
+                                             string->chars, len, hash);
+    if (interned != NULL) {
+        /* Nothing was allocated after it, so the space goes back. */
+        vm->nursery_top = (uint8_t *) string;
+        return interned;
+    }
+    string->obj.type = OBJ_STRING;
+    string->obj.is_marked = false;
+    string->obj.is_remembered = false;
+    string->obj.next = NULL;
+    string->hash = hash;
+    table_set (&vm->strings, string, NIL_VAL);
+    return string;
 }
 
 /* ##################################################################################### */
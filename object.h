@@ -31,6 +31,10 @@ typedef enum {
 
 struct Obj {
   Obj_t type;
+  bool is_marked;           /* Black or gray if equal to vm->mark_sense. 
+                               In the nursery: moved out, NEXT is the 
+                               copy. */
+  bool is_remembered;       /* Old, and in vm->remembered. */
   struct Obj *next; 
 };
 
@@ -41,11 +45,26 @@ typedef struct {
     int arity;  /* Stores the expected number of parameters. */
     Chunk c;
     ObjString *name;
+    int call_count;
+    int loop_count;         /* Backward jumps taken in the interpreter. */
+    int reg_count;          /* Registers used by register code. */
+    /* Unless NULL, the parameters and body in the source, which are
+        only compiled on the first call (see --lazy). */
+    const char *source;
+    int source_len;
+    int source_line;
+    struct JitCode *jit;    /* Native code, once the function is hot. */
+    struct Trace *traces;   /* Native code of its hot loops. */
+    int trace_failures;     /* Recordings that went wrong, or traces
+                               thrown away. */
 }   ObjFunction;
 
 /* ##################################################################################### */
 
-typedef Value (*NativeFn)(int arg_count, Value *args);
+/* Defined in vm.h, which needs the objects first. */
+typedef struct VM VM;
+
+typedef Value (*NativeFn)(VM *vm, int arg_count, Value *args);
 
 /* ##################################################################################### */
 
@@ -58,19 +77,25 @@ typedef struct {
 
 /* ##################################################################################### */
 
+/* A string and its characters are one block. */
 struct ObjString {
     Obj obj;
     int len;
-    char *chars;
     uint32_t hash;
+    char chars[];           /* LEN characters and a '\0'. */
 };
 
+/* Bytes of a string with LEN characters. */
+#define STRING_SIZE(len) (sizeof(ObjString) + (len) + 1)
+
 /* ##################################################################################### */
 
-ObjFunction *new_function ();
-ObjNative *new_native (NativeFn function);
-ObjString *take_string (char *chars, int len);
-ObjString *copy_string (const char *chars, int len);
+ObjFunction *new_function (VM *vm);
+ObjNative *new_native (VM *vm, NativeFn function);
+ObjString *reserve_string (VM *vm, int len);
+ObjString *take_string (VM *vm, ObjString *string);
+ObjString *copy_string (VM *vm, const char *chars, int len);
+ObjString *concat_strings (VM *vm, ObjString *a, ObjString *b);
 void print_object (Value val);
 
 /* ##################################################################################### */
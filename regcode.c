@@ -0,0 +1,512 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "regcode.h"
+#include "vm.h"
+
+/* ##################################################################################### */
+
+/* The compiler always emits stack code first; in register mode every
+    function is then rewritten into register code. The depth of the
+    value stack is known statically at each instruction, so stack slot
+    N of a frame simply becomes register N. What makes the register
+    code shorter is that operands are not copied there eagerly: the
+    translator keeps a virtual stack of where each value currently
+    lives, a register or a literal, and only materializes a value into
+    its own slot when something needs it there. So 'a = b + c' becomes
+    a single ROP_ADD instead of five stack instructions. */
+
+/* ##################################################################################### */
+
+/* Where the value at one position of the virtual stack lives. */
+typedef struct {
+    bool in_reg;
+    uint8_t op;         /* Unless IN_REG, the literal load for it:
+                           ROP_CONSTANT, ROP_NIL, ROP_TRUE or ROP_FALSE. */
+    int index;          /* Register, or constant index for ROP_CONSTANT. */
+}   Operand;
+
+/* A jump whose 16-bit offset at AT should lead to stack offset TARGET. */
+typedef struct {
+    int at;
+    int target;
+    bool backward;
+}   Fixup;
+
+typedef struct {
+    Chunk *in;
+    Chunk out;
+    int offset;         /* Stack instruction being translated. */
+    int line;           /* And the line it came from. */
+
+    Operand stack[UINT8_COUNT];
+    int depth;
+    int max_depth;
+
+    bool *is_target;    /* Per stack offset: does a jump land here? */
+    int *target_depth;  /* Per stack offset: stack depth for jumps. */
+    int *map;           /* Per stack offset: where it went in OUT. */
+    Fixup *fixups;
+    int fixup_count;
+
+    /* Offset in OUT of the destination operand of the last instruction
+        if that wrote register LAST_DEST_REG, else -1. Lets an
+        assignment retarget it instead of adding a move. */
+    int last_dest;
+    int last_dest_reg;
+    bool failed;
+}   Translator;
+
+/* ##################################################################################### */
+
+static void emit (Translator *t, uint8_t byte) {
+    write_chunk (&t->out, byte, t->line);
+}
+
+static void emit_short (Translator *t, uint16_t word) {
+    emit (t, (word >> 8) & 0xff);
+    emit (t, word & 0xff);
+}
+
+/* Emits OP whose first operand, the destination, is register DEST. */
+static void emit_dest (Translator *t, uint8_t op, int dest) {
+    emit (t, op);
+    t->last_dest = t->out.count;
+    t->last_dest_reg = dest;
+    emit (t, (uint8_t) dest);
+}
+
+/* Loads the literal OPERAND into register DEST. */
+static void emit_literal (Translator *t, Operand *operand, int dest) {
+    if (operand->op == ROP_CONSTANT && operand->index > UINT8_MAX) {
+        emit_dest (t, ROP_CONSTANT_LONG, dest);
+        emit (t, (operand->index >> 16) & 0xff);
+        emit_short (t, operand->index & 0xffff);
+        return;
+    }
+    emit_dest (t, operand->op, dest);
+    if (operand->op == ROP_CONSTANT) emit (t, (uint8_t) operand->index);
+}
+
+/* Emits OP, which does not write a register. */
+static void emit_op (Translator *t, uint8_t op) {
+    emit (t, op);
+    t->last_dest = -1;
+}
+
+/* Emits a jump offset placeholder leading to stack offset TARGET. */
+static void emit_target (Translator *t, int target, bool backward) {
+    Fixup *fixup = &t->fixups[t->fixup_count++];
+    fixup->at = t->out.count;
+    fixup->target = target;
+    fixup->backward = backward;
+    emit_short (t, 0xffff);
+    if (!backward) t->target_depth[target] = t->depth;
+}
+
+/* ##################################################################################### */
+
+static void push_reg (Translator *t, int reg) {
+    if (t->depth == UINT8_COUNT) {
+        t->failed = true;
+        return;
+    }
+    Operand *operand = &t->stack[t->depth++];
+    operand->in_reg = true;
+    operand->index = reg;
+    if (t->depth > t->max_depth) t->max_depth = t->depth;
+}
+
+static void push_literal (Translator *t, uint8_t op, int index) {
+    push_reg (t, 0);
+    if (t->failed) return;
+    Operand *operand = &t->stack[t->depth - 1];
+    operand->in_reg = false;
+    operand->op = op;
+    operand->index = index;
+}
+
+/* ##################################################################################### */
+
+/* Makes sure the value at stack position POS is in register POS. */
+static void materialize (Translator *t, int pos) {
+    Operand *operand = &t->stack[pos];
+    if (operand->in_reg) {
+        if (operand->index == pos) return;
+        emit_dest (t, ROP_MOVE, pos);
+        emit (t, (uint8_t) operand->index);
+    } else {
+        emit_literal (t, operand, pos);
+    }
+    operand->in_reg = true;
+    operand->index = pos;
+}
+
+/* Materializes the stack below position LIMIT, which is what jumps
+    and calls expect to find. */
+static void flush (Translator *t, int limit) {
+    for (int pos = 0; pos < limit; pos++) materialize (t, pos);
+}
+
+/* Returns a register holding the value at stack position POS. */
+static int reg_of (Translator *t, int pos) {
+    if (!t->stack[pos].in_reg) materialize (t, pos);
+    return t->stack[pos].index;
+}
+
+/* ##################################################################################### */
+
+/* A binary instruction: both operands are replaced by the result,
+    written to the register of the lower one. */
+static void binary (Translator *t, uint8_t op) {
+    int pos = t->depth - 2;
+    Operand *rhs = &t->stack[pos + 1];
+    if ((op == ROP_ADD || op == ROP_SUBTRACT) && !rhs->in_reg &&
+        rhs->op == ROP_CONSTANT && rhs->index <= UINT8_MAX &&
+        IS_NUMBER(t->in->constants.values[rhs->index])) {
+        int k = rhs->index;
+        int b = reg_of (t, pos);
+        emit_dest (t, op == ROP_ADD ? ROP_ADD_CONST : ROP_SUB_CONST, pos);
+        emit (t, (uint8_t) b);
+        emit (t, (uint8_t) k);
+    } else {
+        int b = reg_of (t, pos);
+        int c = reg_of (t, pos + 1);
+        emit_dest (t, op, pos);
+        emit (t, (uint8_t) b);
+        emit (t, (uint8_t) c);
+    }
+    t->depth -= 2;
+    push_reg (t, pos);
+}
+
+static void unary (Translator *t, uint8_t op) {
+    int pos = t->depth - 1;
+    int b = reg_of (t, pos);
+    emit_dest (t, op, pos);
+    emit (t, (uint8_t) b);
+    t->depth--;
+    push_reg (t, pos);
+}
+
+/* A comparison fused with the jump that follows it. */
+static void compare_jmp (Translator *t, uint8_t op, int target) {
+    int pos = t->depth - 2;
+    flush (t, pos);
+    int b = reg_of (t, pos);
+    int c = reg_of (t, pos + 1);
+    emit_op (t, op);
+    emit (t, (uint8_t) b);
+    emit (t, (uint8_t) c);
+    t->depth -= 2;
+    emit_target (t, target, false);
+}
+
+/* ##################################################################################### */
+
+/* Stores the top of the stack into local SLOT, leaving it on the stack. */
+static void set_local (Translator *t, int slot) {
+    int top = t->depth - 1;
+    /* Values still waiting in SLOT have to be saved first. */
+    for (int pos = 0; pos < top; pos++) {
+        if (pos != slot && t->stack[pos].in_reg &&
+            t->stack[pos].index == slot) {
+            materialize (t, pos);
+        }
+    }
+
+    Operand *val = &t->stack[top];
+    if (val->in_reg && val->index == top && t->last_dest != -1 &&
+        t->last_dest_reg == top) {
+        /* The value was just computed, so compute it into SLOT. */
+        t->out.code[t->last_dest] = (uint8_t) slot;
+        t->last_dest_reg = slot;
+    } else if (val->in_reg) {
+        if (val->index != slot) {
+            emit_dest (t, ROP_MOVE, slot);
+            emit (t, (uint8_t) val->index);
+        }
+    } else {
+        emit_literal (t, val, slot);
+    }
+    val->in_reg = true;
+    val->index = slot;
+    t->stack[slot].in_reg = true;
+    t->stack[slot].index = slot;
+}
+
+/* ##################################################################################### */
+
+static int jmp_target (Chunk *c, int offset) {
+    int jmp = (c->code[offset + 1] << 8) | c->code[offset + 2];
+    if (c->code[offset] == OP_LOOP) return offset + 3 - jmp;
+    return offset + 3 + jmp;
+}
+
+/* ##################################################################################### */
+
+/* Translates the instruction at T->offset. Returns false if control
+    never falls through to the next one. */
+static bool translate (Translator *t) {
+    Chunk *c = t->in;
+    uint8_t *ip = &c->code[t->offset];
+    int top = t->depth - 1;
+
+    switch (ip[0]) {
+        case OP_CONSTANT: push_literal (t, ROP_CONSTANT, ip[1]); break;
+        case OP_CONSTANT_LONG:
+            push_literal (t, ROP_CONSTANT, 
+                          (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+            break;
+        case OP_NIL:      push_literal (t, ROP_NIL, 0);          break;
+        case OP_TRUE:     push_literal (t, ROP_TRUE, 0);         break;
+        case OP_FALSE:    push_literal (t, ROP_FALSE, 0);        break;
+        case OP_POP:      t->depth--;                            break;
+
+        case OP_GET_LOCAL:
+            materialize (t, ip[1]);
+            push_reg (t, ip[1]);
+            break;
+        case OP_SET_LOCAL:
+            set_local (t, ip[1]);
+            break;
+        case OP_GET_LOCAL_ADD_CONST:
+        case OP_GET_LOCAL_SUB_CONST:
+            materialize (t, ip[1]);
+            emit_dest (t, ip[0] == OP_GET_LOCAL_ADD_CONST ?
+                          ROP_ADD_CONST : ROP_SUB_CONST, t->depth);
+            emit (t, ip[1]);
+            emit (t, ip[2]);
+            push_reg (t, t->depth);
+            break;
+
+        case OP_GET_GLOBAL:
+            emit_dest (t, ROP_GET_GLOBAL, t->depth);
+            emit (t, ip[1]);
+            emit (t, ip[2]);
+            push_reg (t, t->depth);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL: {
+            int a = reg_of (t, top);
+            emit_op (t, ip[0] == OP_SET_GLOBAL ?
+                        ROP_SET_GLOBAL : ROP_DEFINE_GLOBAL);
+            emit (t, (uint8_t) a);
+            emit (t, ip[1]);
+            emit (t, ip[2]);
+            if (ip[0] == OP_DEFINE_GLOBAL) t->depth--;
+            break;
+        }
+
+        case OP_EQUAL:         binary (t, ROP_EQUAL);         break;
+        case OP_NOT_EQUAL:     binary (t, ROP_NOT_EQUAL);     break;
+        case OP_GREATER:       binary (t, ROP_GREATER);       break;
+        case OP_GREATER_EQUAL: binary (t, ROP_GREATER_EQUAL); break;
+        case OP_LESS:          binary (t, ROP_LESS);          break;
+        case OP_LESS_EQUAL:    binary (t, ROP_LESS_EQUAL);    break;
+        case OP_ADD:           binary (t, ROP_ADD);           break;
+        case OP_SUBTRACT:      binary (t, ROP_SUBTRACT);      break;
+        case OP_MULTIPLY:      binary (t, ROP_MULTIPLY);      break;
+        case OP_DIVIDE:        binary (t, ROP_DIVIDE);        break;
+        case OP_NEGATE:        unary (t, ROP_NEGATE);         break;
+        case OP_NOT:           unary (t, ROP_NOT);            break;
+
+        case OP_PRINT: {
+            int a = reg_of (t, top);
+            emit_op (t, ROP_PRINT);
+            emit (t, (uint8_t) a);
+            t->depth--;
+            break;
+        }
+
+        case OP_JMP:
+            flush (t, t->depth);
+            emit_op (t, ROP_JMP);
+            emit_target (t, jmp_target (c, t->offset), false);
+            return false;
+        case OP_LOOP:
+            flush (t, t->depth);
+            emit_op (t, ROP_LOOP);
+            emit_target (t, jmp_target (c, t->offset), true);
+            return false;
+        case OP_JMP_IF_FALSE:
+            flush (t, t->depth);
+            emit_op (t, ROP_JMP_IF_FALSE);
+            emit (t, (uint8_t) top);
+            emit_target (t, jmp_target (c, t->offset), false);
+            break;
+        case OP_EQUAL_JMP_IF_FALSE:
+            compare_jmp (t, ROP_EQUAL_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+        case OP_NOT_EQUAL_JMP_IF_FALSE:
+            compare_jmp (t, ROP_NOT_EQUAL_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+        case OP_GREATER_JMP_IF_FALSE:
+            compare_jmp (t, ROP_GREATER_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+        case OP_GREATER_EQUAL_JMP_IF_FALSE:
+            compare_jmp (t, ROP_GREATER_EQUAL_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+        case OP_LESS_JMP_IF_FALSE:
+            compare_jmp (t, ROP_LESS_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+        case OP_LESS_EQUAL_JMP_IF_FALSE:
+            compare_jmp (t, ROP_LESS_EQUAL_JMP_IF_FALSE,
+                         jmp_target (c, t->offset));
+            break;
+
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            int a = t->depth - ip[1] - 1;
+            flush (t, t->depth);
+            emit_op (t, ip[0] == OP_CALL ? ROP_CALL : ROP_TAIL_CALL);
+            emit (t, (uint8_t) a);
+            emit (t, ip[1]);
+            t->depth = a;
+            push_reg (t, a);
+            break;
+        }
+        case OP_RETURN: {
+            int a = reg_of (t, top);
+            emit_op (t, ROP_RETURN);
+            emit (t, (uint8_t) a);
+            return false;
+        }
+
+        default:
+            t->failed = true;   /* Quickened code, never compiled. */
+            break;
+    }
+    return true;
+}
+
+/* ##################################################################################### */
+
+static void mark_targets (Translator *t) {
+    Chunk *c = t->in;
+    for (int offset = 0; offset < c->count;
+         offset += instruction_len (c->code[offset])) {
+        switch (c->code[offset]) {
+            case OP_JMP:
+            case OP_LOOP:
+            case OP_JMP_IF_FALSE:
+            case OP_EQUAL_JMP_IF_FALSE:
+            case OP_NOT_EQUAL_JMP_IF_FALSE:
+            case OP_GREATER_JMP_IF_FALSE:
+            case OP_GREATER_EQUAL_JMP_IF_FALSE:
+            case OP_LESS_JMP_IF_FALSE:
+            case OP_LESS_EQUAL_JMP_IF_FALSE: {
+                int target = jmp_target (c, offset);
+                if (target < 0 || target > c->count) {
+                    t->failed = true;
+                } else {
+                    t->is_target[target] = true;
+                }
+                t->fixup_count++;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+static void patch_targets (Translator *t) {
+    for (int i = 0; i < t->fixup_count; i++) {
+        Fixup *fixup = &t->fixups[i];
+        int jmp = fixup->backward ?
+                  fixup->at + 2 - t->map[fixup->target] :
+                  t->map[fixup->target] - (fixup->at + 2);
+        if (jmp < 0 || jmp > UINT16_MAX) {
+            t->failed = true;
+            return;
+        }
+        t->out.code[fixup->at] = (jmp >> 8) & 0xff;
+        t->out.code[fixup->at + 1] = jmp & 0xff;
+    }
+}
+
+/* ##################################################################################### */
+
+/* Replaces the stack code of FUNCTION with register code. Returns false
+    if the function needs more than UINT8_COUNT registers, leaving the
+    stack code in place. */
+bool to_register_code (ObjFunction *function) {
+    Chunk *c = &function->c;
+    Translator t;
+    t.in = c;
+    init_chunk (&t.out);
+    t.depth = 0;
+    t.max_depth = 0;
+    t.fixup_count = 0;
+    t.last_dest = -1;
+    t.failed = false;
+
+    /* One past the end, since a jump may land right behind the code. */
+    int count = c->count + 1;
+    t.is_target = ALLOCATE(bool, count);
+    t.target_depth = ALLOCATE(int, count);
+    t.map = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++) {
+        t.is_target[i] = false;
+        t.target_depth[i] = -1;
+        t.map[i] = -1;
+    }
+    mark_targets (&t);
+    int fixup_capacity = t.fixup_count;
+    t.fixups = ALLOCATE(Fixup, fixup_capacity);
+    t.fixup_count = 0;
+
+    /* Slot 0 holds the function itself, the parameters follow. */
+    for (int i = 0; i <= function->arity; i++) push_reg (&t, i);
+
+    bool reachable = true;
+    for (t.offset = 0; t.offset < c->count && !t.failed;
+         t.offset += instruction_len (c->code[t.offset])) {
+        if (t.is_target[t.offset]) {
+            if (reachable) flush (&t, t.depth);
+            else if (t.target_depth[t.offset] != -1) {
+                t.depth = t.target_depth[t.offset];
+            }
+            for (int pos = 0; pos < t.depth; pos++) {
+                t.stack[pos].in_reg = true;
+                t.stack[pos].index = pos;
+            }
+            t.last_dest = -1;
+            reachable = true;
+        }
+        t.map[t.offset] = t.out.count;
+        t.line = get_line (c, t.offset);
+        reachable = translate (&t);
+    }
+    t.map[c->count] = t.out.count;
+    if (!t.failed) patch_targets (&t);
+
+    FREE_ARRAY(bool, t.is_target, count);
+    FREE_ARRAY(int, t.target_depth, count);
+    FREE_ARRAY(int, t.map, count);
+    FREE_ARRAY(Fixup, t.fixups, fixup_capacity);
+
+    if (t.failed) {
+        free_chunk (&t.out);
+        return false;
+    }
+
+    /* The constants stay, only the code is swapped. */
+    free_value_array (&t.out.constants);
+    t.out.constants = c->constants;
+    init_value_array (&c->constants);
+    free_chunk (c);
+    *c = t.out;
+    function->reg_count = t.max_depth;
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "common.h"
+#include "object.h"
+
+/* ##################################################################################### */
+
+bool to_register_code (ObjFunction *function);
+
+#endif
\ No newline at end of file
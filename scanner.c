@@ -1,168 +1,212 @@
-#include <ctype.h> 
 #include <stdio.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
+#ifdef SIMD_SCANNER
+#include <emmintrin.h>
+#endif
+
 /* ##################################################################################### */
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-}   Scanner;
+/* Character classes, one table lookup instead of the <ctype.h> calls.
+    Only ASCII letters and digits count, as in the "C" locale. */
+#define CHAR_ALPHA  0x01
+#define CHAR_DIGIT  0x02
+#define CHAR_SPACE  0x04    /* Whitespace other than newlines. */
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+#define S CHAR_SPACE
+static const uint8_t char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, S, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,
+};
+#undef A
+#undef D
+#undef S
+
+#define CLASS(c) (char_class[(uint8_t) (c)])
 
 /* ##################################################################################### */
 
-Scanner scanner;
+/* Keywords are found with a perfect hash of their first and last
+    character and their length; no two keywords share a slot. */
+#define KEYWORD_HASH(first, last, len) \
+    (((uint8_t) (first) + (uint8_t) (last) * 5 + (len)) & 31)
+
+typedef struct {
+    const char *name;
+    int len;
+    Token_t type;
+}   Keyword;
+
+static const Keyword keywords[32] = {
+    [KEYWORD_HASH('a', 'd', 3)] = {"and",    3, TOKEN_AND},
+    [KEYWORD_HASH('c', 's', 5)] = {"class",  5, TOKEN_CLASS},
+    [KEYWORD_HASH('e', 'e', 4)] = {"else",   4, TOKEN_ELSE},
+    [KEYWORD_HASH('f', 'e', 5)] = {"false",  5, TOKEN_FALSE},
+    [KEYWORD_HASH('f', 'r', 3)] = {"for",    3, TOKEN_FOR},
+    [KEYWORD_HASH('f', 'n', 3)] = {"fun",    3, TOKEN_FUN},
+    [KEYWORD_HASH('i', 'f', 2)] = {"if",     2, TOKEN_IF},
+    [KEYWORD_HASH('n', 'l', 3)] = {"nil",    3, TOKEN_NIL},
+    [KEYWORD_HASH('o', 'r', 2)] = {"or",     2, TOKEN_OR},
+    [KEYWORD_HASH('p', 't', 5)] = {"print",  5, TOKEN_PRINT},
+    [KEYWORD_HASH('r', 'n', 6)] = {"return", 6, TOKEN_RETURN},
+    [KEYWORD_HASH('s', 'r', 5)] = {"super",  5, TOKEN_SUPER},
+    [KEYWORD_HASH('t', 's', 4)] = {"this",   4, TOKEN_THIS},
+    [KEYWORD_HASH('t', 'e', 4)] = {"true",   4, TOKEN_TRUE},
+    [KEYWORD_HASH('v', 'r', 3)] = {"var",    3, TOKEN_VAR},
+    [KEYWORD_HASH('w', 'e', 5)] = {"while",  5, TOKEN_WHILE},
+};
 
 /* ##################################################################################### */
 
-void init_scanner (const char *source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void init_scanner (Scanner *scanner, const char *source, size_t len, 
+                   int line) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + len;
+    scanner->line = line;
 }
 
 /* ##################################################################################### */
 
-static bool is_at_end () {
-    return *scanner.current == '\0';
+static bool is_at_end (Scanner *scanner) {
+    return scanner->current == scanner->end;
 }
 
 /* ##################################################################################### */
 
-static char advance () {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance (Scanner *scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
 /* ##################################################################################### */
 
-static char peek () {
-    return *scanner.current;
+static char peek (Scanner *scanner) {
+    if (is_at_end (scanner)) return '\0';
+    return *scanner->current;
 }
 
 /* ##################################################################################### */
 
-static char peek_next () {
-    if (is_at_end ()) return '\0';
-    return scanner.current[1];
+static char peek_next (Scanner *scanner) {
+    if (scanner->end - scanner->current < 2) return '\0';
+    return scanner->current[1];
 }
 
 /* ##################################################################################### */
 
-static bool match (char expected) {
-    if (is_at_end ()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match (Scanner *scanner, char expected) {
+    if (is_at_end (scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
 /* ##################################################################################### */
 
-static Token make_token (Token_t type) {
+static Token make_token (Scanner *scanner, Token_t type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.len = (int) (scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.len = (int) (scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 /* ##################################################################################### */
 
-static Token error_token (const char *msg) {
+static Token error_token (Scanner *scanner, const char *msg) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = msg;
     token.len = (int) strlen (msg);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 /* ##################################################################################### */
 
-static void skip_whitespace () {
-    for (;;) {
-        char c = peek ();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance ();
-                break;
-            case '\n':
-                scanner.line++;
-                advance ();
-                break;
-            case '/':
-                if (peek_next () == '/') {
-                    while (peek () != '\n' && !is_at_end ())
-                        advance ();
-                } else {
-                    return;
-                }
-                break;
-            default:
-                return;
-        }
+/* Returns the first newline from P on, or END. */
+static const char *find_newline (const char *p, const char *end) {
+#ifdef SIMD_SCANNER
+    const __m128i newline = _mm_set1_epi8 ('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128 ((const __m128i *) p);
+        int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, newline));
+        if (mask != 0) return p + __builtin_ctz (mask);
     }
+#endif
+    while (p < end && *p != '\n') p++;
+    return p;
 }
 
 /* ##################################################################################### */
 
-static Token_t check_keyword (int start, int len, 
-                            const char *rest, Token_t type) {
-    if (scanner.current - scanner.start == start + len &&
-        memcmp (scanner.start + start, rest, len) == 0) {
-            return type;
+/* Returns the first '"' from P on, or END, adding the newlines passed
+    on the way to *LINES. */
+static const char *find_quote (const char *p, const char *end, int *lines) {
+#ifdef SIMD_SCANNER
+    const __m128i quote = _mm_set1_epi8 ('"');
+    const __m128i newline = _mm_set1_epi8 ('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128 ((const __m128i *) p);
+        int quotes = _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, quote));
+        int newlines = _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, newline));
+        if (quotes != 0) {
+            int at = __builtin_ctz (quotes);
+            *lines += __builtin_popcount (newlines & ((1 << at) - 1));
+            return p + at;
+        }
+        *lines += __builtin_popcount (newlines);
     }
-
-    return TOKEN_IDENTIFIER;
+#endif
+    for (; p < end && *p != '"'; p++) {
+        if (*p == '\n') (*lines)++;
+    }
+    return p;
 }
 
 /* ##################################################################################### */
 
-static Token_t identifier_type () {
-
-    switch (scanner.start[0]) {
-        case 'a': return check_keyword (1, 2, "nd", TOKEN_AND);
-        case 'c': return check_keyword (1, 4, "lass", TOKEN_CLASS);
-        case 'e': return check_keyword (1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': 
-                        return check_keyword (2, 3, "lse", TOKEN_FALSE);
-                    case 'o':
-                        return check_keyword (2, 1, "r", TOKEN_FOR);
-                    case 'u':
-                        return check_keyword (2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return check_keyword (1, 1, "f", TOKEN_IF);
-        case 'n': return check_keyword (1, 2, "il", TOKEN_NIL);
-        case 'o': return check_keyword (1, 1, "r", TOKEN_OR);
-        case 'p': return check_keyword (1, 4, "rint", TOKEN_PRINT);
-        case 'r': return check_keyword (1, 5, "eturn", TOKEN_RETURN);
-        case 's': return check_keyword (1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': 
-                        return check_keyword (2, 2, "is", TOKEN_THIS);
-                    case 'r':
-                        return check_keyword (2, 2, "ue", TOKEN_TRUE);
-                }
-            }
+/* Works on a local copy of current, like the other loops over many 
+    characters, so it can stay in a register. */
+static void skip_whitespace (Scanner *scanner) {
+    const char *p = scanner->current;
+    const char *end = scanner->end;
+    for (; p < end; p++) {
+        if (CLASS(*p) & CHAR_SPACE) continue;
+
+        if (*p == '\n') {
+            scanner->line++;
+        } else if (*p == '/' && end - p >= 2 && p[1] == '/') {
+            p = find_newline (p, end) - 1;
+        } else {
             break;
+        }
+    }
+    scanner->current = p;
+}
 
-        case 'v': return check_keyword (1, 2, "ar", TOKEN_VAR);
-        case 'w': return check_keyword (1, 4, "hile", TOKEN_WHILE);
+/* ##################################################################################### */
 
+static Token_t identifier_type (Scanner *scanner) {
+    int len = (int) (scanner->current - scanner->start);
+    const Keyword *keyword = &keywords[KEYWORD_HASH(scanner->start[0], 
+                                                    scanner->current[-1], len)];
+    if (keyword->len == len && 
+        memcmp (scanner->start, keyword->name, len) == 0) {
+        return keyword->type;
     }
 
     return TOKEN_IDENTIFIER;
@@ -170,76 +214,84 @@ static Token_t identifier_type () {
 
 /* ##################################################################################### */
 
-static Token identifier () {
-    while (isalpha (peek ()) || isdigit (peek ())) advance ();
-    return make_token (identifier_type ());
+static const char *skip_class (const char *p, const char *end, uint8_t mask) {
+    while (p < end && (CLASS(*p) & mask)) p++;
+    return p;
+}
+
+/* ##################################################################################### */
+
+static Token identifier (Scanner *scanner) {
+    scanner->current = skip_class (scanner->current, scanner->end, 
+                                   CHAR_ALPHA | CHAR_DIGIT);
+    return make_token (scanner, identifier_type (scanner));
 }
 
 /* ##################################################################################### */
 
-static Token number () {
-    while (isdigit (peek ())) advance ();
+static Token number (Scanner *scanner) {
+    scanner->current = skip_class (scanner->current, scanner->end, CHAR_DIGIT);
 
-    if (peek () == '.' && isdigit (peek_next ())) {
-        advance ();
+    if (peek (scanner) == '.' && (CLASS(peek_next (scanner)) & CHAR_DIGIT)) {
+        advance (scanner);
 
-        while (isdigit (peek ())) advance ();
+        scanner->current = skip_class (scanner->current, scanner->end, CHAR_DIGIT);
     }
 
-    return make_token (TOKEN_NUMBER);
+    return make_token (scanner, TOKEN_NUMBER);
 }
 
 /* ##################################################################################### */
 
-static Token string () {
-    while (peek () != '"' && !is_at_end ()) {
-        if (peek () == '\n') scanner.line++;
-        advance ();
-    }
+static Token string (Scanner *scanner) {
+    scanner->current = find_quote (scanner->current, scanner->end, 
+                                  &scanner->line);
 
-    if (is_at_end ()) return error_token ("Unterminated string.");
+    if (is_at_end (scanner)) {
+        return error_token (scanner, "Unterminated string.");
+    }
 
-    advance ();
-    return make_token (TOKEN_STRING);
+    advance (scanner);
+    return make_token (scanner, TOKEN_STRING);
 }
 
 /* ##################################################################################### */
 
-Token scan_token () {
-    skip_whitespace ();
-    scanner.start = scanner.current;
-    if (is_at_end ()) return make_token (TOKEN_EOF);
+Token scan_token (Scanner *scanner) {
+    skip_whitespace (scanner);
+    scanner->start = scanner->current;
+    if (is_at_end (scanner)) return make_token (scanner, TOKEN_EOF);
 
-    char c = advance ();
-    if (isalpha (c) || c == '_') return identifier ();
-    if (isdigit (c)) return number ();
+    char c = advance (scanner);
+    if ((CLASS(c) & CHAR_ALPHA) || c == '_') return identifier (scanner);
+    if (CLASS(c) & CHAR_DIGIT) return number (scanner);
     switch (c) {
-        case '(': return make_token (TOKEN_LEFT_PAREN);
-        case ')': return make_token (TOKEN_RIGHT_PAREN);
-        case '{': return make_token (TOKEN_LEFT_BRACE);
-        case '}': return make_token (TOKEN_RIGHT_BRACE);
-        case ';': return make_token (TOKEN_SEMICOLON);
-        case ',': return make_token (TOKEN_COMMA);
-        case '.': return make_token (TOKEN_DOT);
-        case '-': return make_token (TOKEN_MINUS);
-        case '+': return make_token (TOKEN_PLUS);
-        case '/': return make_token (TOKEN_SLASH);
-        case '*': return make_token (TOKEN_STAR);
+        case '(': return make_token (scanner, TOKEN_LEFT_PAREN);
+        case ')': return make_token (scanner, TOKEN_RIGHT_PAREN);
+        case '{': return make_token (scanner, TOKEN_LEFT_BRACE);
+        case '}': return make_token (scanner, TOKEN_RIGHT_BRACE);
+        case ';': return make_token (scanner, TOKEN_SEMICOLON);
+        case ',': return make_token (scanner, TOKEN_COMMA);
+        case '.': return make_token (scanner, TOKEN_DOT);
+        case '-': return make_token (scanner, TOKEN_MINUS);
+        case '+': return make_token (scanner, TOKEN_PLUS);
+        case '/': return make_token (scanner, TOKEN_SLASH);
+        case '*': return make_token (scanner, TOKEN_STAR);
         case '!':
-            return make_token (
-                match ('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return make_token (scanner, 
+                match (scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return make_token (
-                match ('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return make_token (scanner, 
+                match (scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return make_token (
-                match ('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return make_token (scanner, 
+                match (scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return make_token (
-                match ('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return make_token (scanner, 
+                match (scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         case '"':
-            return string ();
+            return string (scanner);
   }
     
-    return error_token ("Unexpected character.");
+    return error_token (scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 /* ##################################################################################### */
 
 typedef enum {
@@ -35,7 +37,19 @@ typedef struct {
 
 /* ##################################################################################### */
 
-void init_scanner(const char* source);
-Token scan_token ();
+/* The source is not NUL-terminated, it may be a mapped file, so the
+    scanner stops at END and never reads it. Each compile has its own
+    Scanner, so several can run at once. */
+typedef struct {
+    const char* start;
+    const char* current;
+    const char* end;
+    int line;
+}   Scanner;
+
+/* ##################################################################################### */
+
+void init_scanner(Scanner *scanner, const char* source, size_t len, int line);
+Token scan_token (Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "slab.h"
+
+/* ##################################################################################### */
+
+/* The start of every slab. Its blocks follow, aligned like malloc's. */
+typedef struct Slab {
+    struct Slab *next;
+    int size_class;
+}   Slab;
+
+#define SLAB_HEADER \
+    ((sizeof(Slab) + SLAB_GRANULE - 1) & ~(size_t) (SLAB_GRANULE - 1))
+
+#define SIZE_CLASS(size) ((int) (((size) - 1) / SLAB_GRANULE))
+#define CLASS_SIZE(size_class) (((size_t) (size_class) + 1) * SLAB_GRANULE)
+
+/* ##################################################################################### */
+
+void init_slabs (SlabPool *pool) {
+    pool->slabs = NULL;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pool->free[i] = NULL;
+        pool->last[i] = NULL;
+        pool->bump[i] = NULL;
+        pool->bump_end[i] = NULL;
+        pool->slab_count[i] = 0;
+        pool->in_use[i] = 0;
+    }
+    pool->large_in_use = 0;
+}
+
+/* ##################################################################################### */
+
+/* Gives every slab back, whatever is still in use. */
+void free_slabs (SlabPool *pool) {
+    Slab *slab = pool->slabs;
+    while (slab != NULL) {
+        Slab *next = slab->next;
+        reallocate (slab, SLAB_SIZE, 0);
+        slab = next;
+    }
+    init_slabs (pool);
+}
+
+/* ##################################################################################### */
+
+/* Takes a block from the free list of SIZE_CLASS, or else from the
+    uncarved part of its newest slab, starting a new slab if that is
+    used up. */
+static void *allocate_block (SlabPool *pool, int size_class) {
+    pool->in_use[size_class]++;
+    void *block = pool->free[size_class];
+    if (block != NULL) {
+        pool->free[size_class] = *(void **) block;
+        return block;
+    }
+
+    size_t size = CLASS_SIZE(size_class);
+    if ((size_t) (pool->bump_end[size_class] - pool->bump[size_class]) < size) {
+        Slab *slab = (Slab *) reallocate (NULL, 0, SLAB_SIZE);
+        slab->next = pool->slabs;
+        slab->size_class = size_class;
+        pool->slabs = slab;
+        pool->slab_count[size_class]++;
+        pool->bump[size_class] = (uint8_t *) slab + SLAB_HEADER;
+        pool->bump_end[size_class] = (uint8_t *) slab + SLAB_SIZE;
+    }
+    block = pool->bump[size_class];
+    pool->bump[size_class] += size;
+    return block;
+}
+
+/* ##################################################################################### */
+
+static void free_block (SlabPool *pool, void *block, int size_class) {
+    pool->in_use[size_class]--;
+    if (pool->free[size_class] == NULL) pool->last[size_class] = block;
+    *(void **) block = pool->free[size_class];
+    pool->free[size_class] = block;
+}
+
+/* ##################################################################################### */
+
+/* Like reallocate (), but small blocks come from POOL. OLD_SIZE must be
+    what POINTER was allocated with, as that tells where it came from. */
+void *slab_reallocate (SlabPool *pool, void *pointer, size_t old_size,
+                       size_t new_size) {
+    bool old_small = old_size > 0 && old_size <= SLAB_MAX_SIZE;
+    bool new_small = new_size > 0 && new_size <= SLAB_MAX_SIZE;
+    if (!old_small && !new_small) {
+        if (old_size == 0) pool->large_in_use++;
+        if (new_size == 0) pool->large_in_use--;
+        return reallocate (pointer, old_size, new_size);
+    }
+    if (old_small && new_small &&
+        SIZE_CLASS(old_size) == SIZE_CLASS(new_size)) {
+        return pointer;
+    }
+
+    void *result = NULL;
+    if (new_small) {
+        result = allocate_block (pool, SIZE_CLASS(new_size));
+    } else if (new_size > 0) {
+        result = reallocate (NULL, 0, new_size);
+        pool->large_in_use++;
+    }
+    if (result != NULL && pointer != NULL) {
+        memcpy (result, pointer, old_size < new_size ? old_size : new_size);
+    }
+    if (old_small) {
+        free_block (pool, pointer, SIZE_CLASS(old_size));
+    } else if (old_size > 0) {
+        reallocate (pointer, old_size, 0);
+        pool->large_in_use--;
+    }
+    return result;
+}
+
+/* ##################################################################################### */
+
+/* Moves the free lists and counts of FREED, a pool without slabs of
+    its own that blocks of POOL were freed into, over to POOL. */
+void merge_slabs (SlabPool *pool, SlabPool *freed) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (freed->free[i] != NULL) {
+            *(void **) freed->last[i] = pool->free[i];
+            if (pool->free[i] == NULL) pool->last[i] = freed->last[i];
+            pool->free[i] = freed->free[i];
+        }
+        pool->in_use[i] += freed->in_use[i];
+    }
+    pool->large_in_use += freed->large_in_use;
+    init_slabs (freed);
+}
+
+/* ##################################################################################### */
+
+/* How full the slabs of each size class are, see --gc-stats. */
+void print_slab_stats (SlabPool *pool) {
+    fprintf (stderr, "Slabs:\n");
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (pool->slab_count[i] == 0) continue;
+        long capacity = (long) pool->slab_count[i] *
+                        (long) ((SLAB_SIZE - SLAB_HEADER) / CLASS_SIZE(i));
+        fprintf (stderr, "  %4zu bytes: %d slabs, %ld of %ld blocks in use "
+                 "(%ld%%)\n", CLASS_SIZE(i), pool->slab_count[i],
+                 pool->in_use[i], capacity, 100 * pool->in_use[i] / capacity);
+    }
+    fprintf (stderr, "  larger: %ld in use\n", pool->large_in_use);
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+/* ##################################################################################### */
+
+/* Blocks of up to SLAB_MAX_SIZE bytes are carved out of slabs of
+    SLAB_SIZE bytes, one size class per multiple of SLAB_GRANULE, and
+    recycled through a free list per class. Larger ones come from
+    malloc. */
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_SIZE (64 * 1024)
+
+/* ##################################################################################### */
+
+/* The slabs the objects of one VM live in. */
+typedef struct {
+    struct Slab *slabs;     /* Every slab, for free_slabs (). */
+    void *free[SLAB_CLASSES]; /* Free blocks, linked through their
+                                 first word. */
+    void *last[SLAB_CLASSES]; /* The end of each free list. */
+    uint8_t *bump[SLAB_CLASSES]; /* Where the newest slab of each class
+                                    is not carved up yet. */
+    uint8_t *bump_end[SLAB_CLASSES];
+    int slab_count[SLAB_CLASSES];
+    long in_use[SLAB_CLASSES];   /* Blocks handed out and not freed. */
+    long large_in_use;      /* The same for malloc. */
+}   SlabPool;
+
+/* ##################################################################################### */
+
+void init_slabs (SlabPool *pool);
+void free_slabs (SlabPool *pool);
+void *slab_reallocate (SlabPool *pool, void *pointer, size_t old_size,
+                       size_t new_size);
+void merge_slabs (SlabPool *pool, SlabPool *freed);
+void print_slab_stats (SlabPool *pool);
+
+#endif
\ No newline at end of file
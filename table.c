@@ -5,6 +5,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 /* Might be optimized in the future, 
     now somewhat arbitrary. */
@@ -138,7 +139,39 @@ void table_add_all (Table *from, Table *to) {
 
 /* ##################################################################################### */
 
-ObjString *table_find_string (Table *table, const char *chars,
+void mark_table (VM *vm, Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        mark_object (vm, (Obj *) entry->key);
+        mark_value (vm, entry->val);
+    }
+}
+
+/* ##################################################################################### */
+
+/* Puts NEW_KEY, a copy of KEY with the same hash, in place of KEY. */
+void table_rekey (Table *table, ObjString *key, ObjString *new_key) {
+    if (table->count == 0) return;
+
+    Entry *entry = find_entry (table->entries, table->capacity, key);
+    if (entry->key == key) entry->key = new_key;
+}
+
+/* ##################################################################################### */
+
+/* Whether STRING is garbage the sweep has not freed yet. */
+static bool is_dead_string (VM *vm, ObjString *string) {
+    return vm->gc_phase == GC_SWEEP && !IS_YOUNG(vm, string) &&
+           string->obj.is_marked != vm->mark_sense;
+}
+
+/* ##################################################################################### */
+
+/* Returns the interned string with CHARS, if any. While the sweep is 
+    in progress, the table may still hold strings the marking did not
+    reach. Those are passed over, as the sweep frees them without
+    looking again, and the caller makes a new one. */
+ObjString *table_find_string (VM *vm, Table *table, const char *chars,
                               int len, uint32_t hash) {
     if (table->count == 0) return NULL;
 
@@ -150,7 +183,8 @@ ObjString *table_find_string (Table *table, const char *chars,
             if (IS_NIL(entry->val)) return NULL;
         } else if (entry->key->len == len &&
                    entry->key->hash == hash &&
-                   memcmp (entry->key->chars, chars, len) == 0) {
+                   memcmp (entry->key->chars, chars, len) == 0 &&
+                   !is_dead_string (vm, entry->key)) {
             /* Found it! */
             return entry->key;
         }
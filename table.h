@@ -2,6 +2,7 @@
 #define clox_table_h
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
 
 /* ##################################################################################### */
@@ -27,8 +28,10 @@ bool table_get (Table *table, ObjString *key, Value *val);
 bool table_set (Table *table, ObjString *key, Value val);
 bool table_delete (Table *table, ObjString *key);
 void table_add_all (Table *from, Table *to);
+void mark_table (VM *vm, Table *table);
+void table_rekey (Table *table, ObjString *key, ObjString *new_key);
 
-ObjString *table_find_string (Table *table, const char *chars,
+ObjString *table_find_string (VM *vm, Table *table, const char *chars,
                               int len, uint32_t hash);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1108 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef TRACING_JIT
+
+/* ##################################################################################### */
+
+/* The tracing JIT is the tier above the baseline JIT. Once a loop got
+    hot, the recorder goes through one iteration of it, starting at the
+    loop header, on copies of the values in the frame, and writes out
+    machine code for exactly the path it took. Every variable the loop
+    touches is loaded into an xmm register when the trace is entered
+    and stays there unboxed until the trace exits. Types are checked on
+    entry only: the trace stores nothing but numbers, so what held for
+    the first iteration holds for every one after it. Each branch is a
+    guard whose failure is a side exit, which writes the variables back,
+    boxes and pushes the temporaries that are on the value stack at that
+    point, and lets run () carry on with the bytecode the other way of
+    the branch. Anything the recorder does not know, such as calls,
+    strings or printing, aborts the recording and leaves the loop to the
+    interpreter and the baseline JIT. */
+
+/* Limits of one recording. Loops that need more are not traced. */
+#define MAX_TRACE_OPS   512     /* Instructions recorded. */
+#define MAX_TRACE_STACK 32      /* Values on top of the frame's locals. */
+#define MAX_TRACE_EXITS 64
+#define MAX_TRACE_LOOPS 16      /* Backward jumps to somewhere else. */
+
+/* The registers of a trace. xmm0 and xmm1 are scratch, the others hold
+    variables and temporary numbers, and booleans live in r8 to r11.
+    rdi, rsi and rdx keep the arguments of the entry throughout, and rax
+    and rcx are scratch. Nothing is called, so none of them are saved. */
+#define XMM_FIRST 2
+#define XMM_COUNT 16
+#define BOOL_COUNT 4
+#define MAX_TRACE_VARS (XMM_COUNT - XMM_FIRST)
+
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+/* Condition codes of jcc and setcc. */
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_P  0xa
+
+/* SSE2 opcodes, the first three with prefix 0xf2, the rest with 0x66. */
+#define ADDSD   0x58
+#define MULSD   0x59
+#define SUBSD   0x5c
+#define DIVSD   0x5e
+#define MOVAPD  0x28
+#define UCOMISD 0x2e
+#define XORPD   0x57
+
+/* Returned by a trace whose entry turned down the types it found. The
+    code returning it comes first, the entry right behind it. */
+#define TRACE_MISS -1
+#define TRACE_ENTRY 6
+
+/* ##################################################################################### */
+
+/* Where run () carries on after a side exit. */
+typedef struct {
+    int offset;             /* Bytecode offset to resume at. */
+    int stack_count;        /* Values the exit pushed onto the stack. */
+}   TraceExit;
+
+struct Trace {
+    struct Trace *next;     /* The next trace of the same function. */
+    int header;             /* Offset of the loop header it starts at. */
+    int loop;               /* Offset of its OP_LOOP_TRACE. */
+    int base;               /* Stack depth of the frame at the header. */
+    int misses;             /* Entries turned down in a row. */
+    TraceExit *exits;
+    int exit_count;
+    uint8_t *code;          /* Executable memory. */
+    size_t size;            /* Size of the mapping holding CODE. */
+};
+
+/* Runs the trace in the frame with SLOTS, pushing what a side exit
+    leaves on the stack at SP. Returns the exit taken or TRACE_MISS. */
+typedef int (*TraceEntry)(Value *slots, Global *globals, Value *sp);
+
+/* ##################################################################################### */
+
+typedef enum {
+    REF_CONST,              /* Known while recording. */
+    REF_VAR,                /* A variable, in its home register. */
+    REF_NUM,                /* A number in an xmm register. */
+    REF_BOOL,               /* 0 or 1 in one of r8 to r11. */
+}   Ref_t;
+
+/* A value on the stack as the recorder sees it. */
+typedef struct {
+    Ref_t type;
+    int reg;                /* The variable of REF_VAR, else the register. */
+    Value val;              /* What it is in the recorded iteration. */
+}   Ref;
+
+/* A local below the recorded stack, or a global, that the trace keeps
+    in a home register. */
+typedef struct {
+    bool global;
+    int index;              /* Slot in the frame or in vm->globals. */
+    int reg;
+    bool guarded;           /* Read before written, so checked on entry. */
+    bool written;           /* Stored back at every exit. */
+    Value val;
+}   Var;
+
+/* The stack at a side exit, which its stub pushes. */
+typedef struct {
+    int offset;
+    int depth;
+    Ref stack[MAX_TRACE_STACK];
+}   Snapshot;
+
+/* A jump to the stub of side exit EXIT, its rel32 at AT in the body. */
+typedef struct {
+    int at;
+    int exit;
+}   ExitJump;
+
+/* Machine code being written. Unlike the baseline JIT's, it grows. */
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+}   Buffer;
+
+/* ##################################################################################### */
+
+/* How a comparison came out: in the flags, as the condition TYPE (or
+    its opposite if NEGATED), or known while recording. */
+typedef enum {
+    COND_ABOVE,
+    COND_ABOVE_EQUAL,
+    COND_EQUAL_NUM,         /* Equal and not unordered, see ucomisd. */
+    COND_EQUAL_INT,
+}   Cond_t;
+
+typedef struct {
+    Cond_t type;
+    bool negated;
+    bool known;
+    bool val;               /* Its result in the recorded iteration. */
+}   Cond;
+
+/* ##################################################################################### */
+
+typedef struct {
+    VM *vm;
+    Chunk *c;
+    Value *slots;
+    int header;
+    int base;
+    Ref stack[MAX_TRACE_STACK];
+    int depth;
+    Var vars[MAX_TRACE_VARS];
+    int var_count;
+    /* References to each register. Home registers are never freed. */
+    int xmm_uses[XMM_COUNT];
+    int bool_uses[BOOL_COUNT];
+    Snapshot exits[MAX_TRACE_EXITS];
+    int exit_count;
+    ExitJump jumps[2 * MAX_TRACE_EXITS];
+    int jump_count;
+    int loops[MAX_TRACE_LOOPS];
+    int loop_count;
+    Buffer body;            /* The loop, entered after the variables are
+                               loaded. */
+    bool failed;
+}   Recorder;
+
+/* ##################################################################################### */
+
+static void emit_bytes (Buffer *b, const uint8_t *bytes, int count) {
+    if (b->count + count > b->capacity) {
+        int old_capacity = b->capacity;
+        while (b->count + count > b->capacity) {
+            b->capacity = GROW_CAPACITY(b->capacity);
+        }
+        b->code = GROW_ARRAY(uint8_t, b->code, old_capacity, b->capacity);
+    }
+    memcpy (&b->code[b->count], bytes, count);
+    b->count += count;
+}
+
+static void emit32 (Buffer *b, uint32_t word) {
+    emit_bytes (b, (const uint8_t *) &word, sizeof (word));
+}
+
+static void emit64 (Buffer *b, uint64_t word) {
+    emit_bytes (b, (const uint8_t *) &word, sizeof (word));
+}
+
+#define EMIT(...)                                           \
+    do {                                                    \
+        const uint8_t bytes_[] = {__VA_ARGS__};             \
+        emit_bytes (b, bytes_, sizeof (bytes_));            \
+    } while (false)
+
+/* Writes a rel32 operand landing on TARGET. */
+static void emit_rel32 (Buffer *b, int target) {
+    emit32 (b, (uint32_t) (target - (b->count + 4)));
+}
+
+static void patch_rel32 (Buffer *b, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy (&b->code[at], &rel, sizeof (rel));
+}
+
+/* ##################################################################################### */
+
+/* OP xmm REG, xmm RM, an SSE2 instruction with mandatory PREFIX. */
+static void emit_sse (Buffer *b, uint8_t prefix, uint8_t op, int reg, int rm) {
+    EMIT(prefix);
+    if (reg >= 8 || rm >= 8) EMIT(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    EMIT(0x0f, op, (uint8_t) (0xc0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+/* movq xmm REG, rax */
+static void emit_movq_rax (Buffer *b, int reg) {
+    EMIT(0x66, reg >= 8 ? 0x4c : 0x48, 0x0f, 0x6e, (uint8_t) (0xc0 | (reg & 7) << 3));
+}
+
+/* xmm REG = the number VAL. */
+static void emit_load_number (Buffer *b, int reg, Value val) {
+    EMIT(0x48, 0xb8);                       /* mov rax, imm64 */
+    emit64 (b, val);
+    emit_movq_rax (b, reg);
+}
+
+/* movq [BASE + DISP], xmm REG */
+static void emit_store (Buffer *b, int reg, int base, int32_t disp) {
+    EMIT(0x66);
+    if (reg >= 8) EMIT(0x44);
+    EMIT(0x0f, 0xd6, (uint8_t) (0x80 | (reg & 7) << 3 | base));
+    emit32 (b, (uint32_t) disp);
+}
+
+/* Goes to TARGET unless rax holds a number. */
+static void emit_number_guard (Buffer *b, int target) {
+    EMIT(0x48, 0x89, 0xc1);                 /* mov rcx, rax */
+    EMIT(0x48, 0xf7, 0xd1);                 /* not rcx */
+    EMIT(0x48, 0xc1, 0xe9, 50);             /* shr rcx, 50 */
+    EMIT(0xf7, 0xc1);                       /* test ecx, QNAN >> 50 */
+    emit32 (b, (uint32_t) (QNAN >> 50));
+    EMIT(0x0f, 0x84);                       /* jz target */
+    emit_rel32 (b, target);
+}
+
+/* ##################################################################################### */
+
+/* Where variable VAR lives outside the trace, as a base register and
+    a displacement. */
+static int var_base (Var *var) {
+    return var->global ? RSI : RDI;
+}
+
+static int32_t var_disp (Var *var) {
+    if (var->global) {
+        return (int32_t) (var->index * sizeof (Global) + offsetof(Global, val));
+    }
+    return (int32_t) (var->index * sizeof (Value));
+}
+
+/* ##################################################################################### */
+
+static Ref const_ref (Value val) {
+    return (Ref) {REF_CONST, 0, val};
+}
+
+static bool is_number (Ref *ref) {
+    return ref->type == REF_VAR || ref->type == REF_NUM ||
+           (ref->type == REF_CONST && IS_NUMBER(ref->val));
+}
+
+static bool is_bool (Ref *ref) {
+    return ref->type == REF_BOOL ||
+           (ref->type == REF_CONST && IS_BOOL(ref->val));
+}
+
+/* ##################################################################################### */
+
+static int alloc_xmm (Recorder *rec) {
+    for (int reg = XMM_FIRST; reg < XMM_COUNT; reg++) {
+        if (rec->xmm_uses[reg] == 0) {
+            rec->xmm_uses[reg] = 1;
+            return reg;
+        }
+    }
+    rec->failed = true;
+    return XMM_FIRST;
+}
+
+static int alloc_bool (Recorder *rec) {
+    for (int reg = 0; reg < BOOL_COUNT; reg++) {
+        if (rec->bool_uses[reg] == 0) {
+            rec->bool_uses[reg] = 1;
+            return reg;
+        }
+    }
+    rec->failed = true;
+    return 0;
+}
+
+static void retain (Recorder *rec, Ref *ref) {
+    if (ref->type == REF_NUM) rec->xmm_uses[ref->reg]++;
+    else if (ref->type == REF_BOOL) rec->bool_uses[ref->reg]++;
+}
+
+static void release (Recorder *rec, Ref *ref) {
+    if (ref->type == REF_NUM) rec->xmm_uses[ref->reg]--;
+    else if (ref->type == REF_BOOL) rec->bool_uses[ref->reg]--;
+}
+
+/* ##################################################################################### */
+
+/* The stack holds the values above the frame's locals at the header.
+    Popping hands the reference to the caller, who releases it. */
+static void push_ref (Recorder *rec, Ref ref) {
+    if (rec->depth == MAX_TRACE_STACK) {
+        rec->failed = true;
+        return;
+    }
+    rec->stack[rec->depth++] = ref;
+}
+
+static Ref pop_ref (Recorder *rec) {
+    if (rec->depth == 0) {
+        rec->failed = true;
+        return const_ref (NIL_VAL);
+    }
+    return rec->stack[--rec->depth];
+}
+
+/* ##################################################################################### */
+
+/* The xmm register holding the number REF, loading a constant into
+    SCRATCH. */
+static int xmm_of (Recorder *rec, Ref *ref, int scratch) {
+    switch (ref->type) {
+        case REF_VAR: return rec->vars[ref->reg].reg;
+        case REF_NUM: return ref->reg;
+        default:
+            emit_load_number (&rec->body, scratch, ref->val);
+            return scratch;
+    }
+}
+
+/* A register for the result of an operation on the number A: its own
+    if nothing else refers to it, else a copy. Releases A. */
+static int result_xmm (Recorder *rec, Ref *a) {
+    if (a->type == REF_NUM && rec->xmm_uses[a->reg] == 1) return a->reg;
+    int reg = alloc_xmm (rec);
+    if (a->type == REF_CONST) {
+        emit_load_number (&rec->body, reg, a->val);
+    } else {
+        emit_sse (&rec->body, 0x66, MOVAPD, reg, xmm_of (rec, a, 0));
+    }
+    release (rec, a);
+    return reg;
+}
+
+/* ##################################################################################### */
+
+/* Takes a snapshot of the stack for a side exit to OFFSET. */
+static int add_exit (Recorder *rec, int offset) {
+    if (rec->exit_count == MAX_TRACE_EXITS) {
+        rec->failed = true;
+        return 0;
+    }
+    Snapshot *exit = &rec->exits[rec->exit_count];
+    exit->offset = offset;
+    exit->depth = rec->depth;
+    memcpy (exit->stack, rec->stack, rec->depth * sizeof (Ref));
+    return rec->exit_count++;
+}
+
+/* jcc to the stub of EXIT. */
+static void emit_exit_jump (Recorder *rec, uint8_t cc, int exit) {
+    Buffer *b = &rec->body;
+    EMIT(0x0f, 0x80 | cc);
+    rec->jumps[rec->jump_count].at = b->count;
+    rec->jumps[rec->jump_count].exit = exit;
+    rec->jump_count++;
+    emit32 (b, 0);
+}
+
+/* Leaves the trace through a new side exit to OFFSET unless COND comes
+    out the way it did while recording. */
+static void guard (Recorder *rec, Cond cond, int offset) {
+    if (cond.known) return;
+    Buffer *b = &rec->body;
+    int exit = add_exit (rec, offset);
+    bool flags = cond.val != cond.negated;
+    switch (cond.type) {
+        case COND_ABOVE:
+            emit_exit_jump (rec, flags ? CC_BE : CC_A, exit);
+            break;
+        case COND_ABOVE_EQUAL:
+            emit_exit_jump (rec, flags ? CC_B : CC_AE, exit);
+            break;
+        case COND_EQUAL_INT:
+            emit_exit_jump (rec, flags ? CC_NE : CC_E, exit);
+            break;
+        case COND_EQUAL_NUM:
+            if (flags) {
+                emit_exit_jump (rec, CC_NE, exit);
+                emit_exit_jump (rec, CC_P, exit);
+            } else {
+                EMIT(0x7a, 0x06);           /* jp over the je */
+                emit_exit_jump (rec, CC_E, exit);
+            }
+            break;
+    }
+}
+
+/* Follows the branch of a conditional jump to TARGET that is taken if
+    COND is false, and returns where the recording goes on. */
+static int branch (Recorder *rec, Cond cond, int next, int target) {
+    guard (rec, cond, cond.val ? target : next);
+    return cond.val ? next : target;
+}
+
+/* Pushes the result of COND as a boolean. */
+static void push_cond (Recorder *rec, Cond cond) {
+    if (cond.known) {
+        push_ref (rec, const_ref (BOOL_VAL(cond.val)));
+        return;
+    }
+    Buffer *b = &rec->body;
+    int reg = alloc_bool (rec);
+    uint8_t cc = cond.type == COND_ABOVE ? CC_A :
+                 cond.type == COND_ABOVE_EQUAL ? CC_AE : CC_E;
+    EMIT(0x41, 0x0f, 0x90 | cc, 0xc0 | reg);    /* setcc rNb */
+    if (cond.type == COND_EQUAL_NUM) {
+        EMIT(0x0f, 0x9b, 0xc0);                 /* setnp al */
+        EMIT(0x41, 0x20, 0xc0 | reg);           /* and rNb, al */
+    }
+    EMIT(0x45, 0x0f, 0xb6, 0xc0 | reg << 3 | reg);  /* movzx rNd, rNb */
+    if (cond.negated) EMIT(0x41, 0x83, 0xf0 | reg, 0x01);  /* xor rNd, 1 */
+    push_ref (rec, (Ref) {REF_BOOL, reg, BOOL_VAL(cond.val)});
+}
+
+/* ##################################################################################### */
+
+/* Compares LHS and RHS for equality. Unless both are numbers or both
+    are booleans the answer only depends on their types, which are
+    known while recording. */
+static Cond equality (Recorder *rec, Ref *lhs, Ref *rhs) {
+    Buffer *b = &rec->body;
+    Cond cond = {COND_EQUAL_INT, false, true, values_equal (lhs->val, rhs->val)};
+    if (lhs->type == REF_CONST && rhs->type == REF_CONST) return cond;
+
+    if (is_number (lhs) && is_number (rhs)) {
+        cond.type = COND_EQUAL_NUM;
+        cond.known = false;
+        int reg = xmm_of (rec, lhs, 0);
+        emit_sse (b, 0x66, UCOMISD, reg, xmm_of (rec, rhs, 1));
+    } else if (is_bool (lhs) && is_bool (rhs)) {
+        cond.known = false;
+        if (lhs->type == REF_CONST) {
+            Ref *swap = lhs;
+            lhs = rhs;
+            rhs = swap;
+        }
+        if (rhs->type == REF_CONST) {           /* cmp rNd, imm8 */
+            EMIT(0x41, 0x83, 0xf8 | lhs->reg, AS_BOOL(rhs->val));
+        } else {                                /* cmp rNd, rMd */
+            EMIT(0x45, 0x39, 0xc0 | rhs->reg << 3 | lhs->reg);
+        }
+    }
+    return cond;
+}
+
+/* Pops two operands and compares them as OP, one of OP_EQUAL up to
+    OP_LESS_EQUAL. */
+static Cond compare (Recorder *rec, uint8_t op) {
+    Ref rhs = pop_ref (rec);
+    Ref lhs = pop_ref (rec);
+    Cond cond = {COND_EQUAL_INT, false, true, false};
+
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+        cond = equality (rec, &lhs, &rhs);
+        if (op == OP_NOT_EQUAL) {
+            cond.negated = !cond.negated;
+            cond.val = !cond.val;
+        }
+    } else if (!is_number (&lhs) || !is_number (&rhs)) {
+        rec->failed = true;     /* A runtime error, left to run (). */
+    } else {
+        double a = AS_NUMBER(lhs.val);
+        double b = AS_NUMBER(rhs.val);
+        cond.val = op == OP_GREATER ? a > b : op == OP_GREATER_EQUAL ? a >= b :
+                   op == OP_LESS ? a < b : a <= b;
+        if (lhs.type != REF_CONST || rhs.type != REF_CONST) {
+            /* Less is greater the other way round. Testing for above
+                either way sends NaNs down the false branch like run (). */
+            bool swap = op == OP_LESS || op == OP_LESS_EQUAL;
+            cond.type = op == OP_GREATER || op == OP_LESS ? COND_ABOVE
+                                                          : COND_ABOVE_EQUAL;
+            cond.known = false;
+            int reg = xmm_of (rec, swap ? &rhs : &lhs, 0);
+            emit_sse (&rec->body, 0x66, UCOMISD, reg,
+                      xmm_of (rec, swap ? &lhs : &rhs, 1));
+        }
+    }
+    release (rec, &lhs);
+    release (rec, &rhs);
+    return cond;
+}
+
+/* Whether REF is truthy. Only booleans in registers are not known while
+    recording, as every number is truthy. */
+static Cond truth (Recorder *rec, Ref *ref) {
+    Buffer *b = &rec->body;
+    Cond cond = {COND_EQUAL_INT, true, true, !is_falsey (ref->val)};
+    if (ref->type == REF_BOOL) {
+        cond.known = false;
+        EMIT(0x45, 0x85, 0xc0 | ref->reg << 3 | ref->reg);  /* test rNd, rNd */
+    }
+    return cond;
+}
+
+/* ##################################################################################### */
+
+/* Pops two numbers and pushes the result of the SSE2 instruction OP. */
+static void arithmetic (Recorder *rec, uint8_t op) {
+    Ref rhs = pop_ref (rec);
+    Ref lhs = pop_ref (rec);
+    if (!is_number (&lhs) || !is_number (&rhs)) {
+        rec->failed = true;     /* Strings, or a runtime error. */
+        return;
+    }
+    double a = AS_NUMBER(lhs.val);
+    double b = AS_NUMBER(rhs.val);
+    Value res = NUMBER_VAL(op == ADDSD ? a + b : op == SUBSD ? a - b :
+                           op == MULSD ? a * b : a / b);
+    if (lhs.type == REF_CONST && rhs.type == REF_CONST) {
+        push_ref (rec, const_ref (res));
+        return;
+    }
+
+    int reg = result_xmm (rec, &lhs);
+    emit_sse (&rec->body, 0xf2, op, reg, xmm_of (rec, &rhs, 1));
+    release (rec, &rhs);
+    push_ref (rec, (Ref) {REF_NUM, reg, res});
+}
+
+static void negate (Recorder *rec) {
+    Buffer *b = &rec->body;
+    Ref ref = pop_ref (rec);
+    if (!is_number (&ref)) {
+        rec->failed = true;
+        return;
+    }
+    Value res = NUMBER_VAL(-AS_NUMBER(ref.val));
+    if (ref.type == REF_CONST) {
+        push_ref (rec, const_ref (res));
+        return;
+    }
+
+    int reg = result_xmm (rec, &ref);
+    EMIT(0x48, 0xb8);                       /* mov rax, SIGN_BIT */
+    emit64 (b, SIGN_BIT);
+    emit_movq_rax (b, 0);
+    emit_sse (b, 0x66, XORPD, reg, 0);
+    push_ref (rec, (Ref) {REF_NUM, reg, res});
+}
+
+static void record_not (Recorder *rec) {
+    Buffer *b = &rec->body;
+    Ref ref = pop_ref (rec);
+    Value res = BOOL_VAL(is_falsey (ref.val));
+    if (ref.type != REF_BOOL) {
+        release (rec, &ref);
+        push_ref (rec, const_ref (res));
+        return;
+    }
+
+    int reg = ref.reg;
+    if (rec->bool_uses[reg] > 1) {
+        release (rec, &ref);
+        reg = alloc_bool (rec);
+        EMIT(0x45, 0x89, 0xc0 | ref.reg << 3 | reg);  /* mov rNd, rMd */
+    }
+    EMIT(0x41, 0x83, 0xf0 | reg, 0x01);     /* xor rNd, 1 */
+    push_ref (rec, (Ref) {REF_BOOL, reg, res});
+}
+
+/* ##################################################################################### */
+
+static void constant (Recorder *rec, int index) {
+    Value val = rec->c->constants.values[index];
+    if (!IS_NUMBER(val)) {
+        rec->failed = true;
+        return;
+    }
+    push_ref (rec, const_ref (val));
+}
+
+/* ##################################################################################### */
+
+/* What variable VAR holds when the trace is entered. */
+static Value entry_value (Recorder *rec, Var *var) {
+    return var->global ? rec->vm->globals[var->index].val
+                       : rec->slots[var->index];
+}
+
+/* The variable for local slot INDEX, or global INDEX, which gets its
+    home register the first time it is seen. */
+static int find_var (Recorder *rec, bool global, int index) {
+    for (int i = 0; i < rec->var_count; i++) {
+        if (rec->vars[i].global == global && rec->vars[i].index == index) {
+            return i;
+        }
+    }
+    if (rec->var_count == MAX_TRACE_VARS) {
+        rec->failed = true;
+        return 0;
+    }
+
+    Var *var = &rec->vars[rec->var_count];
+    var->global = global;
+    var->index = index;
+    var->reg = alloc_xmm (rec);
+    var->guarded = false;
+    var->written = false;
+    var->val = entry_value (rec, var);
+    return rec->var_count++;
+}
+
+static void get_var (Recorder *rec, int v) {
+    Var *var = &rec->vars[v];
+    if (!IS_NUMBER(var->val)) {
+        rec->failed = true;
+        return;
+    }
+    if (!var->written) var->guarded = true;
+    push_ref (rec, (Ref) {REF_VAR, v, var->val});
+}
+
+/* Stores the number on top of the stack into variable V. */
+static void set_var (Recorder *rec, int v) {
+    Buffer *b = &rec->body;
+    Var *var = &rec->vars[v];
+    if (rec->depth == 0 || !is_number (&rec->stack[rec->depth - 1])) {
+        rec->failed = true;
+        return;
+    }
+
+    /* What was read from the variable before keeps the old value. */
+    for (int i = 0; i < rec->depth; i++) {
+        Ref *ref = &rec->stack[i];
+        if (ref->type == REF_VAR && ref->reg == v) {
+            int reg = alloc_xmm (rec);
+            emit_sse (b, 0x66, MOVAPD, reg, var->reg);
+            *ref = (Ref) {REF_NUM, reg, ref->val};
+        }
+    }
+
+    Ref *top = &rec->stack[rec->depth - 1];
+    if (top->type == REF_CONST) {
+        emit_load_number (b, var->reg, top->val);
+    } else {
+        emit_sse (b, 0x66, MOVAPD, var->reg, xmm_of (rec, top, 0));
+    }
+    var->written = true;
+    var->val = top->val;
+}
+
+/* ##################################################################################### */
+
+/* Locals below the base are variables, the others are on the stack. */
+static void get_local (Recorder *rec, int slot) {
+    if (slot < rec->base) {
+        int v = find_var (rec, false, slot);
+        if (!rec->failed) get_var (rec, v);
+    } else if (slot - rec->base < rec->depth) {
+        Ref ref = rec->stack[slot - rec->base];
+        retain (rec, &ref);
+        push_ref (rec, ref);
+    } else {
+        rec->failed = true;
+    }
+}
+
+static void set_local (Recorder *rec, int slot) {
+    if (slot < rec->base) {
+        int v = find_var (rec, false, slot);
+        if (!rec->failed) set_var (rec, v);
+    } else if (slot - rec->base < rec->depth) {
+        Ref top = rec->stack[rec->depth - 1];
+        retain (rec, &top);
+        release (rec, &rec->stack[slot - rec->base]);
+        rec->stack[slot - rec->base] = top;
+    } else {
+        rec->failed = true;
+    }
+}
+
+static void get_global (Recorder *rec, int slot) {
+    int v = find_var (rec, true, slot);
+    if (!rec->failed) get_var (rec, v);
+}
+
+/* An undefined global would be a runtime error, and globals never
+    become undefined again, so the check is only needed now. */
+static void set_global (Recorder *rec, int slot) {
+    if (IS_UNDEFINED(rec->vm->globals[slot].val)) {
+        rec->failed = true;
+        return;
+    }
+    int v = find_var (rec, true, slot);
+    if (!rec->failed) set_var (rec, v);
+}
+
+/* ##################################################################################### */
+
+/* Notes a backward jump at OFFSET that does not close the trace, such
+    as the one to the condition of a for loop. The same one twice is an
+    inner loop, which is not traced into. */
+static bool pass_loop (Recorder *rec, int offset) {
+    for (int i = 0; i < rec->loop_count; i++) {
+        if (rec->loops[i] == offset) return false;
+    }
+    if (rec->loop_count == MAX_TRACE_LOOPS) return false;
+    rec->loops[rec->loop_count++] = offset;
+    return true;
+}
+
+/* ##################################################################################### */
+
+#define SHORT(ip) (((ip)[0] << 8) | (ip)[1])
+
+/* Records one iteration of the loop starting at its header. Returns
+    the offset of the OP_LOOP that goes back to the header, or -1 if the
+    loop cannot be traced. */
+static int record (Recorder *rec) {
+    Chunk *c = rec->c;
+    int offset = rec->header;
+    for (int count = 0; count < MAX_TRACE_OPS && !rec->failed; count++) {
+        uint8_t op = c->code[offset];
+        uint8_t *ip = &c->code[offset + 1];
+        int next = offset + instruction_len (op);
+
+        switch (op) {
+            case OP_CONSTANT:      constant (rec, ip[0]); break;
+            case OP_CONSTANT_LONG:
+                constant (rec, (ip[0] << 16) | (ip[1] << 8) | ip[2]);
+                break;
+            case OP_NIL:   push_ref (rec, const_ref (NIL_VAL)); break;
+            case OP_TRUE:  push_ref (rec, const_ref (TRUE_VAL)); break;
+            case OP_FALSE: push_ref (rec, const_ref (FALSE_VAL)); break;
+            case OP_POP: {
+                Ref ref = pop_ref (rec);
+                release (rec, &ref);
+                break;
+            }
+            case OP_GET_LOCAL:  get_local (rec, ip[0]); break;
+            case OP_SET_LOCAL:  set_local (rec, ip[0]); break;
+            case OP_GET_GLOBAL: get_global (rec, SHORT(ip)); break;
+            case OP_SET_GLOBAL: set_global (rec, SHORT(ip)); break;
+
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:
+            case OP_EQUAL_ANY:
+                push_cond (rec, compare (rec, OP_EQUAL));
+                break;
+            case OP_NOT_EQUAL:
+            case OP_NOT_EQUAL_NUM:
+            case OP_NOT_EQUAL_ANY:
+                push_cond (rec, compare (rec, OP_NOT_EQUAL));
+                break;
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+                push_cond (rec, compare (rec, op));
+                break;
+
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_ANY:   arithmetic (rec, ADDSD); break;
+            case OP_SUBTRACT:  arithmetic (rec, SUBSD); break;
+            case OP_MULTIPLY:  arithmetic (rec, MULSD); break;
+            case OP_DIVIDE:    arithmetic (rec, DIVSD); break;
+            case OP_NEGATE:    negate (rec); break;
+            case OP_NOT:       record_not (rec); break;
+            case OP_GET_LOCAL_ADD_CONST:
+            case OP_GET_LOCAL_SUB_CONST:
+                get_local (rec, ip[0]);
+                constant (rec, ip[1]);
+                arithmetic (rec, op == OP_GET_LOCAL_ADD_CONST ? ADDSD : SUBSD);
+                break;
+
+            case OP_JMP:
+                next += SHORT(ip);
+                break;
+            case OP_JMP_IF_FALSE:
+                if (rec->depth == 0) return -1;
+                next = branch (rec, truth (rec, &rec->stack[rec->depth - 1]),
+                               next, next + SHORT(ip));
+                break;
+            case OP_EQUAL_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_EQUAL), next, next + SHORT(ip));
+                break;
+            case OP_NOT_EQUAL_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_NOT_EQUAL), next,
+                               next + SHORT(ip));
+                break;
+            case OP_GREATER_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_GREATER), next,
+                               next + SHORT(ip));
+                break;
+            case OP_GREATER_EQUAL_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_GREATER_EQUAL), next,
+                               next + SHORT(ip));
+                break;
+            case OP_LESS_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_LESS), next, next + SHORT(ip));
+                break;
+            case OP_LESS_EQUAL_JMP_IF_FALSE:
+                next = branch (rec, compare (rec, OP_LESS_EQUAL), next,
+                               next + SHORT(ip));
+                break;
+
+            case OP_LOOP:
+                next -= SHORT(ip);
+                if (next == rec->header) {
+                    return rec->depth == 0 && !rec->failed ? offset : -1;
+                }
+                if (!pass_loop (rec, offset)) return -1;
+                break;
+
+            default:
+                return -1;
+        }
+        offset = next;
+    }
+    return -1;
+}
+
+#undef SHORT
+
+/* Goes back to the loop header for another recording, keeping only the
+    variables found and their home registers. */
+static void restart (Recorder *rec) {
+    rec->depth = 0;
+    memset (rec->xmm_uses, 0, sizeof (rec->xmm_uses));
+    memset (rec->bool_uses, 0, sizeof (rec->bool_uses));
+    for (int i = 0; i < rec->var_count; i++) {
+        Var *var = &rec->vars[i];
+        rec->xmm_uses[var->reg] = 1;
+        var->guarded = false;
+        var->written = false;
+        var->val = entry_value (rec, var);
+    }
+    rec->exit_count = 0;
+    rec->jump_count = 0;
+    rec->loop_count = 0;
+    rec->body.count = 0;
+    rec->failed = false;
+}
+
+/* ##################################################################################### */
+
+/* Boxes REF into slot INDEX of the stack at rdx. */
+static void emit_box (Buffer *b, Recorder *rec, Ref *ref, int index) {
+    int32_t disp = (int32_t) (index * sizeof (Value));
+    switch (ref->type) {
+        case REF_VAR:
+            emit_store (b, rec->vars[ref->reg].reg, RDX, disp);
+            return;
+        case REF_NUM:
+            emit_store (b, ref->reg, RDX, disp);
+            return;
+        case REF_BOOL:
+            EMIT(0x48, 0xb8);               /* mov rax, FALSE_VAL */
+            emit64 (b, FALSE_VAL);
+            EMIT(0x4c, 0x01, 0xc0 | ref->reg << 3);     /* add rax, rN */
+            break;
+        case REF_CONST:
+            EMIT(0x48, 0xb8);               /* mov rax, imm64 */
+            emit64 (b, ref->val);
+            break;
+    }
+    EMIT(0x48, 0x89, 0x82);                 /* mov [rdx + disp32], rax */
+    emit32 (b, (uint32_t) disp);
+}
+
+/* Puts the trace together: the code returning TRACE_MISS, the entry
+    loading and checking the variables, the loop body, a stub for each
+    side exit and the write-back of the variables the stubs end in. */
+static Trace *assemble (Recorder *rec) {
+    Buffer buffer = {NULL, 0, 0};
+    Buffer *b = &buffer;
+
+    EMIT(0xb8);                             /* mov eax, TRACE_MISS */
+    emit32 (b, (uint32_t) TRACE_MISS);
+    EMIT(0xc3);                             /* ret */
+
+    for (int i = 0; i < rec->var_count; i++) {
+        Var *var = &rec->vars[i];
+        EMIT(0x48, 0x8b, 0x80 | var_base (var));    /* mov rax, [base + disp32] */
+        emit32 (b, (uint32_t) var_disp (var));
+        if (var->guarded) emit_number_guard (b, 0);
+        emit_movq_rax (b, var->reg);
+    }
+
+    int body = b->count;
+    emit_bytes (b, rec->body.code, rec->body.count);
+
+    int *stubs = ALLOCATE(int, rec->exit_count);
+    int *stub_jumps = ALLOCATE(int, rec->exit_count);
+    for (int i = 0; i < rec->exit_count; i++) {
+        Snapshot *exit = &rec->exits[i];
+        stubs[i] = b->count;
+        for (int j = 0; j < exit->depth; j++) {
+            emit_box (b, rec, &exit->stack[j], j);
+        }
+        EMIT(0xb8);                         /* mov eax, i */
+        emit32 (b, (uint32_t) i);
+        EMIT(0xe9);                         /* jmp write-back */
+        stub_jumps[i] = b->count;
+        emit32 (b, 0);
+    }
+
+    int write_back = b->count;
+    for (int i = 0; i < rec->var_count; i++) {
+        Var *var = &rec->vars[i];
+        if (var->written) emit_store (b, var->reg, var_base (var), var_disp (var));
+    }
+    EMIT(0xc3);                             /* ret */
+
+    for (int i = 0; i < rec->jump_count; i++) {
+        patch_rel32 (b, body + rec->jumps[i].at, stubs[rec->jumps[i].exit]);
+    }
+    for (int i = 0; i < rec->exit_count; i++) {
+        patch_rel32 (b, stub_jumps[i], write_back);
+    }
+    FREE_ARRAY(int, stubs, rec->exit_count);
+    FREE_ARRAY(int, stub_jumps, rec->exit_count);
+
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    size_t size = ((size_t) b->count + page - 1) / page * page;
+    uint8_t *code = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy (code, b->code, b->count);
+        if (mprotect (code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap (code, size);
+            code = MAP_FAILED;
+        }
+    }
+    FREE_ARRAY(uint8_t, b->code, b->capacity);
+    if (code == MAP_FAILED) return NULL;
+
+    Trace *trace = ALLOCATE(Trace, 1);
+    trace->code = code;
+    trace->size = size;
+    trace->exit_count = rec->exit_count;
+    trace->exits = ALLOCATE(TraceExit, rec->exit_count);
+    for (int i = 0; i < rec->exit_count; i++) {
+        trace->exits[i].offset = rec->exits[i].offset;
+        trace->exits[i].stack_count = rec->exits[i].depth;
+    }
+    return trace;
+}
+
+#undef EMIT
+
+/* ##################################################################################### */
+
+static Trace *find_trace (ObjFunction *function, int header) {
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header) return trace;
+    }
+    return NULL;
+}
+
+/* ##################################################################################### */
+
+/* Records and compiles a trace of the hot loop whose header the ip of
+    FRAME is at, unless it has one. Returns whether it has one now. The
+    OP_LOOP that closes the loop becomes OP_LOOP_TRACE, which enters the
+    trace from then on. */
+bool trace_record (VM *vm, CallFrame *frame) {
+    ObjFunction *function = frame->function;
+    int header = (int) (frame->ip - function->c.code);
+    if (find_trace (function, header) != NULL) return true;
+    if (function->trace_failures >= TRACE_MAX_FAILURES) return false;
+
+    Recorder *rec = ALLOCATE(Recorder, 1);
+    rec->vm = vm;
+    rec->c = &function->c;
+    rec->slots = frame->slots;
+    rec->header = header;
+    rec->base = (int) (vm->sp - frame->slots);
+    rec->depth = 0;
+    rec->var_count = 0;
+    memset (rec->xmm_uses, 0, sizeof (rec->xmm_uses));
+    memset (rec->bool_uses, 0, sizeof (rec->bool_uses));
+    rec->exit_count = 0;
+    rec->jump_count = 0;
+    rec->loop_count = 0;
+    rec->body = (Buffer) {NULL, 0, 0};
+    rec->failed = false;
+
+    /* Home registers hold their variables from the entry on, but the
+        first recording may hand one out as a temporary before it gets
+        to the variable. So that one only finds the variables, and the
+        trace comes from the second. */
+    int loop = record (rec);
+    if (loop != -1) {
+        restart (rec);
+        loop = record (rec);
+    }
+    if (loop != -1) {
+        const uint8_t jmp = 0xe9;           /* jmp body */
+        emit_bytes (&rec->body, &jmp, 1);
+        emit_rel32 (&rec->body, 0);
+    }
+    Trace *trace = loop != -1 ? assemble (rec) : NULL;
+    int base = rec->base;
+    FREE_ARRAY(uint8_t, rec->body.code, rec->body.capacity);
+    FREE(Recorder, rec);
+    if (trace == NULL) {
+        function->trace_failures++;
+        return false;
+    }
+
+    trace->header = header;
+    trace->loop = loop;
+    trace->base = base;
+    trace->misses = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+    function->c.code[loop] = OP_LOOP_TRACE;
+    return true;
+}
+
+/* ##################################################################################### */
+
+static void free_trace (Trace *trace) {
+    munmap (trace->code, trace->size);
+    FREE_ARRAY(TraceExit, trace->exits, trace->exit_count);
+    FREE(Trace, trace);
+}
+
+/* Throws away TRACE of FUNCTION, whose loop keeps running into types
+    it was not recorded for, and puts its OP_LOOP back. */
+static void drop_trace (ObjFunction *function, Trace *trace) {
+    Trace **link = &function->traces;
+    while (*link != trace) link = &(*link)->next;
+    *link = trace->next;
+    function->c.code[trace->loop] = OP_LOOP;
+    function->trace_failures++;
+    free_trace (trace);
+}
+
+/* ##################################################################################### */
+
+/* Runs the trace of the loop whose header the ip of FRAME is at, and
+    leaves FRAME and the stack the way run () carries on after it. */
+void trace_run (VM *vm, CallFrame *frame) {
+    ObjFunction *function = frame->function;
+    Trace *trace = find_trace (function, (int) (frame->ip - function->c.code));
+    if (trace == NULL || vm->sp - frame->slots != trace->base) return;
+
+    TraceEntry entry = (TraceEntry) (void *) (trace->code + TRACE_ENTRY);
+    int exit = entry (frame->slots, vm->globals, vm->sp);
+    if (exit == TRACE_MISS) {
+        if (++trace->misses == TRACE_MAX_MISSES) drop_trace (function, trace);
+        return;
+    }
+    trace->misses = 0;
+    frame->ip = function->c.code + trace->exits[exit].offset;
+    vm->sp += trace->exits[exit].stack_count;
+}
+
+/* ##################################################################################### */
+
+/* Frees TRACE and the ones after it, the traces of a function. */
+void trace_free (Trace *trace) {
+    while (trace != NULL) {
+        Trace *next = trace->next;
+        free_trace (trace);
+        trace = next;
+    }
+}
+
+#endif
\ No newline at end of file
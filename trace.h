@@ -0,0 +1,38 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef TRACING_JIT
+
+/* ##################################################################################### */
+
+/* Backward jumps to a loop header after which a trace of the loop is
+    recorded. Loops count down in vm->hot_loops, where loops whose
+    headers hash alike share a counter. */
+#define TRACE_HOT_LOOP 56
+#define HOT_LOOP(vm, ip) ((vm)->hot_loops[(uintptr_t) (ip) % HOT_LOOP_SLOTS])
+
+/* Recordings of a function that may fail before it is left to the
+    interpreter and the baseline JIT for good. */
+#define TRACE_MAX_FAILURES 4
+
+/* Entries in a row whose types a trace may turn down before it is
+    thrown away, so the loop can be recorded again. */
+#define TRACE_MAX_MISSES 8
+
+/* ##################################################################################### */
+
+typedef struct Trace Trace;
+
+/* ##################################################################################### */
+
+bool trace_record (VM *vm, CallFrame *frame);
+void trace_run (VM *vm, CallFrame *frame);
+void trace_free (Trace *trace);
+
+#endif
+
+#endif
\ No newline at end of file
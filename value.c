@@ -37,6 +37,17 @@ void free_value_array (ValueArray *arr) {
 /* ##################################################################################### */
 
 void print_value (Value val) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(val)) {
+        printf (AS_BOOL(val) ? "true" : "false");
+    } else if (IS_NIL(val)) {
+        printf ("nil");
+    } else if (IS_NUMBER(val)) {
+        printf ("%g", AS_NUMBER(val));
+    } else if (IS_OBJ(val)) {
+        print_object (val);
+    }
+#else
     switch (val.type) {
         case VAL_BOOL:
             printf (AS_BOOL(val) ? "true" : "false");
@@ -44,12 +55,21 @@ void print_value (Value val) {
         case VAL_NIL:    printf ("nil"); break;
         case VAL_NUMBER: printf ("%g", AS_NUMBER(val)); break;
         case VAL_OBJ:    print_object (val); break;
+        case VAL_UNDEFINED: break;  /* Unreachable. */
     }
+#endif
 }
 
 /* ##################################################################################### */
 
 bool values_equal (Value a, Value b) {
+#ifdef NAN_BOXING
+    /* Numbers must compare as doubles so that NaN != NaN. */
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
@@ -58,4 +78,5 @@ bool values_equal (Value a, Value b) {
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
         default:            return false;  /* Unreachable. */
     }
+#endif
 }
\ No newline at end of file
@@ -10,11 +10,72 @@ typedef struct ObjString ObjString;
 
 /* ##################################################################################### */
 
+#ifdef NAN_BOXING
+
+/* A double is a number unless all of its exponent bits, the quiet bit
+    and the Intel "QNaN Floating-Point Indefinite" bit are set. Inside 
+    that space the low bits hold a tag for nil/false/true, and with the
+    sign bit set the low 48 bits hold an Obj pointer. */
+#define SIGN_BIT    ((uint64_t) 0x8000000000000000)
+#define QNAN        ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL       1
+#define TAG_FALSE     2
+#define TAG_TRUE      3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  value_to_num (value)
+#define AS_OBJ(value)     ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   num_to_value (num)
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+/* ##################################################################################### */
+
+/* Type punning through a union is the portable way to reinterpret
+    the bits; compilers turn it into a plain register move. */
+static inline double value_to_num (Value value) {
+    union {
+        uint64_t bits;
+        double num;
+    }   data;
+    data.bits = value;
+    return data.num;
+}
+
+static inline Value num_to_value (double num) {
+    union {
+        uint64_t bits;
+        double num;
+    }   data;
+    data.num = num;
+    return data.bits;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED,      /* Marks a global slot that is not defined yet. 
+                            Never visible to Lox code. */
 }   Value_t;
 
 /* ##################################################################################### */
@@ -32,6 +93,7 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
@@ -41,9 +103,12 @@ typedef struct {
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
 /* ##################################################################################### */
 
 typedef struct {
@@ -6,43 +6,41 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
 /* ##################################################################################### */
 
-VM vm; 
-
-/* ##################################################################################### */
-
-static Value clock_native (int arg_count, Value *args) {
+static Value clock_native (VM *vm, int arg_count, Value *args) {
     return NUMBER_VAL((double) clock () / CLOCKS_PER_SEC);
 }
 
 /* ##################################################################################### */
 
-static void reset_stack () {
-    vm.sp = vm.stack;
-    vm.frame_count = 0;
+static void reset_stack (VM *vm) {
+    vm->sp = vm->stack;
+    vm->frame_count = 0;
 }
 
 /* ##################################################################################### */
 
-static void runtime_error (const char *format, ...) {
+void runtime_error (VM *vm, const char *format, ...) {
     va_list args;
     va_start (args, format);
     vfprintf (stderr, format, args);
     va_end (args);
     fputs ("\n", stderr);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+    for (int i = vm->frame_count - 1; i >= 0; i--) {
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->function;
         size_t instruction = frame->ip - function->c.code - 1;
         fprintf(stderr, "[line %d] in ", 
-            function->c.lines[instruction]);
+            get_line (&function->c, (int) instruction));
         if (function->name == NULL) {
             fprintf (stderr, "script\n");
         } 
@@ -50,311 +48,1166 @@ static void runtime_error (const char *format, ...) {
             fprintf (stderr, "%s()\n", function->name->chars);
         }
     }
-    reset_stack();
+    reset_stack(vm);
 }
 
 /* ##################################################################################### */
 
 /* Takes a pointer to a C function and the name it will be given in clox. */
-static void define_native (const char *name, NativeFn function) {
-    push (OBJ_VAL(copy_string (name, (int) strlen (name))));
-    push (OBJ_VAL(new_native (function)));
-    table_set (&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop (); 
-    pop ();
+void define_native (VM *vm, const char *name, NativeFn function) {
+    push (vm, OBJ_VAL(copy_string (vm, name, (int) strlen (name))));
+    push (vm, OBJ_VAL(new_native (vm, function)));
+    int slot = global_slot (vm, AS_STRING(vm->stack[0]));
+    if (slot != -1) {
+        vm->globals[slot].val = vm->stack[1];
+        GC_SHADE(vm, vm->stack[1]);
+    }
+    pop (vm); 
+    pop (vm);
+}
+
+/* ##################################################################################### */
+
+/* Keeps VAL alive until remove_root (), e.g. a compiled script that
+    has yet to run. */
+void add_root (VM *vm, Value val) {
+    write_value_array (&vm->roots, val);
+}
+
+/* ##################################################################################### */
+
+void remove_root (VM *vm, Value val) {
+    for (int i = vm->roots.count - 1; i >= 0; i--) {
+        if (values_equal (vm->roots.values[i], val)) {
+            vm->roots.values[i] = vm->roots.values[--vm->roots.count];
+            return;
+        }
+    }
+}
+
+/* ##################################################################################### */
+
+/* Returns the slot of the global variable NAME, adding an undefined
+    global for it the first time the name is seen, or -1 if there is no
+    slot left for it. */
+int global_slot (VM *vm, ObjString *name) {
+    Value slot;
+    VM_LOCK(vm, globals_lock);
+    if (table_get (&vm->global_slots, name, &slot)) {
+        VM_UNLOCK(vm, globals_lock);
+        return (int) AS_NUMBER(slot);
+    }
+    if (vm->global_count == GLOBALS_MAX) {
+        VM_UNLOCK(vm, globals_lock);
+        return -1;
+    }
+
+    if (vm->global_count == vm->global_capacity) {
+        int old_capacity = vm->global_capacity;
+        vm->global_capacity = GROW_CAPACITY(old_capacity);
+        vm->globals = GROW_ARRAY(Global, vm->globals, 
+            old_capacity, vm->global_capacity);
+    }
+    vm->globals[vm->global_count].name = name;
+    vm->globals[vm->global_count].val = UNDEFINED_VAL;
+    GC_SHADE(vm, OBJ_VAL(name));
+    table_set (&vm->global_slots, name, NUMBER_VAL(vm->global_count));
+    int new_slot = vm->global_count++;
+    VM_UNLOCK(vm, globals_lock);
+    return new_slot;
 }
 
 /* ##################################################################################### */
 
 /* Initiates the virtual machine. */
-void init_VM() {
-    reset_stack ();
-    vm.objects = NULL;
-    init_table (&vm.globals);
-    init_table (&vm.strings);
+void init_VM (VM *vm) {
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+    vm->max_frames = FRAMES_MAX;
+    vm->stack = NULL;
+    vm->stack_capacity = 0;
+    vm->frames = GROW_ARRAY(CallFrame, vm->frames, 0, FRAMES_INITIAL);
+    vm->frame_capacity = FRAMES_INITIAL;
+    vm->stack = GROW_ARRAY(Value, vm->stack, 0, STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
+    reset_stack (vm);
+    vm->objects = NULL;
+    init_slabs (&vm->slabs);
+    init_slabs (&vm->swept);
+    vm->bytes_allocated = 0;
+    vm->next_gc = GC_FIRST_COLLECTION;
+    vm->nursery = ALLOCATE(uint8_t, NURSERY_SIZE);
+    vm->nursery_top = vm->nursery;
+    vm->nursery_full = false;
+    vm->remembered = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->gc_phase = GC_IDLE;
+    vm->mark_sense = false;
+    vm->sweep_link = NULL;
+    vm->sweep_list = NULL;
+    vm->dead_strings = NULL;
+    vm->sweep_freed = 0;
+    vm->sweeping = false;
+    atomic_init (&vm->sweep_done, false);
+    vm->next_slice = 0;
+    vm->gc_budget = GC_SLICE_BUDGET;
+    memset (vm->major_pauses, 0, sizeof (vm->major_pauses));
+    memset (vm->minor_pauses, 0, sizeof (vm->minor_pauses));
+    vm->gc_threads = 1;
+    vm->markers = NULL;
+    vm->gray.objects = NULL;
+    vm->gray.count = 0;
+    vm->gray.capacity = 0;
+    init_value_array (&vm->roots);
+    vm->compiling = NULL;
+    vm->jit_enabled = true;
+    vm->trace_enabled = true;
+#ifdef TRACING_JIT
+    memset (vm->hot_loops, TRACE_HOT_LOOP, sizeof (vm->hot_loops));
+#endif
+    vm->register_mode = false;
+    vm->lazy_compile = false;
+    vm->parallel = false;
+    vm->jit_frame = NULL;
+    vm->jit_nesting = 0;
+    pthread_mutex_init (&vm->objects_lock, NULL);
+    pthread_mutex_init (&vm->strings_lock, NULL);
+    pthread_mutex_init (&vm->globals_lock, NULL);
+    vm->globals = NULL;
+    vm->global_count = 0;
+    vm->global_capacity = 0;
+    init_table (&vm->global_slots);
+    init_table (&vm->strings);
 
-    define_native ("clock", clock_native);
+    define_native (vm, "clock", clock_native);
 }
 
 /* ##################################################################################### */
 
-void free_VM() {
-    free_table (&vm.globals);
-    free_table (&vm.strings);
-    free_objects ();
+void free_VM (VM *vm) {
+    FREE_ARRAY(CallFrame, vm->frames, vm->frame_capacity);
+    FREE_ARRAY(Value, vm->stack, vm->stack_capacity);
+    FREE_ARRAY(Global, vm->globals, vm->global_capacity);
+    free_table (&vm->global_slots);
+    free_table (&vm->strings);
+    free_value_array (&vm->roots);
+    free_objects (vm);
+    pthread_mutex_destroy (&vm->objects_lock);
+    pthread_mutex_destroy (&vm->strings_lock);
+    pthread_mutex_destroy (&vm->globals_lock);
 }
 
 /* ##################################################################################### */
 
-void push (Value val) {
-    *vm.sp = val;
-    vm.sp++;
+void push (VM *vm, Value val) {
+    *vm->sp = val;
+    vm->sp++;
 }
 
 /* ##################################################################################### */
 
-Value pop () {
-    vm.sp--;
-    return *vm.sp;
+Value pop (VM *vm) {
+    vm->sp--;
+    return *vm->sp;
 }
 
 /* ##################################################################################### */
 
-static Value peek (int distance) {
-    return vm.sp[-1 - distance];
+static Value peek (VM *vm, int distance) {
+    return vm->sp[-1 - distance];
 }
 
 /* ##################################################################################### */
 
-/* Puts the called function into a new frame. */
-static bool call (ObjFunction *function, int arg_count) {
+/* Checks the argument count and counts the call, compiling the
+    function to native code once it got hot. A function skimmed by the
+    compiler gets its bytecode first. */
+static bool enter_function (VM *vm, ObjFunction *function, int arg_count) {
+    if (function->source != NULL && !compile_lazy (vm, function)) {
+        runtime_error (vm, "Could not compile function %s.", 
+                       function->name->chars);
+        return false;
+    }
     if (arg_count != function->arity) {
-        runtime_error ("Expected %d arguments but got %d.", 
+        runtime_error (vm, "Expected %d arguments but got %d.", 
                        function->arity, arg_count);
         return false;
     }
+
+#ifdef BASELINE_JIT
+    if (++function->call_count == JIT_CALL_THRESHOLD && 
+        function->jit == NULL && vm->jit_enabled) {
+        jit_compile (function);
+    }
+#endif
+    return true;
+}
+
+/* ##################################################################################### */
+
+/* Moves the value stack into a bigger block with room for at least
+    NEEDED values, and points the frames and sp into it. */
+static void grow_stack (VM *vm, int needed) {
+    int old_capacity = vm->stack_capacity;
+    int sp = (int) (vm->sp - vm->stack);
+    int *slots = ALLOCATE(int, vm->frame_count);
+    for (int i = 0; i < vm->frame_count; i++) {
+        slots[i] = (int) (vm->frames[i].slots - vm->stack);
+    }
+
+    while (vm->stack_capacity < needed) {
+        vm->stack_capacity = GROW_CAPACITY(vm->stack_capacity);
+    }
+    vm->stack = GROW_ARRAY(Value, vm->stack, old_capacity, vm->stack_capacity);
+
+    vm->sp = vm->stack + sp;
+    for (int i = 0; i < vm->frame_count; i++) {
+        vm->frames[i].slots = vm->stack + slots[i];
+    }
+    FREE_ARRAY(int, slots, vm->frame_count);
+}
+
+/* ##################################################################################### */
+
+/* Puts the called function into a new frame. */
+static bool call (VM *vm, ObjFunction *function, int arg_count) {
+    if (!enter_function (vm, function, arg_count)) return false;
     /* Probably a bug in some runaway recursive code. */
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error ("Stack overflow.");
+    if (vm->frame_count == vm->max_frames) {
+        runtime_error (vm, "Stack overflow.");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frame_count++];
+    if (vm->frame_count == vm->frame_capacity) {
+        int old_capacity = vm->frame_capacity;
+        vm->frame_capacity = GROW_CAPACITY(old_capacity);
+        vm->frames = GROW_ARRAY(CallFrame, vm->frames,
+            old_capacity, vm->frame_capacity);
+    }
+    /* Budget UINT8_COUNT slots per frame, like the fixed stack did. */
+    int needed = (int) (vm->sp - vm->stack) - arg_count - 1 + UINT8_COUNT;
+    if (needed > vm->stack_capacity) grow_stack (vm, needed);
+
+    CallFrame *frame = &vm->frames[vm->frame_count++];
     frame->function = function;
     frame->ip = function->c.code;
-    frame->slots = vm.sp - arg_count - 1;
+    frame->slots = vm->sp - arg_count - 1;
     return true;
 }
 
 /* ##################################################################################### */
 
-static bool call_value (Value callee, int arg_count) {
+bool call_value (VM *vm, Value callee, int arg_count) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_FUNCTION:
-                return call (AS_FUNCTION(callee), arg_count);
+                return call (vm, AS_FUNCTION(callee), arg_count);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native (arg_count, vm.sp - arg_count);
-                vm.sp -= arg_count + 1;
-                push (result);
+                Value result = native (vm, arg_count, vm->sp - arg_count);
+                vm->sp -= arg_count + 1;
+                push (vm, result);
                 return true;
             }
             default:
                 break;  /* Non-callable object type. */
         }
     }
-    runtime_error ("Can only call functions and classes.");
+    runtime_error (vm, "Can only call functions and classes.");
     return false;
 }
 
 /* ##################################################################################### */
 
-static bool is_falsey (Value val) {
-    return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
-}
-
-/* ##################################################################################### */
+/* Like call_value (), but a called clox function takes over the frame
+    of the caller, which is about to return anyway: the callee and its
+    arguments slide down to where the caller's window starts. Anything
+    else is called normally, leaving the result for the OP_RETURN that
+    follows. */
+bool tail_call_value (VM *vm, Value callee, int arg_count) {
+    if (!IS_FUNCTION(callee)) return call_value (vm, callee, arg_count);
 
-static void concatenate () {
-    ObjString *b = AS_STRING(pop ());
-    ObjString *a = AS_STRING(pop ());
+    ObjFunction *function = AS_FUNCTION(callee);
+    if (!enter_function (vm, function, arg_count)) return false;
 
-    int len = a->len + b->len;
-    char *chars = ALLOCATE(char, len + 1);
-    memcpy (chars, a->chars, a->len);
-    memcpy (chars + a->len, b->chars, b->len);
-    chars[len] = '\0';
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    memmove (frame->slots, vm->sp - arg_count - 1,
+             (arg_count + 1) * sizeof (Value));
+    vm->sp = frame->slots + arg_count + 1;
+    frame->function = function;
+    frame->ip = function->c.code;
+    return true;
+}
 
-    ObjString *res = take_string (chars, len);
-    push (OBJ_VAL(res));
+/* ##################################################################################### */
 
+/* The operands stay on the stack until the result exists, which keeps
+    them alive if allocating it collects garbage. */
+void concatenate (VM *vm) {
+    ObjString *b = AS_STRING(peek (vm, 0));
+    ObjString *a = AS_STRING(peek (vm, 1));
+    ObjString *result = concat_strings (vm, a, b);
+    pop (vm);
+    pop (vm);
+    push (vm, OBJ_VAL(result));
+    GC_SAFEPOINT(vm);
 }
 
 /* ##################################################################################### */
 
-static InterpretRes run () {
-    /* Current topmost CallFrame. */
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+static InterpretRes run (VM *vm) {
+    /* Current topmost CallFrame. Its ip is cached in a local so the
+        compiler can keep it in a register; it is written back to the 
+        frame whenever something else might look at it. */
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    register uint8_t *ip = frame->ip;
 
-#define READ_BYTE()     (*frame->ip++)
+#define READ_BYTE()     (*ip++)
 #define READ_CONSTANT() (frame->function->c.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, frame->function->c.constants.values[(ip[-3] << 16) | \
+                                                  (ip[-2] << 8) | ip[-1]])
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING()   AS_STRING(READ_CONSTANT())
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_GLOBAL()   (&vm->globals[READ_SHORT()])
+/* Quickening rewrites the opcode of the instruction being executed.
+    None of the quickened instructions have operands, so it is always 
+    the byte right before ip. Deoptimizing puts a generic opcode that
+    does not quicken back and executes the instruction again. */
+#define QUICKEN(op)     (ip[-1] = (op))
+#define DEOPTIMIZE(op)  do { ip[-1] = (op); ip--; } while (false)
+/* Hands the topmost frame over to its native code, if it has any,
+    and picks up again with whatever frame is on top when the native 
+    code returns. */
+#ifdef BASELINE_JIT
+#define ENTER_JIT()                                       \
+    do {                                                  \
+        if (frame->function->jit != NULL) {               \
+            InterpretRes res;                             \
+            frame->ip = ip;                               \
+            if (jit_run (vm, &res)) return res;           \
+            frame = &vm->frames[vm->frame_count - 1];     \
+            ip = frame->ip;                               \
+        }                                                 \
+    } while (false)
+#else
+#define ENTER_JIT() do {} while (false)
+#endif
+#define RUNTIME_ERROR(...)                                \
+    do {                                                  \
+        frame->ip = ip;                                   \
+        runtime_error (vm, __VA_ARGS__);                  \
+        return INTERPRET_RUNTIME_ERROR;                   \
+    } while (false)
 #define BINARY_OP(value_type, op)                         \
     do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error ("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;               \
+        if (!IS_NUMBER(peek(vm, 0)) ||                    \
+            !IS_NUMBER(peek(vm, 1))) {                    \
+            RUNTIME_ERROR("Operands must be numbers.");   \
         }                                                 \
-      double b = AS_NUMBER(pop());                        \
-      double a = AS_NUMBER(pop());                        \
-      push(value_type(a op b));                           \
+      double b = AS_NUMBER(pop(vm));                      \
+      double a = AS_NUMBER(pop(vm));                      \
+      push(vm, value_type(a op b));                       \
+    } while (false)
+/* Pops both operands and jumps if the comparison is false. The offset
+    is read after the type check so that errors are reported on the 
+    line of the comparison itself. */
+#define COMPARE_JMP_IF_FALSE(op)                          \
+    do {                                                  \
+        if (!IS_NUMBER(peek(vm, 0)) ||                    \
+            !IS_NUMBER(peek(vm, 1))) {                    \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        double b = AS_NUMBER(pop(vm));                    \
+        double a = AS_NUMBER(pop(vm));                    \
+        uint16_t offset = READ_SHORT();                   \
+        if (!(a op b)) ip += offset;                      \
     } while (false)
-
-    for (;;) {
 
 #ifdef DEBUG_TRACE_EXEC
-        printf ("       ");
-        for (Value *slot = vm.stack; slot < vm.sp; slot++) {
-            printf ("[ ");
-            print_value (*slot);
-            printf (" ]");
-        }
-        printf ("\n");
-        disassemble_instruction (&frame->function->c, 
-                                (int) (frame->ip - frame->function->c.code));
+#define TRACE_EXEC()                                                    \
+    do {                                                                \
+        printf ("       ");                                             \
+        for (Value *slot = vm->stack; slot < vm->sp; slot++) {          \
+            printf ("[ ");                                              \
+            print_value (*slot);                                        \
+            printf (" ]");                                              \
+        }                                                               \
+        printf ("\n");                                                  \
+        disassemble_instruction (vm, &frame->function->c,               \
+                        (int) (ip - frame->function->c.code));          \
+    } while (false)
+#else
+#define TRACE_EXEC() do {} while (false)
+#endif
+
+/* With threaded dispatch every handler ends in its own indirect jump,
+    which gives the branch predictor one history per opcode instead of
+    a single shared one at the top of the switch. */
+#ifdef THREADED_DISPATCH
+    static void *dispatch_table[] = {
+        [OP_CONSTANT]      = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_NIL]           = &&L_OP_NIL,
+        [OP_TRUE]          = &&L_OP_TRUE,
+        [OP_FALSE]         = &&L_OP_FALSE,
+        [OP_POP]           = &&L_OP_POP,
+        [OP_NEGATE]        = &&L_OP_NEGATE,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]    = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]    = &&L_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]     = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL]     = &&L_OP_SET_LOCAL,
+        [OP_EQUAL]         = &&L_OP_EQUAL,
+        [OP_NOT_EQUAL]     = &&L_OP_NOT_EQUAL,
+        [OP_GREATER]       = &&L_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS]          = &&L_OP_LESS,
+        [OP_LESS_EQUAL]    = &&L_OP_LESS_EQUAL,
+        [OP_ADD]           = &&L_OP_ADD,
+        [OP_SUBTRACT]      = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY]      = &&L_OP_MULTIPLY,
+        [OP_DIVIDE]        = &&L_OP_DIVIDE,
+        [OP_NOT]           = &&L_OP_NOT,
+        [OP_PRINT]         = &&L_OP_PRINT,
+        [OP_JMP]           = &&L_OP_JMP,
+        [OP_JMP_IF_FALSE]  = &&L_OP_JMP_IF_FALSE,
+        [OP_LOOP]          = &&L_OP_LOOP,
+        [OP_LOOP_TRACE]    = &&L_OP_LOOP_TRACE,
+        [OP_CALL]          = &&L_OP_CALL,
+        [OP_TAIL_CALL]     = &&L_OP_TAIL_CALL,
+        [OP_RETURN]        = &&L_OP_RETURN,
+        [OP_EQUAL_JMP_IF_FALSE]         = &&L_OP_EQUAL_JMP_IF_FALSE,
+        [OP_NOT_EQUAL_JMP_IF_FALSE]     = &&L_OP_NOT_EQUAL_JMP_IF_FALSE,
+        [OP_GREATER_JMP_IF_FALSE]       = &&L_OP_GREATER_JMP_IF_FALSE,
+        [OP_GREATER_EQUAL_JMP_IF_FALSE] = &&L_OP_GREATER_EQUAL_JMP_IF_FALSE,
+        [OP_LESS_JMP_IF_FALSE]          = &&L_OP_LESS_JMP_IF_FALSE,
+        [OP_LESS_EQUAL_JMP_IF_FALSE]    = &&L_OP_LESS_EQUAL_JMP_IF_FALSE,
+        [OP_GET_LOCAL_ADD_CONST]        = &&L_OP_GET_LOCAL_ADD_CONST,
+        [OP_GET_LOCAL_SUB_CONST]        = &&L_OP_GET_LOCAL_SUB_CONST,
+        [OP_ADD_NUM]                    = &&L_OP_ADD_NUM,
+        [OP_ADD_STR]                    = &&L_OP_ADD_STR,
+        [OP_EQUAL_NUM]                  = &&L_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM]              = &&L_OP_NOT_EQUAL_NUM,
+        [OP_ADD_ANY]                    = &&L_OP_ADD_ANY,
+        [OP_EQUAL_ANY]                  = &&L_OP_EQUAL_ANY,
+        [OP_NOT_EQUAL_ANY]              = &&L_OP_NOT_EQUAL_ANY,
+    };
+
+#define DISPATCH()                                      \
+    do {                                                \
+        TRACE_EXEC();                                   \
+        goto *dispatch_table[READ_BYTE()];              \
+    } while (false)
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(op)        L_##op
+#define NEXT            DISPATCH()
+#define END_LOOP
+#else
+#define INTERPRET_LOOP          \
+    for (;;) {                  \
+        TRACE_EXEC();           \
+        switch (READ_BYTE())
+#define CASE(op)        case op
+#define NEXT            break
+#define END_LOOP        }
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push (constant);
-                break;
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push (vm, constant);
+            NEXT;
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = READ_CONSTANT_LONG();
+            push (vm, constant);
+            NEXT;
+        }
+        CASE(OP_NIL): push(vm, NIL_VAL); NEXT;
+        CASE(OP_TRUE): push(vm, BOOL_VAL(true)); NEXT;
+        CASE(OP_FALSE): push(vm, BOOL_VAL(false)); NEXT;
+        CASE(OP_POP): pop (vm); NEXT;
+        CASE(OP_EQUAL): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(OP_EQUAL_NUM);
+            push (vm, BOOL_VAL(values_equal (a, b)));
+            NEXT;
+        }
+        CASE(OP_NOT_EQUAL): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(OP_NOT_EQUAL_NUM);
+            push (vm, BOOL_VAL(!values_equal (a, b)));
+            NEXT;
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            Global *global = READ_GLOBAL();
+            global->val = peek (vm, 0);
+            GC_SHADE(vm, global->val);
+            pop (vm);
+            NEXT;
+        }
+        CASE(OP_GET_GLOBAL): {
+            Global *global = READ_GLOBAL();
+            if (IS_UNDEFINED(global->val)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", 
+                              global->name->chars);
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop (); break;
-            case OP_EQUAL: {
-                Value b = pop ();
-                Value a = pop ();
-                push (BOOL_VAL(values_equal (a, b)));
-                break;
+            push (vm, global->val);
+            NEXT;
+        }
+        CASE(OP_SET_GLOBAL): {
+            Global *global = READ_GLOBAL();
+            if (IS_UNDEFINED(global->val)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", 
+                              global->name->chars);
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                table_set (&vm.globals, name, peek (0));
-                pop ();
-                break;
+            global->val = peek (vm, 0);
+            GC_SHADE(vm, global->val);
+            NEXT;
+        }
+        /* Accesses the current frame's slots array, which means
+           it accesses the given numbered slot relative to the 
+           beginning of that frame. */
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push (vm, frame->slots[slot]);
+            NEXT;
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek (vm, 0);
+            NEXT;
+        }
+        CASE(OP_GREATER):       BINARY_OP(BOOL_VAL, >); NEXT;
+        CASE(OP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); NEXT;
+        CASE(OP_LESS):          BINARY_OP(BOOL_VAL, <); NEXT;
+        CASE(OP_LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=); NEXT;
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(peek(vm, 0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value val;
-                if (!table_get (&vm.globals, name, &val)) {
-                    runtime_error ("Undefined variable '%s'.", 
-                                   name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push (val);
-                break;
+            push (vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+            NEXT;
+        CASE(OP_ADD): {
+            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                QUICKEN(OP_ADD_STR);
+                concatenate (vm);
+            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop (vm));
+                double a = AS_NUMBER(pop (vm));
+                push (vm, NUMBER_VAL (a + b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (table_set (&vm.globals, name, peek (0))) {
-                    table_delete (&vm.globals, name);
-                    runtime_error ("Undefined variable '%s'.",
-                                   name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            NEXT;
+        }      
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT;
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT;
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); NEXT;
+        CASE(OP_NOT):
+            push (vm, BOOL_VAL(is_falsey (pop (vm))));
+            NEXT;
+        CASE(OP_PRINT): {
+            print_value (pop (vm));
+            printf ("\n");
+            NEXT;
+        }
+        CASE(OP_JMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            NEXT;
+        }
+        CASE(OP_JMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey (peek (vm, 0))) ip += offset;
+            NEXT;
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+#ifdef TRACING_JIT
+            if (--HOT_LOOP(vm, ip) == 0) {
+                HOT_LOOP(vm, ip) = TRACE_HOT_LOOP;
+                frame->ip = ip;
+                if (vm->jit_enabled && vm->trace_enabled &&
+                    trace_record (vm, frame)) {
+                    trace_run (vm, frame);
+                    ip = frame->ip;
+                    ENTER_JIT();
+                    NEXT;
                 }
-                break;
             }
-            /* Accesses the current frame's slots array, which means
-               it accesses the given numbered slot relative to the 
-               beginning of that frame. */
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push (frame->slots[slot]);
-                break;
+#endif
+#ifdef BASELINE_JIT
+            if (++frame->function->loop_count == JIT_LOOP_THRESHOLD &&
+                frame->function->jit == NULL && vm->jit_enabled) {
+                jit_compile (frame->function);
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek (0);
-                break;
+#endif
+            ENTER_JIT();
+            NEXT;
+        }
+        CASE(OP_LOOP_TRACE): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+#ifdef TRACING_JIT
+            frame->ip = ip;
+            trace_run (vm, frame);
+            ip = frame->ip;
+#endif
+            ENTER_JIT();
+            NEXT;
+        }
+        CASE(OP_CALL): {
+            int arg_count = READ_BYTE();
+            frame->ip = ip;
+            if (!call_value (vm, peek (vm, arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error ("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push (NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate ();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop ());
-                    double a = AS_NUMBER(pop ());
-                    push (NUMBER_VAL (a + b));
-                } else {
-                    runtime_error (
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }      
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                push (BOOL_VAL(is_falsey (pop ())));
-                break;
-            case OP_PRINT: {
-                print_value (pop ());
-                printf ("\n");
-                break;
+            frame = &vm->frames[vm->frame_count - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            NEXT;
+        }
+        CASE(OP_TAIL_CALL): {
+            int arg_count = READ_BYTE();
+            frame->ip = ip;
+            if (!tail_call_value (vm, peek (vm, arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ip = frame->ip;
+            ENTER_JIT();
+            NEXT;
+        }
+
+        CASE(OP_RETURN): {
+            Value result = pop (vm);
+            vm->frame_count--;
+            if (vm->frame_count == 0) {
+                /* We have finished executing the top-level code, 
+                  so the entire program is done. */
+                pop (vm);
+                return INTERPRET_OK;
+            }
+            vm->sp = frame->slots;
+            push (vm, result);
+            frame = &vm->frames[vm->frame_count - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            NEXT;
+        }
+        CASE(OP_EQUAL_JMP_IF_FALSE): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            uint16_t offset = READ_SHORT();
+            if (!values_equal (a, b)) ip += offset;
+            NEXT;
+        }
+        CASE(OP_NOT_EQUAL_JMP_IF_FALSE): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            uint16_t offset = READ_SHORT();
+            if (values_equal (a, b)) ip += offset;
+            NEXT;
+        }
+        CASE(OP_GREATER_JMP_IF_FALSE):       COMPARE_JMP_IF_FALSE(>); NEXT;
+        CASE(OP_GREATER_EQUAL_JMP_IF_FALSE): COMPARE_JMP_IF_FALSE(>=); NEXT;
+        CASE(OP_LESS_JMP_IF_FALSE):          COMPARE_JMP_IF_FALSE(<); NEXT;
+        CASE(OP_LESS_EQUAL_JMP_IF_FALSE):    COMPARE_JMP_IF_FALSE(<=); NEXT;
+        /* The compiler only fuses these when the constant is a number,
+            so the local is the only operand that needs checking. */
+        CASE(OP_GET_LOCAL_ADD_CONST): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            push (vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            NEXT;
+        }
+        CASE(OP_GET_LOCAL_SUB_CONST): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
-            case OP_JMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            push (vm, NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+            NEXT;
+        }
+        CASE(OP_ADD_NUM): {
+            if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+                DEOPTIMIZE(OP_ADD_ANY);
+                NEXT;
             }
-            case OP_JMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey (peek (0))) frame->ip += offset;
-                break;
+            double b = AS_NUMBER(pop (vm));
+            double a = AS_NUMBER(pop (vm));
+            push (vm, NUMBER_VAL(a + b));
+            NEXT;
+        }
+        CASE(OP_ADD_STR): {
+            if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) {
+                DEOPTIMIZE(OP_ADD_ANY);
+                NEXT;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            concatenate (vm);
+            NEXT;
+        }
+        CASE(OP_EQUAL_NUM): {
+            if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+                DEOPTIMIZE(OP_EQUAL_ANY);
+                NEXT;
             }
-            case OP_CALL: {
-                int arg_count = READ_BYTE();
-                if (!call_value (peek (arg_count), arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            double b = AS_NUMBER(pop (vm));
+            double a = AS_NUMBER(pop (vm));
+            push (vm, BOOL_VAL(a == b));
+            NEXT;
+        }
+        CASE(OP_NOT_EQUAL_NUM): {
+            if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+                DEOPTIMIZE(OP_NOT_EQUAL_ANY);
+                NEXT;
             }
+            double b = AS_NUMBER(pop (vm));
+            double a = AS_NUMBER(pop (vm));
+            push (vm, BOOL_VAL(a != b));
+            NEXT;
+        }
+        CASE(OP_ADD_ANY): {
+            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                concatenate (vm);
+            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                double b = AS_NUMBER(pop (vm));
+                double a = AS_NUMBER(pop (vm));
+                push (vm, NUMBER_VAL (a + b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            NEXT;
+        }
+        CASE(OP_EQUAL_ANY): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            push (vm, BOOL_VAL(values_equal (a, b)));
+            NEXT;
+        }
+        CASE(OP_NOT_EQUAL_ANY): {
+            Value b = pop (vm);
+            Value a = pop (vm);
+            push (vm, BOOL_VAL(!values_equal (a, b)));
+            NEXT;
+        }
+    }
+    END_LOOP
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_GLOBAL
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef ENTER_JIT
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef COMPARE_JMP_IF_FALSE
+#undef TRACE_EXEC
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+#undef END_LOOP
+}
 
-            case OP_RETURN: {
-                Value result = pop ();
-                vm.frame_count--;
-                if (vm.frame_count == 0) {
-                    /* We have finished executing the top-level code, 
-                      so the entire program is done. */
-                    pop ();
-                    return INTERPRET_OK;
-                }
-                vm.sp = frame->slots;
-                push (result);
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+/* ##################################################################################### */
+
+/* In register mode a frame owns UINT8_COUNT slots and keeps sp above
+    the registers its code uses. Registers past the arguments start
+    out nil. */
+static void reserve_registers (VM *vm, CallFrame *frame, int arg_count) {
+    Value *top = frame->slots + frame->function->reg_count;
+    for (Value *reg = frame->slots + arg_count + 1; reg < top; reg++) {
+        *reg = NIL_VAL;
+    }
+    vm->sp = top;
+}
+
+/* ##################################################################################### */
+
+/* Same as run () for register code. Instructions name their operands
+    directly in the frame's slots, so there is no pushing and popping. */
+static InterpretRes run_registers (VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    register uint8_t *ip = frame->ip;
+    register Value *regs = frame->slots;
+
+#define READ_BYTE()     (*ip++)
+#define READ_CONSTANT() (frame->function->c.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, frame->function->c.constants.values[(ip[-3] << 16) | \
+                                                  (ip[-2] << 8) | ip[-1]])
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_GLOBAL()   (&vm->globals[READ_SHORT()])
+#define REG()           (regs[READ_BYTE()])
+#define LOAD_FRAME()                                      \
+    do {                                                  \
+        frame = &vm->frames[vm->frame_count - 1];         \
+        ip = frame->ip;                                   \
+        regs = frame->slots;                              \
+    } while (false)
+#define RUNTIME_ERROR(...)                                \
+    do {                                                  \
+        frame->ip = ip;                                   \
+        runtime_error (vm, __VA_ARGS__);                  \
+        return INTERPRET_RUNTIME_ERROR;                   \
+    } while (false)
+#define BINARY_OP(value_type, op)                         \
+    do {                                                  \
+        Value *a = &REG();                                \
+        Value b = REG();                                  \
+        Value c = REG();                                  \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) {             \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        *a = value_type(AS_NUMBER(b) op AS_NUMBER(c));    \
+    } while (false)
+#define COMPARE_JMP_IF_FALSE(op)                          \
+    do {                                                  \
+        Value b = REG();                                  \
+        Value c = REG();                                  \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) {             \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        }                                                 \
+        uint16_t offset = READ_SHORT();                   \
+        if (!(AS_NUMBER(b) op AS_NUMBER(c))) ip += offset;\
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXEC
+#define TRACE_EXEC()                                                    \
+    do {                                                                \
+        printf ("       ");                                             \
+        for (Value *slot = regs; slot < vm->sp; slot++) {               \
+            printf ("[ ");                                              \
+            print_value (*slot);                                        \
+            printf (" ]");                                              \
+        }                                                               \
+        printf ("\n");                                                  \
+        disassemble_instruction (vm, &frame->function->c,               \
+                        (int) (ip - frame->function->c.code));          \
+    } while (false)
+#else
+#define TRACE_EXEC() do {} while (false)
+#endif
+
+#ifdef THREADED_DISPATCH
+    static void *dispatch_table[] = {
+        [ROP_MOVE]          = &&L_ROP_MOVE,
+        [ROP_CONSTANT]      = &&L_ROP_CONSTANT,
+        [ROP_CONSTANT_LONG] = &&L_ROP_CONSTANT_LONG,
+        [ROP_NIL]           = &&L_ROP_NIL,
+        [ROP_TRUE]          = &&L_ROP_TRUE,
+        [ROP_FALSE]         = &&L_ROP_FALSE,
+        [ROP_DEFINE_GLOBAL] = &&L_ROP_DEFINE_GLOBAL,
+        [ROP_GET_GLOBAL]    = &&L_ROP_GET_GLOBAL,
+        [ROP_SET_GLOBAL]    = &&L_ROP_SET_GLOBAL,
+        [ROP_EQUAL]         = &&L_ROP_EQUAL,
+        [ROP_NOT_EQUAL]     = &&L_ROP_NOT_EQUAL,
+        [ROP_GREATER]       = &&L_ROP_GREATER,
+        [ROP_GREATER_EQUAL] = &&L_ROP_GREATER_EQUAL,
+        [ROP_LESS]          = &&L_ROP_LESS,
+        [ROP_LESS_EQUAL]    = &&L_ROP_LESS_EQUAL,
+        [ROP_ADD]           = &&L_ROP_ADD,
+        [ROP_SUBTRACT]      = &&L_ROP_SUBTRACT,
+        [ROP_MULTIPLY]      = &&L_ROP_MULTIPLY,
+        [ROP_DIVIDE]        = &&L_ROP_DIVIDE,
+        [ROP_ADD_CONST]     = &&L_ROP_ADD_CONST,
+        [ROP_SUB_CONST]     = &&L_ROP_SUB_CONST,
+        [ROP_NEGATE]        = &&L_ROP_NEGATE,
+        [ROP_NOT]           = &&L_ROP_NOT,
+        [ROP_PRINT]         = &&L_ROP_PRINT,
+        [ROP_JMP]           = &&L_ROP_JMP,
+        [ROP_JMP_IF_FALSE]  = &&L_ROP_JMP_IF_FALSE,
+        [ROP_LOOP]          = &&L_ROP_LOOP,
+        [ROP_EQUAL_JMP_IF_FALSE]         = &&L_ROP_EQUAL_JMP_IF_FALSE,
+        [ROP_NOT_EQUAL_JMP_IF_FALSE]     = &&L_ROP_NOT_EQUAL_JMP_IF_FALSE,
+        [ROP_GREATER_JMP_IF_FALSE]       = &&L_ROP_GREATER_JMP_IF_FALSE,
+        [ROP_GREATER_EQUAL_JMP_IF_FALSE] = &&L_ROP_GREATER_EQUAL_JMP_IF_FALSE,
+        [ROP_LESS_JMP_IF_FALSE]          = &&L_ROP_LESS_JMP_IF_FALSE,
+        [ROP_LESS_EQUAL_JMP_IF_FALSE]    = &&L_ROP_LESS_EQUAL_JMP_IF_FALSE,
+        [ROP_CALL]          = &&L_ROP_CALL,
+        [ROP_TAIL_CALL]     = &&L_ROP_TAIL_CALL,
+        [ROP_RETURN]        = &&L_ROP_RETURN,
+    };
+
+#define DISPATCH()                                      \
+    do {                                                \
+        TRACE_EXEC();                                   \
+        goto *dispatch_table[READ_BYTE()];              \
+    } while (false)
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(op)        L_##op
+#define NEXT            DISPATCH()
+#define END_LOOP
+#else
+#define INTERPRET_LOOP          \
+    for (;;) {                  \
+        TRACE_EXEC();           \
+        switch (READ_BYTE())
+#define CASE(op)        case op
+#define NEXT            break
+#define END_LOOP        }
+#endif
+
+    INTERPRET_LOOP {
+        CASE(ROP_MOVE): {
+            Value *a = &REG();
+            *a = REG();
+            NEXT;
+        }
+        CASE(ROP_CONSTANT): {
+            Value *a = &REG();
+            *a = READ_CONSTANT();
+            NEXT;
+        }
+        CASE(ROP_CONSTANT_LONG): {
+            Value *a = &REG();
+            *a = READ_CONSTANT_LONG();
+            NEXT;
+        }
+        CASE(ROP_NIL):   REG() = NIL_VAL; NEXT;
+        CASE(ROP_TRUE):  REG() = BOOL_VAL(true); NEXT;
+        CASE(ROP_FALSE): REG() = BOOL_VAL(false); NEXT;
+        CASE(ROP_DEFINE_GLOBAL): {
+            Value a = REG();
+            READ_GLOBAL()->val = a;
+            GC_SHADE(vm, a);
+            NEXT;
+        }
+        CASE(ROP_GET_GLOBAL): {
+            Value *a = &REG();
+            Global *global = READ_GLOBAL();
+            if (IS_UNDEFINED(global->val)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", 
+                              global->name->chars);
+            }
+            *a = global->val;
+            NEXT;
+        }
+        CASE(ROP_SET_GLOBAL): {
+            Value a = REG();
+            Global *global = READ_GLOBAL();
+            if (IS_UNDEFINED(global->val)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", 
+                              global->name->chars);
+            }
+            global->val = a;
+            GC_SHADE(vm, a);
+            NEXT;
+        }
+        CASE(ROP_EQUAL): {
+            Value *a = &REG();
+            Value b = REG();
+            Value c = REG();
+            *a = BOOL_VAL(values_equal (b, c));
+            NEXT;
+        }
+        CASE(ROP_NOT_EQUAL): {
+            Value *a = &REG();
+            Value b = REG();
+            Value c = REG();
+            *a = BOOL_VAL(!values_equal (b, c));
+            NEXT;
+        }
+        CASE(ROP_GREATER):       BINARY_OP(BOOL_VAL, >); NEXT;
+        CASE(ROP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); NEXT;
+        CASE(ROP_LESS):          BINARY_OP(BOOL_VAL, <); NEXT;
+        CASE(ROP_LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=); NEXT;
+        CASE(ROP_ADD): {
+            Value *a = &REG();
+            Value b = REG();
+            Value c = REG();
+            if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                *a = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+            } else if (IS_STRING(b) && IS_STRING(c)) {
+                *a = OBJ_VAL(concat_strings (vm, AS_STRING(b), AS_STRING(c)));
+                GC_SAFEPOINT(vm);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            NEXT;
+        }
+        CASE(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT;
+        CASE(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT;
+        CASE(ROP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); NEXT;
+        /* The constant is always a number, as with the stack code's
+            OP_GET_LOCAL_ADD_CONST. */
+        CASE(ROP_ADD_CONST): {
+            Value *a = &REG();
+            Value b = REG();
+            Value k = READ_CONSTANT();
+            if (!IS_NUMBER(b)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            *a = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(k));
+            NEXT;
+        }
+        CASE(ROP_SUB_CONST): {
+            Value *a = &REG();
+            Value b = REG();
+            Value k = READ_CONSTANT();
+            if (!IS_NUMBER(b)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            *a = NUMBER_VAL(AS_NUMBER(b) - AS_NUMBER(k));
+            NEXT;
+        }
+        CASE(ROP_NEGATE): {
+            Value *a = &REG();
+            Value b = REG();
+            if (!IS_NUMBER(b)) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            *a = NUMBER_VAL(-AS_NUMBER(b));
+            NEXT;
+        }
+        CASE(ROP_NOT): {
+            Value *a = &REG();
+            *a = BOOL_VAL(is_falsey (REG()));
+            NEXT;
+        }
+        CASE(ROP_PRINT): {
+            print_value (REG());
+            printf ("\n");
+            NEXT;
+        }
+        CASE(ROP_JMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            NEXT;
+        }
+        CASE(ROP_JMP_IF_FALSE): {
+            Value a = REG();
+            uint16_t offset = READ_SHORT();
+            if (is_falsey (a)) ip += offset;
+            NEXT;
+        }
+        CASE(ROP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            NEXT;
+        }
+        CASE(ROP_EQUAL_JMP_IF_FALSE): {
+            Value b = REG();
+            Value c = REG();
+            uint16_t offset = READ_SHORT();
+            if (!values_equal (b, c)) ip += offset;
+            NEXT;
+        }
+        CASE(ROP_NOT_EQUAL_JMP_IF_FALSE): {
+            Value b = REG();
+            Value c = REG();
+            uint16_t offset = READ_SHORT();
+            if (values_equal (b, c)) ip += offset;
+            NEXT;
+        }
+        CASE(ROP_GREATER_JMP_IF_FALSE):       COMPARE_JMP_IF_FALSE(>); NEXT;
+        CASE(ROP_GREATER_EQUAL_JMP_IF_FALSE): COMPARE_JMP_IF_FALSE(>=); NEXT;
+        CASE(ROP_LESS_JMP_IF_FALSE):          COMPARE_JMP_IF_FALSE(<); NEXT;
+        CASE(ROP_LESS_EQUAL_JMP_IF_FALSE):    COMPARE_JMP_IF_FALSE(<=); NEXT;
+        /* The callee and its arguments sit in registers A and up, which
+            is where call_value () expects them on top of the stack. */
+        CASE(ROP_CALL): {
+            uint8_t a = READ_BYTE();
+            int arg_count = READ_BYTE();
+            int frame_count = vm->frame_count;
+            frame->ip = ip;
+            vm->sp = regs + a + arg_count + 1;
+            if (!call_value (vm, regs[a], arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            if (vm->frame_count == frame_count) {
+                vm->sp = regs + frame->function->reg_count;
+            } else {
+                reserve_registers (vm, frame, arg_count);
             }
+            NEXT;
+        }
+        CASE(ROP_TAIL_CALL): {
+            uint8_t a = READ_BYTE();
+            int arg_count = READ_BYTE();
+            bool replaces_frame = IS_FUNCTION(regs[a]);
+            frame->ip = ip;
+            vm->sp = regs + a + arg_count + 1;
+            if (!tail_call_value (vm, regs[a], arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ip = frame->ip;
+            if (replaces_frame) {
+                reserve_registers (vm, frame, arg_count);
+            } else {
+                vm->sp = regs + frame->function->reg_count;
+            }
+            NEXT;
+        }
+        CASE(ROP_RETURN): {
+            Value result = REG();
+            vm->frame_count--;
+            if (vm->frame_count == 0) {
+                vm->sp = vm->stack;
+                return INTERPRET_OK;
+            }
+            /* Slot 0 of the callee is register A of the caller's call. */
+            regs[0] = result;
+            LOAD_FRAME();
+            vm->sp = regs + frame->function->reg_count;
+            NEXT;
         }
     }
+    END_LOOP
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_GLOBAL
+#undef REG
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef COMPARE_JMP_IF_FALSE
+#undef TRACE_EXEC
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+#undef END_LOOP
 }
 
 /* ##################################################################################### */
 
-InterpretRes interpret (const char *source) {
-    ObjFunction *function = compile (source);
+/* Runs FUNCTION, the compiled top level of a script. */
+InterpretRes interpret_function (VM *vm, ObjFunction *function) {
+    push(vm, OBJ_VAL(function));
+    /* Set up call frame for code executed at top level. */
+    call (vm, function, 0);
+    if (vm->register_mode) {
+        reserve_registers (vm, &vm->frames[0], 0);
+        return run_registers (vm);
+    }
+    return run (vm);
+}
+
+/* ##################################################################################### */
+
+InterpretRes interpret (VM *vm, const char *source, size_t len) {
+    ObjFunction *function = compile (vm, source, len);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    /* Set up call frame for code executed at top level. */
-    call (function, 0);
-    return run ();
+    return interpret_function (vm, function);
 }
 
 /* ##################################################################################### */
\ No newline at end of file
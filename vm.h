@@ -1,16 +1,29 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "chunk.h"
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 
 /* ##################################################################################### */
 
 #define UINT8_COUNT (UINT8_MAX + 1)
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/* Default limit on the call depth, see vm.max_frames. */
+#define FRAMES_MAX 4096
+/* Both stacks start out this small and grow on demand. */
+#define FRAMES_INITIAL 8
+/* Code refers to globals by 16-bit slot. */
+#define GLOBALS_MAX (UINT16_MAX + 1)
+/* Counters of the loops on their way to a trace, see HOT_LOOP (). */
+#define HOT_LOOP_SLOTS 64
+#define STACK_INITIAL (2 * UINT8_COUNT)
+/* Power-of-two buckets of the pause histograms, see --gc-stats. */
+#define GC_HISTOGRAM_BUCKETS 24
 
 /* ##################################################################################### */
 
@@ -24,16 +37,103 @@ typedef struct {
 
 /* ##################################################################################### */
 
+/* A global variable. The compiler resolves every global name to the
+    index of one of these, so the VM never hashes names at runtime. */
+typedef struct {
+    ObjString *name;
+    Value val;              /* UNDEFINED_VAL until the global is defined. */
+}   Global;
+
+/* ##################################################################################### */
+
+/* Where the incremental collector is, see run_collection (). */
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+}   GcPhase;
+
+/* ##################################################################################### */
+
+/* Objects that are marked but whose references are not yet. */
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    Obj **objects;
+    int count;
+    int capacity;
+}   GrayStack;
+
+/* ##################################################################################### */
+
+/* All state of one interpreter. Nothing is shared between VMs, so each
+    thread can run its own. */
+struct VM {
+    CallFrame *frames;
     int frame_count;
+    int frame_capacity;
+    int max_frames;         /* Deeper calls are a stack overflow. */
 
-    Value stack[STACK_MAX]; 
+    /* Grows by moving, so pointers into it only live in the frames and
+        in sp, where grow_stack () fixes them up. */
+    Value *stack;
+    int stack_capacity;
     Value *sp;              /* Points to the top of stack. */
-    Table globals;          /* Global variables. */
+    Global *globals;        /* Global variables, indexed by slot. */
+    int global_count;
+    int global_capacity;
+    Table global_slots;     /* Maps global names to their slot. */
     Table strings;          /* Used for string interning. */
-    Obj *objects;           /* Used in garbage collection. */
-}   VM;
+    Obj *objects;           /* Every object, for the sweep. */
+    SlabPool slabs;         /* Where objects live. */
+    size_t bytes_allocated; /* Held by objects, see gc_reallocate (). */
+    size_t next_gc;         /* Collect once bytes_allocated passes this. */
+    uint8_t *nursery;       /* Young objects, see allocate_young (). */
+    uint8_t *nursery_top;   /* Next free byte of the nursery. */
+    bool nursery_full;      /* Collect it at the next safepoint. */
+    Obj **remembered;       /* Old objects that may point into the nursery. */
+    int remembered_count;
+    int remembered_capacity;
+    GcPhase gc_phase;
+    bool mark_sense;        /* What is_marked of a black object is. */
+    Obj **sweep_link;       /* Points at the next object to sweep. */
+    /* The background sweep has these to itself while vm->sweeping. */
+    Obj *sweep_list;        /* The objects it is on, then the survivors. */
+    Obj *dead_strings;      /* Left for sweep () to take out of the
+                               string table. */
+    size_t sweep_freed;     /* Bytes it freed. */
+    SlabPool swept;         /* Blocks it freed. */
+    bool sweeping;
+    atomic_bool sweep_done; /* Set by it once it is through. */
+    pthread_t sweeper;
+    size_t next_slice;      /* Next slice once bytes_allocated gets here. */
+    int gc_budget;          /* Work per slice, see --gc-budget. */
+    int gc_threads;         /* Threads a collection may use, this one
+                               included, see --gc-threads. */
+    struct Markers *markers; /* The other marking threads. */
+    GrayStack gray;
+    uint64_t major_pauses[GC_HISTOGRAM_BUCKETS];
+    uint64_t minor_pauses[GC_HISTOGRAM_BUCKETS];
+    ValueArray roots;       /* Values the embedder holds on to, which are
+                               only reachable from C. */
+    struct Parser *compiling; /* The innermost compile running on the
+                                 VM's own thread, for its roots. */
+    bool jit_enabled;       /* Cleared by --no-jit. */
+    bool trace_enabled;     /* Cleared by --no-trace. */
+    uint8_t hot_loops[HOT_LOOP_SLOTS]; /* Counting down to a trace. */
+    bool register_mode;     /* Set by --registers: functions are compiled
+                               to register code and run by 
+                               run_registers (). */
+    bool lazy_compile;      /* Set by --lazy: function bodies are only
+                               compiled when first called. */
+    /* Set while compile_parallel () runs. The compiler threads share
+        objects, strings and globals, so those locks are only taken
+        then, and nothing is collected. */
+    bool parallel;
+    pthread_mutex_t objects_lock;
+    pthread_mutex_t strings_lock;
+    pthread_mutex_t globals_lock;
+    CallFrame *jit_frame;   /* The frame native code is running in. */
+    int jit_nesting;        /* Native calls nested on the C stack. */
+};
 
 /* ##################################################################################### */
 
@@ -45,22 +145,44 @@ typedef enum {
 
 /* ##################################################################################### */
 
-extern VM vm;
+/* Takes LOCK of VM if other threads may be compiling. */
+#define VM_LOCK(vm, lock) \
+    do { if ((vm)->parallel) pthread_mutex_lock (&(vm)->lock); } while (false)
+#define VM_UNLOCK(vm, lock) \
+    do { if ((vm)->parallel) pthread_mutex_unlock (&(vm)->lock); } while (false)
 
 /* ##################################################################################### */
 
-/* VM stuff. */
-void init_VM();
-void free_VM();
+/* VM stuff. An embedder owns the VM struct and passes it to every
+    call; init_VM () also defines the natives. */
+void init_VM (VM *vm);
+void free_VM (VM *vm);
+void define_native (VM *vm, const char *name, NativeFn function);
+void add_root (VM *vm, Value val);
+void remove_root (VM *vm, Value val);
 
 /* ##################################################################################### */
 
-InterpretRes interpret (const char *source);
+InterpretRes interpret (VM *vm, const char *source, size_t len);
+InterpretRes interpret_function (VM *vm, ObjFunction *function);
+int global_slot (VM *vm, ObjString *name);
 
 /* ##################################################################################### */
 
 /* Stack operations. */
-void push (Value val);
-Value pop ();
+void push (VM *vm, Value val);
+Value pop (VM *vm);
+
+/* ##################################################################################### */
+
+/* Shared with the native code emitted by the JIT. */
+void runtime_error (VM *vm, const char *format, ...);
+bool call_value (VM *vm, Value callee, int arg_count);
+bool tail_call_value (VM *vm, Value callee, int arg_count);
+void concatenate (VM *vm);
+
+static inline bool is_falsey (Value val) {
+    return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
+}
 
 #endif
\ No newline at end of file